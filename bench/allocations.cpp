@@ -0,0 +1,256 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+
+// Motion Capture
+#include <libmotioncapture/motioncapture.h>
+#ifdef ENABLE_OPTITRACK
+#include "natnet_server.h"
+#endif
+
+// Checks that steady-state frame processing does not allocate: counts heap
+// allocations (global operator new and, with glibc, malloc()) in all threads
+// while frames are received after a warm-up. Exits with 1 if any scenario
+// allocated.
+
+namespace {
+
+  std::atomic<bool> counting(false);
+  std::atomic<size_t> allocations(0);
+
+  void record()
+  {
+    if (counting.load(std::memory_order_relaxed)) {
+      allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void* allocate(size_t size)
+  {
+#ifndef __GLIBC__
+    record(); // otherwise counted by malloc() below
+#endif
+    void* p = std::malloc(size > 0 ? size : 1);
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+
+} // namespace
+
+// Eigen allocates with malloc() and realloc() rather than operator new, so
+// with glibc these are counted as well
+#ifdef __GLIBC__
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t count, size_t size);
+  void* __libc_realloc(void* p, size_t size);
+  void __libc_free(void* p);
+
+  void* malloc(size_t size)
+  {
+    record();
+    return __libc_malloc(size);
+  }
+
+  void* calloc(size_t count, size_t size)
+  {
+    record();
+    return __libc_calloc(count, size);
+  }
+
+  void* realloc(void* p, size_t size)
+  {
+    record();
+    return __libc_realloc(p, size);
+  }
+
+  void free(void* p)
+  {
+    __libc_free(p);
+  }
+}
+#endif
+
+void* operator new(size_t size)
+{
+  return allocate(size);
+}
+
+void* operator new[](size_t size)
+{
+  return allocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+  try {
+    return allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+  try {
+    return allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+using namespace libmotioncapture;
+
+namespace {
+
+  const size_t WARMUP_FRAMES = 100;
+  const size_t FRAMES = 1000;
+
+  // keeps the compiler from discarding the consumed values
+  volatile float sink;
+
+  // what a typical real-time loop does with every frame
+  float consume(MotionCapture& mocap)
+  {
+    float sum = 0;
+    for (const auto& item : mocap.rigidBodies()) {
+      sum += item.second.position()(0);
+    }
+    sum += mocap.pointCloud().sum();
+    for (const auto& latency : mocap.latency()) {
+      sum += latency.value();
+    }
+    const Frame& frame = mocap.latestFrame();
+    for (size_t i = 0; i < frame.size(); ++i) {
+      sum += frame.velocity(i)(0);
+    }
+    return sum;
+  }
+
+  // Runs 'step' (which receives one frame) for the warm-up and then counts
+  // the allocations of FRAMES more steps, continuing for at least 'duration'
+  // so that periodic background work (like keep-alives) is included
+  template<typename F>
+  bool check(
+    const std::string& name,
+    MotionCapture& mocap,
+    F step,
+    std::chrono::milliseconds duration = std::chrono::milliseconds(0))
+  {
+    float sum = 0;
+    for (size_t i = 0; i < WARMUP_FRAMES; ++i) {
+      step();
+      sum += consume(mocap);
+    }
+    allocations = 0;
+    counting = true;
+    const auto end = std::chrono::steady_clock::now() + duration;
+    size_t frames = 0;
+    while (frames < FRAMES || std::chrono::steady_clock::now() < end) {
+      step();
+      sum += consume(mocap);
+      ++frames;
+    }
+    counting = false;
+    sink = sum;
+    const size_t count = allocations;
+    std::printf("%-40s %6zu allocations in %zu frames\n", name.c_str(), count, frames);
+    return count == 0;
+  }
+
+  std::map<std::string, std::string> mockConfig()
+  {
+    std::map<std::string, std::string> cfg;
+    cfg["frequency"] = "10000";
+    cfg["history"] = "100";
+    cfg["velocity"] = "1";
+    std::string rigidBodies;
+    for (int i = 0; i < 20; ++i) {
+      // longer than any small string buffer
+      rigidBodies += (i > 0 ? ";rigid_body_with_a_long_name_" : "rigid_body_with_a_long_name_")
+        + std::to_string(i) + "(0.1,0.2,0.3,1,0,0,0)";
+    }
+    cfg["rigid_bodies"] = rigidBodies;
+    cfg["pointcloud"] = "0,0,1;0,1,0;1,0,0";
+    return cfg;
+  }
+
+  bool checkMock()
+  {
+    bool ok = true;
+    std::map<std::string, std::string> cfg = mockConfig();
+    for (const char* policy : {"latest", "all"}) {
+      cfg["delivery_policy"] = policy;
+      std::unique_ptr<MotionCapture> mocap(MotionCapture::connect("mock", cfg));
+      float sum = 0;
+      mocap->setFrameCallback([&sum](const Frame& frame) { sum += frame.position(0)(0); });
+      ok &= check(std::string("mock/") + policy, *mocap, [&]() { mocap->waitForNextFrame(); });
+    }
+
+    cfg["delivery_policy"] = "latest";
+    cfg["threaded"] = "1";
+    std::unique_ptr<MotionCapture> mocap(MotionCapture::connect("mock", cfg));
+    ok &= check("mock/threaded", *mocap, [&]() { mocap->waitForNextFrame(); });
+    return ok;
+  }
+
+#ifdef ENABLE_OPTITRACK
+  bool checkOptitrack()
+  {
+    bool ok = true;
+    for (const char* policy : {"latest", "all"}) {
+      bench::NatNetServer server(4, 1, 20, 500);
+      std::map<std::string, std::string> cfg;
+      cfg["hostname"] = "127.0.0.1";
+      cfg["port_command"] = std::to_string(server.commandPort());
+      cfg["delivery_policy"] = policy;
+      cfg["history"] = "100";
+      cfg["velocity"] = "1";
+      std::unique_ptr<MotionCapture> mocap(MotionCapture::connect("optitrack", cfg));
+      // lockstep: every frame is sent before it is waited for; runs over
+      // several keep-alive periods of the command channel (1 s)
+      ok &= check(std::string("optitrack/") + policy, *mocap, [&]() {
+        server.sendFrame();
+        mocap->waitForNextFrame();
+      }, std::chrono::milliseconds(3500));
+    }
+    return ok;
+  }
+#endif
+
+} // namespace
+
+int main()
+{
+  bool ok = checkMock();
+#ifdef ENABLE_OPTITRACK
+  ok &= checkOptitrack();
+#endif
+  return ok ? 0 : 1;
+}
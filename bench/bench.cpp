@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Motion Capture
+#include <libmotioncapture/motioncapture.h>
+#include <libmotioncapture/mock.h>
+#include <libmotioncapture/natnet.h>
+#ifdef ENABLE_QUALISYS
+#include <libmotioncapture/qualisys.h>
+#endif
+#ifdef ENABLE_FZMOTION
+#include <libmotioncapture/fzmotion.h>
+#endif
+
+#include "natnet_packets.h"
+
+// Microbenchmarks of the parsing and conversion hot paths. Prints the median
+// time per call of several runs.
+//
+//   motioncapture_bench [filter]
+//     runs the benchmarks whose name contains 'filter' on synthetic inputs
+//   motioncapture_bench --natnet <major>.<minor> <packet>...
+//     decodes recorded NatNet frames, one raw datagram (including its 4 byte
+//     header) per file
+
+using namespace libmotioncapture;
+
+namespace {
+
+  const size_t BODY_COUNTS[] = {1, 10, 100, 500};
+  const size_t MARKER_COUNTS[] = {0, 100, 1000, 5000};
+
+  // keeps the compiler from discarding the benchmarked work
+  volatile float sink;
+
+  // Calls 'f' repeatedly, in runs of at least 10 ms, and returns the median
+  // time per call in nanoseconds
+  template<typename F>
+  double measure(F f)
+  {
+    const uint64_t minRun = 10000000;
+    size_t iterations = 1;
+    while (true) {
+      const uint64_t start = hostTime();
+      for (size_t i = 0; i < iterations; ++i) {
+        f();
+      }
+      const uint64_t elapsed = hostTime() - start;
+      if (elapsed >= minRun) {
+        break;
+      }
+      iterations *= elapsed > 0 ? std::min<uint64_t>(10, 2 * minRun / elapsed + 1) : 10;
+    }
+
+    std::vector<double> runs;
+    for (int run = 0; run < 5; ++run) {
+      const uint64_t start = hostTime();
+      for (size_t i = 0; i < iterations; ++i) {
+        f();
+      }
+      runs.push_back((hostTime() - start) / (double)iterations);
+    }
+    std::sort(runs.begin(), runs.end());
+    return runs[runs.size() / 2];
+  }
+
+  class Bench
+  {
+  public:
+    explicit Bench(const std::string& filter)
+      : m_filter(filter)
+    {
+      printf("%-52s %14s %10s\n", "benchmark", "time/call", "MB/s");
+    }
+
+    bool enabled(const std::string& name) const
+    {
+      return name.find(m_filter) != std::string::npos;
+    }
+
+    // 'bytes' is the size of the input of one call (0 if not meaningful)
+    template<typename F>
+    void run(const std::string& name, size_t bytes, F f)
+    {
+      if (!enabled(name)) {
+        return;
+      }
+      const double ns = measure(f);
+      if (bytes > 0) {
+        printf("%-52s %11.0f ns %10.1f\n", name.c_str(), ns, bytes * 1e3 / ns);
+      } else {
+        printf("%-52s %11.0f ns %10s\n", name.c_str(), ns, "-");
+      }
+      fflush(stdout);
+    }
+
+  private:
+    std::string m_filter;
+  };
+
+  std::string sizeName(size_t bodies, size_t markers)
+  {
+    return "/bodies:" + std::to_string(bodies) + "/markers:" + std::to_string(markers);
+  }
+
+  // consumes a decoded frame like a client would
+  class SumVisitor : public NatNetFrameVisitor
+  {
+  public:
+    SumVisitor()
+      : sum(0)
+    {
+    }
+
+    virtual void marker(float x, float y, float z)
+    {
+      sum += x + y + z;
+    }
+
+    virtual void rigidBody(const NatNetRigidBody& rb)
+    {
+      sum += rb.x + rb.qw;
+    }
+
+    float sum;
+  };
+
+  void benchNatNetDecode(Bench& bench)
+  {
+    const int versions[][2] = {{2, 9}, {3, 1}, {4, 1}};
+    for (const auto& version : versions) {
+      const NatNetFrameDecoder decoder(version[0], version[1]);
+      for (size_t bodies : BODY_COUNTS) {
+        for (size_t markers : MARKER_COUNTS) {
+          const std::string name = "natnet_decode/" + std::to_string(version[0])
+            + "." + std::to_string(version[1]) + sizeName(bodies, markers);
+          const std::vector<char> packet = bench::makeFrameOfData(
+            version[0], version[1], 1, bodies, markers);
+          bench.run(name, packet.size(), [&]() {
+            SumVisitor visitor;
+            if (!decoder.decode(packet.data(), packet.size(), visitor)) {
+              throw std::runtime_error("Synthetic frame rejected");
+            }
+            sink = visitor.sum;
+          });
+        }
+      }
+    }
+  }
+
+  // rigidBodies() and pointCloud() are implemented by MotionCapture on the
+  // Frame that every backend fills, so they are measured on a mock
+  void benchConversion(Bench& bench)
+  {
+    for (size_t bodies : BODY_COUNTS) {
+      for (size_t markers : MARKER_COUNTS) {
+        std::vector<RigidBody> objects;
+        for (size_t i = 0; i < bodies; ++i) {
+          objects.emplace_back("rb" + std::to_string(i + 1),
+            Eigen::Vector3f(0.01f * i, 0.5f, 1.0f), Eigen::Quaternionf::Identity());
+        }
+        PointCloud pointCloud(markers, 3);
+        pointCloud.setOnes();
+
+        MotionCaptureMock mocap(0, objects, pointCloud);
+        mocap.waitForNextFrame();
+
+        bench.run("rigid_bodies" + sizeName(bodies, markers), 0, [&]() {
+          const auto rigidBodies = mocap.rigidBodies();
+          sink = rigidBodies.size();
+        });
+        // copies, as bindings and most applications do
+        bench.run("point_cloud" + sizeName(bodies, markers), 0, [&]() {
+          const PointCloud copy = mocap.pointCloud();
+          sink = copy.rows();
+        });
+      }
+    }
+  }
+
+#ifdef ENABLE_FZMOTION
+  std::vector<byte> makeFZMotionData(size_t bodies, size_t markers)
+  {
+    std::vector<byte> packet;
+    auto put = [&packet](const void* value, size_t size) {
+      const byte* p = static_cast<const byte*>(value);
+      packet.insert(packet.end(), p, p + size);
+    };
+    const Message message = MotionCaptureData;
+    const uint16 dataBytes = 0;
+    const int32 frameNumber = 1;
+    const uint32 markerSets = 0;
+    const int32 markerCount = markers;
+    const uint32 bodyCount = bodies;
+    put(&message, sizeof(message));
+    put(&dataBytes, sizeof(dataBytes));
+    put(&frameNumber, sizeof(frameNumber));
+    put(&markerSets, sizeof(markerSets));
+    put(&markerCount, sizeof(markerCount));
+    for (size_t i = 0; i < markers; ++i) {
+      LMarker marker = {(uint32)i, {0.001f * i, 1.0f, 2.0f}};
+      put(&marker, sizeof(marker));
+    }
+    put(&bodyCount, sizeof(bodyCount));
+    for (size_t i = 0; i < bodies; ++i) {
+      LRigidBody rb = {(uint32)i + 1, {0.01f * i, 0.5f, 1.0f}, {0, 0, 0, 1}, 1};
+      put(&rb, sizeof(rb));
+    }
+    return packet;
+  }
+
+  void benchFZMotionParse(Bench& bench)
+  {
+    for (size_t bodies : BODY_COUNTS) {
+      for (size_t markers : MARKER_COUNTS) {
+        const std::vector<byte> packet = makeFZMotionData(bodies, markers);
+        std::vector<LMarker> allMarkers;
+        std::vector<LRigidBody> allRigidBodies;
+        int32 frameNumber;
+        bench.run("fzmotion_parse" + sizeName(bodies, markers), packet.size(), [&]() {
+          MotionCaptureFZMotion::parseData(packet.data(), frameNumber, allMarkers, allRigidBodies);
+          sink = allMarkers.size() + allRigidBodies.size();
+        });
+      }
+    }
+  }
+#endif
+
+#ifdef ENABLE_QUALISYS
+  void benchQualisysEuler(Bench& bench)
+  {
+    for (size_t bodies : BODY_COUNTS) {
+      std::vector<Eigen::Vector3f> angles;
+      for (size_t i = 0; i < bodies; ++i) {
+        angles.emplace_back(0.1f * i, 45.0f - 0.2f * i, 170.0f);
+      }
+      bench.run("qualisys_euler/bodies:" + std::to_string(bodies), 0, [&]() {
+        float sum = 0;
+        for (const auto& a : angles) {
+          sum += MotionCaptureQualisys::eulerToQuaternion(a(0), a(1), a(2)).w();
+        }
+        sink = sum;
+      });
+    }
+  }
+#endif
+
+  void benchMockConnect(Bench& bench)
+  {
+    for (size_t bodies : BODY_COUNTS) {
+      for (size_t markers : MARKER_COUNTS) {
+        std::map<std::string, std::string> cfg;
+        std::string rigidBodies;
+        for (size_t i = 0; i < bodies; ++i) {
+          rigidBodies += (i > 0 ? ";rb" : "rb") + std::to_string(i + 1) + "(0.1,0.2,0.3,1,0,0,0)";
+        }
+        std::string pointCloud;
+        for (size_t i = 0; i < markers; ++i) {
+          pointCloud += i > 0 ? ";0.1,0.2,0.3" : "0.1,0.2,0.3";
+        }
+        cfg["rigid_bodies"] = rigidBodies;
+        cfg["pointcloud"] = pointCloud;
+        bench.run("mock_connect" + sizeName(bodies, markers), rigidBodies.size() + pointCloud.size(), [&]() {
+          MotionCapture* mocap = MotionCapture::connect("mock", cfg);
+          sink = mocap->pointCloud().rows();
+          delete mocap;
+        });
+      }
+    }
+  }
+
+  int benchCorpus(const std::string& version, int argc, char** argv)
+  {
+    int major = 0, minor = 0;
+    if (std::sscanf(version.c_str(), "%d.%d", &major, &minor) != 2) {
+      std::fprintf(stderr, "Invalid NatNet version %s\n", version.c_str());
+      return 1;
+    }
+    const NatNetFrameDecoder decoder(major, minor);
+    Bench bench("");
+    for (int i = 0; i < argc; ++i) {
+      std::ifstream file(argv[i], std::ios::binary);
+      const std::vector<char> packet(
+        (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      SumVisitor check;
+      if (!file || !decoder.decode(packet.data(), packet.size(), check)) {
+        std::fprintf(stderr, "%s: not a NatNet %s frame of mocap data\n", argv[i], version.c_str());
+        return 1;
+      }
+      bench.run(std::string("natnet_decode/") + argv[i], packet.size(), [&]() {
+        SumVisitor visitor;
+        decoder.decode(packet.data(), packet.size(), visitor);
+        sink = visitor.sum;
+      });
+    }
+    return 0;
+  }
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc >= 3 && std::strcmp(argv[1], "--natnet") == 0) {
+    return benchCorpus(argv[2], argc - 3, argv + 3);
+  }
+  if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+    std::fprintf(stderr, "Use ./motioncapture_bench [filter] or ./motioncapture_bench --natnet <major>.<minor> <packet>...\n");
+    return 1;
+  }
+
+  Bench bench(argc == 2 ? argv[1] : "");
+  benchNatNetDecode(bench);
+  benchConversion(bench);
+#ifdef ENABLE_FZMOTION
+  benchFZMotionParse(bench);
+#endif
+#ifdef ENABLE_QUALISYS
+  benchQualisysEuler(bench);
+#endif
+  benchMockConnect(bench);
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Motion Capture
+#include <libmotioncapture/motioncapture.h>
+
+#include "natnet_server.h"
+
+// Measures the latency from sending a NatNet frame to the return of
+// waitForNextFrame() through the OptiTrack backend. By default a NatNetServer
+// runs in-process on the loopback interface; with 'hostname' the benchmark
+// connects to a natnet_simulator on this host instead (its frames carry the
+// send time, so it must run on the same host). Options (defaults in brackets):
+//   version          NatNet version of the in-process server [4.1]
+//   bodies           rigid bodies per frame [10]
+//   markers          markers per frame [0]
+//   rate             frames per second of the in-process server, 0 sends as
+//                    fast as possible [1000]
+//   frames           frames to measure [10000]
+//   delivery_policy  latest, all or all_with_gap_report [all]
+//   hostname         address of a natnet_simulator [in-process server]
+//   port_command     command port of the natnet_simulator [1510]
+
+using namespace libmotioncapture;
+
+namespace {
+
+  // value below which the given fraction of the sorted samples lies
+  double percentile(const std::vector<uint64_t>& sorted, double q)
+  {
+    const size_t i = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[i] / 1e3;
+  }
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  std::map<std::string, std::string> cfg;
+  cfg["version"] = "4.1";
+  cfg["bodies"] = "10";
+  cfg["markers"] = "0";
+  cfg["rate"] = "1000";
+  cfg["frames"] = "10000";
+  cfg["delivery_policy"] = "all";
+  cfg["hostname"] = "";
+  cfg["port_command"] = "1510";
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc || cfg.find(argv[i]) == cfg.end()) {
+      std::cerr << "Use ./motioncapture_latency [option1] [value1] ... (options: version, bodies, markers, rate, frames, delivery_policy, hostname, port_command)" << std::endl;
+      return 1;
+    }
+    cfg[argv[i]] = argv[i+1];
+  }
+
+  const size_t frames = std::stoul(cfg["frames"]);
+  if (frames == 0) {
+    std::cerr << "Need at least one frame" << std::endl;
+    return 1;
+  }
+  const double rate = std::stod(cfg["rate"]);
+  std::unique_ptr<bench::NatNetServer> server;
+  std::atomic<bool> stop(false);
+  std::thread sender;
+
+  std::map<std::string, std::string> clientCfg;
+  clientCfg["delivery_policy"] = cfg["delivery_policy"];
+  if (cfg["hostname"].empty()) {
+    int major = 0, minor = 0;
+    if (std::sscanf(cfg["version"].c_str(), "%d.%d", &major, &minor) != 2) {
+      std::cerr << "Invalid NatNet version " << cfg["version"] << std::endl;
+      return 1;
+    }
+    server.reset(new bench::NatNetServer(major, minor,
+      std::stoul(cfg["bodies"]), std::stoul(cfg["markers"])));
+    clientCfg["hostname"] = "127.0.0.1";
+    clientCfg["port_command"] = std::to_string(server->commandPort());
+  } else {
+    clientCfg["hostname"] = cfg["hostname"];
+    clientCfg["port_command"] = cfg["port_command"];
+  }
+
+  std::unique_ptr<MotionCapture> mocap(MotionCapture::connect("optitrack", clientCfg));
+
+  if (server) {
+    sender = std::thread([&]() {
+      const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(rate > 0 ? 1.0 / rate : 0.0));
+      auto next = std::chrono::steady_clock::now();
+      while (!stop) {
+        if (rate > 0) {
+          next += period;
+          std::this_thread::sleep_until(next);
+        }
+        server->sendFrame();
+      }
+    });
+  }
+
+  // the first frames pay for page faults and slot allocation
+  const size_t warmup = std::min<size_t>(100, frames / 10);
+  std::vector<uint64_t> latencies;
+  latencies.reserve(frames);
+  const uint64_t start = hostTime();
+  for (size_t i = 0; i < warmup + frames; ++i) {
+    if (i == warmup) {
+      latencies.clear();
+    }
+    mocap->waitForNextFrame();
+    const uint64_t now = hostTime();
+    // timeStamp() is the send time in microseconds
+    latencies.push_back(now - std::min(now, mocap->timeStamp() * 1000));
+  }
+  const uint64_t elapsed = hostTime() - start;
+
+  stop = true;
+  if (sender.joinable()) {
+    sender.join();
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  const FrameCounters counters = mocap->frameCounters();
+  const Stats stats = mocap->stats();
+  std::printf("frames: %zu in %.2f s (%.0f frames/s), dropped %llu\n",
+    latencies.size(), elapsed / 1e9, (warmup + frames) / (elapsed / 1e9),
+    (unsigned long long)counters.dropped);
+  std::printf("latency [us]: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f (1 us resolution)\n",
+    percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+    percentile(latencies, 0.999), latencies.back() / 1e3);
+  std::printf("parse [us]: mean %.2f  p99 %.2f\n",
+    stats.parseTime.mean() / 1e3, stats.parseTime.quantile(0.99) / 1e3);
+  return 0;
+}
@@ -0,0 +1,260 @@
+#pragma once
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Builders for synthetic NatNet packets (server info, model definitions and
+// frames of mocap data) in the layout of a given NatNet version
+
+namespace bench {
+
+  enum {
+    NAT_CONNECT = 0,
+    NAT_SERVERINFO = 1,
+    NAT_REQUEST = 2,
+    NAT_RESPONSE = 3,
+    NAT_REQUEST_MODELDEF = 4,
+    NAT_MODELDEF = 5,
+    NAT_FRAMEOFDATA = 7,
+    NAT_KEEPALIVE = 10,
+    NAT_ECHOREQUEST = 12,
+    NAT_ECHORESPONSE = 13,
+  };
+
+  // appends little-endian values to a packet
+  class PacketWriter
+  {
+  public:
+    explicit PacketWriter(int messageId)
+    {
+      put<uint16_t>(messageId);
+      put<uint16_t>(0); // byte count, see finish()
+    }
+
+    template<typename T>
+    void put(T value)
+    {
+      const char* p = reinterpret_cast<const char*>(&value);
+      m_data.insert(m_data.end(), p, p + sizeof(T));
+    }
+
+    void putString(const std::string& value)
+    {
+      m_data.insert(m_data.end(), value.c_str(), value.c_str() + value.size() + 1);
+    }
+
+    void putZeros(size_t count)
+    {
+      m_data.insert(m_data.end(), count, 0);
+    }
+
+    size_t size() const
+    {
+      return m_data.size();
+    }
+
+    // overwrites a previously written 32 bit value
+    void patch(size_t offset, int32_t value)
+    {
+      memcpy(&m_data[offset], &value, sizeof(value));
+    }
+
+    // fills in the byte count of the header and returns the packet
+    std::vector<char> finish()
+    {
+      const size_t payload = m_data.size() - 4;
+      const uint16_t count = payload < 0xFFFF ? (uint16_t)payload : 0xFFFF;
+      memcpy(&m_data[2], &count, sizeof(count));
+      return m_data;
+    }
+
+  private:
+    std::vector<char> m_data;
+  };
+
+  inline bool atLeast(int major, int minor, int wantMajor, int wantMinor)
+  {
+    return major > wantMajor || (major == wantMajor && minor >= wantMinor);
+  }
+
+  // NAT_SERVERINFO response to NAT_CONNECT
+  inline std::vector<char> makeServerInfo(
+    int major,
+    int minor,
+    uint64_t clockFrequency,
+    uint16_t dataPort,
+    const uint8_t* multicastGroup) // nullptr for unicast
+  {
+    PacketWriter w(NAT_SERVERINFO);
+    const std::string name("libmotioncapture bench");
+    w.putString(name);
+    w.putZeros(256 - name.size() - 1);
+    w.put<uint8_t>(3); // application version
+    w.putZeros(3);
+    w.put<uint8_t>(major);
+    w.put<uint8_t>(minor);
+    w.put<uint8_t>(0);
+    w.put<uint8_t>(0);
+    w.put<uint64_t>(clockFrequency);
+    w.put<uint16_t>(dataPort);
+    w.put<uint8_t>(multicastGroup ? 1 : 0);
+    for (int i = 0; i < 4; ++i) {
+      w.put<uint8_t>(multicastGroup ? multicastGroup[i] : 0);
+    }
+    return w.finish();
+  }
+
+  // NAT_MODELDEF with rigid bodies "rb1".."rbN" (IDs 1..N)
+  inline std::vector<char> makeModelDef(int major, int minor, size_t bodies)
+  {
+    const bool hasSizes = atLeast(major, minor, 4, 1);
+    PacketWriter w(NAT_MODELDEF);
+    w.put<int32_t>(bodies);
+    for (size_t i = 0; i < bodies; ++i) {
+      w.put<int32_t>(1); // rigid body
+      const size_t sizeOffset = w.size();
+      if (hasSizes) {
+        w.put<int32_t>(0);
+      }
+      const size_t start = w.size();
+      if (major >= 2) {
+        w.putString("rb" + std::to_string(i + 1));
+      }
+      w.put<int32_t>(i + 1); // ID
+      w.put<int32_t>(-1);    // parent ID
+      w.put<float>(0);       // offset
+      w.put<float>(0);
+      w.put<float>(0);
+      if (major >= 3) {
+        w.put<int32_t>(0); // markers
+      }
+      if (hasSizes) {
+        w.patch(sizeOffset, w.size() - start);
+      }
+    }
+    return w.finish();
+  }
+
+  // Frame of mocap data with 'bodies' tracked rigid bodies (IDs 1..N) and
+  // 'markers' markers (labeled markers where the version has them). The
+  // timestamps are sent as high resolution timestamps (NatNet 3.0 and later).
+  inline std::vector<char> makeFrameOfData(
+    int major,
+    int minor,
+    int frameNumber,
+    size_t bodies,
+    size_t markers,
+    uint64_t cameraMidExposure = 0,
+    uint64_t transmit = 0)
+  {
+    const bool hasSizes = atLeast(major, minor, 4, 1);
+    const bool hasParams = atLeast(major, minor, 2, 6);
+    const bool hasLabeled = atLeast(major, minor, 2, 3);
+
+    PacketWriter w(NAT_FRAMEOFDATA);
+    w.put<int32_t>(frameNumber);
+
+    w.put<int32_t>(0); // marker sets
+    if (hasSizes) {
+      w.put<int32_t>(0);
+    }
+
+    // legacy unlabeled markers
+    const size_t legacyMarkers = hasLabeled ? 0 : markers;
+    w.put<int32_t>(legacyMarkers);
+    if (hasSizes) {
+      w.put<int32_t>(legacyMarkers * 12);
+    }
+    for (size_t i = 0; i < legacyMarkers; ++i) {
+      w.put<float>(0.001f * i);
+      w.put<float>(1.0f);
+      w.put<float>(2.0f);
+    }
+
+    w.put<int32_t>(bodies);
+    if (hasSizes) {
+      w.put<int32_t>(0);
+    }
+    for (size_t i = 0; i < bodies; ++i) {
+      w.put<int32_t>(i + 1);
+      w.put<float>(0.01f * i); // position
+      w.put<float>(0.5f);
+      w.put<float>(1.0f);
+      w.put<float>(0);         // rotation
+      w.put<float>(0);
+      w.put<float>(0);
+      w.put<float>(1);
+      if (major >= 2) {
+        w.put<float>(0.0001f); // mean error
+      }
+      if (hasParams) {
+        w.put<int16_t>(1); // tracked
+      }
+    }
+
+    if (atLeast(major, minor, 2, 1)) {
+      w.put<int32_t>(0); // skeletons
+      if (hasSizes) {
+        w.put<int32_t>(0);
+      }
+    }
+
+    if (hasSizes) {
+      w.put<int32_t>(0); // assets
+      w.put<int32_t>(0);
+    }
+
+    if (hasLabeled) {
+      w.put<int32_t>(markers);
+      if (hasSizes) {
+        w.put<int32_t>(0);
+      }
+      for (size_t i = 0; i < markers; ++i) {
+        w.put<int32_t>(i);
+        w.put<float>(0.001f * i);
+        w.put<float>(1.0f);
+        w.put<float>(2.0f);
+        w.put<float>(0.01f); // size
+        if (hasParams) {
+          w.put<int16_t>(0);
+        }
+        if (major >= 3) {
+          w.put<float>(0); // residual
+        }
+      }
+    }
+
+    if (atLeast(major, minor, 2, 9)) {
+      w.put<int32_t>(0); // force plates
+      if (hasSizes) {
+        w.put<int32_t>(0);
+      }
+    }
+    if (atLeast(major, minor, 2, 11)) {
+      w.put<int32_t>(0); // devices
+      if (hasSizes) {
+        w.put<int32_t>(0);
+      }
+    }
+
+    if (major < 3) {
+      w.put<float>(0); // software latency
+    }
+    w.put<uint32_t>(0); // timecode
+    w.put<uint32_t>(0); // sub-frame
+    if (atLeast(major, minor, 2, 7)) {
+      w.put<double>(frameNumber / 120.0);
+    } else {
+      w.put<float>(frameNumber / 120.0f);
+    }
+    if (major >= 3) {
+      w.put<uint64_t>(cameraMidExposure);
+      w.put<uint64_t>(cameraMidExposure);
+      w.put<uint64_t>(transmit);
+    }
+    w.put<uint16_t>(0); // params
+    return w.finish();
+  }
+
+} // namespace bench
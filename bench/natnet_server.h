@@ -0,0 +1,278 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <libmotioncapture/motioncapture.h>
+
+#include "natnet_packets.h"
+
+namespace bench {
+
+  // Stand-in for a Motive NatNet server. Answers NAT_CONNECT,
+  // NAT_REQUEST_MODELDEF and NAT_ECHOREQUEST on the command port (in a
+  // background thread), records subscriptions, counts keep-alives and
+  // sends synthetic frames of mocap data to the data port, either to a
+  // multicast group or to the address of the client that connected last.
+  // The model can be changed while streaming (see setBodies()).
+  //
+  // Frames carry the send time (hostTime(), so the server reports a clock
+  // frequency of 1 GHz) as camera mid-exposure and transmit timestamps.
+  // Clients on the same host get it back as Frame::timeStamp() in
+  // microseconds.
+  class NatNetServer
+  {
+  public:
+    enum { MAX_PACKETSIZE = 65503 };
+
+    // Port 0 picks free ports. An empty multicast group selects unicast.
+    NatNetServer(
+      int versionMajor,
+      int versionMinor,
+      size_t bodies,
+      size_t markers,
+      const std::string& address = "127.0.0.1",
+      uint16_t commandPort = 0,
+      uint16_t dataPort = 0,
+      const std::string& multicastGroup = "")
+      : m_commandSocket(m_commandContext)
+      , m_versionMajor(versionMajor)
+      , m_versionMinor(versionMinor)
+      , m_markers(markers)
+      , m_dataSocket(m_dataContext)
+      , m_dataPort(dataPort)
+      , m_multicast(!multicastGroup.empty())
+      , m_clientConnected(false)
+      , m_keepAlives(0)
+      , m_framesSent(0)
+      , m_modelsChanged(false)
+    {
+      if (versionMajor < 3) {
+        throw std::runtime_error("NatNetServer needs NatNet 3.0 or later (for timestamps)");
+      }
+      setBodies(bodies);
+      m_modelsChanged = false;
+
+      using boost::asio::ip::udp;
+      const auto listenAddress = boost::asio::ip::make_address(address);
+      m_commandSocket.open(udp::v4());
+      m_commandSocket.set_option(udp::socket::reuse_address(true));
+      m_commandSocket.bind(udp::endpoint(listenAddress, commandPort));
+
+      m_dataSocket.open(udp::v4());
+      if (m_dataPort == 0) {
+        // borrow a free port from the kernel
+        udp::socket probe(m_dataContext, udp::endpoint(udp::v4(), 0));
+        m_dataPort = probe.local_endpoint().port();
+      }
+      if (m_multicast) {
+        m_dataTarget = udp::endpoint(boost::asio::ip::make_address(multicastGroup), m_dataPort);
+        m_dataSocket.set_option(boost::asio::ip::multicast::enable_loopback(true));
+      }
+
+      uint8_t group[4];
+      if (m_multicast) {
+        const auto bytes = m_dataTarget.address().to_v4().to_bytes();
+        std::copy(bytes.begin(), bytes.end(), group);
+      }
+      m_serverInfo = makeServerInfo(versionMajor, versionMinor, 1000000000,
+        m_dataPort, m_multicast ? group : nullptr);
+      PacketWriter echo(NAT_ECHORESPONSE);
+      echo.putZeros(2 * sizeof(uint64_t));
+      m_echoResponse = echo.finish();
+
+      receiveCommand();
+      m_commandThread = std::thread([this]() { m_commandContext.run(); });
+    }
+
+    ~NatNetServer()
+    {
+      m_commandContext.stop();
+      m_commandThread.join();
+    }
+
+    uint16_t commandPort() const
+    {
+      return m_commandSocket.local_endpoint().port();
+    }
+
+    uint16_t dataPort() const
+    {
+      return m_dataPort;
+    }
+
+    // true, once a client sent NAT_CONNECT (always true for multicast)
+    bool hasClient() const
+    {
+      return m_multicast || m_clientConnected;
+    }
+
+    // "SubscribeToData" commands received so far (they are acknowledged,
+    // but the frames are not filtered)
+    std::vector<std::string> subscriptions() const
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_subscriptions;
+    }
+
+    // NAT_KEEPALIVE messages received so far
+    uint64_t keepAlives() const
+    {
+      return m_keepAlives;
+    }
+
+    // Sends the next frame (numbered from 1) stamped with the current time.
+    // Returns false if there is no client to send to yet. Must always be
+    // called from the same thread.
+    bool sendFrame()
+    {
+      boost::asio::ip::udp::endpoint target;
+      if (m_multicast) {
+        target = m_dataTarget;
+      } else {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_clientConnected) {
+          return false;
+        }
+        target = m_dataTarget;
+      }
+
+      const int32_t frameNumber = ++m_framesSent;
+      memcpy(&m_frame[4], &frameNumber, sizeof(frameNumber));
+      // high resolution timestamps are the last fields before the params
+      const size_t timestamps = m_frame.size() - 2 - 3 * sizeof(uint64_t);
+      const uint64_t now = libmotioncapture::hostTime();
+      for (size_t i = 0; i < 3; ++i) {
+        memcpy(&m_frame[timestamps + i * sizeof(uint64_t)], &now, sizeof(now));
+      }
+      // params are the last field
+      const uint16_t params = m_modelsChanged ? 0x02 : 0;
+      memcpy(&m_frame[m_frame.size() - sizeof(params)], &params, sizeof(params));
+      m_modelsChanged = false;
+      m_dataSocket.send_to(boost::asio::buffer(m_frame), target);
+      return true;
+    }
+
+    // Changes the number of rigid bodies of the model. Like Motive, the next
+    // frame flags the change (bTrackedModelsChanged). Must be called from
+    // the thread that sends the frames.
+    void setBodies(size_t bodies)
+    {
+      std::vector<char> frame = makeFrameOfData(m_versionMajor, m_versionMinor, 0, bodies, m_markers);
+      if (frame.size() > MAX_PACKETSIZE) {
+        throw std::runtime_error("Frame of " + std::to_string(frame.size())
+          + " bytes does not fit into a NatNet packet");
+      }
+      m_frame.swap(frame);
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_modelDef = makeModelDef(m_versionMajor, m_versionMinor, bodies);
+      m_modelsChanged = true;
+    }
+
+    uint64_t framesSent() const
+    {
+      return m_framesSent;
+    }
+
+    size_t frameSize() const
+    {
+      return m_frame.size();
+    }
+
+  private:
+    void receiveCommand()
+    {
+      m_commandSocket.async_receive_from(
+        boost::asio::buffer(m_request), m_requester,
+        [this](const boost::system::error_code& ec, size_t length) {
+          if (ec) {
+            if (ec == boost::asio::error::operation_aborted) {
+              return;
+            }
+            fprintf(stderr, "NatNetServer: %s\n", ec.message().c_str());
+          } else if (length >= 4) {
+            handleCommand(length);
+          }
+          receiveCommand();
+        });
+    }
+
+    void handleCommand(size_t length)
+    {
+      uint16_t messageId;
+      memcpy(&messageId, m_request, sizeof(messageId));
+      boost::system::error_code ec;
+      if (messageId == NAT_CONNECT) {
+        if (!m_multicast) {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_dataTarget = boost::asio::ip::udp::endpoint(m_requester.address(), m_dataPort);
+          m_clientConnected = true;
+        }
+        m_commandSocket.send_to(boost::asio::buffer(m_serverInfo), m_requester, 0, ec);
+      } else if (messageId == NAT_REQUEST_MODELDEF) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_commandSocket.send_to(boost::asio::buffer(m_modelDef), m_requester, 0, ec);
+      } else if (messageId == NAT_ECHOREQUEST && length >= 4 + sizeof(uint64_t)) {
+        // the client's timestamp followed by ours; written in place, so that
+        // keep-alives do not allocate
+        const uint64_t now = libmotioncapture::hostTime();
+        memcpy(&m_echoResponse[4], m_request + 4, sizeof(uint64_t));
+        memcpy(&m_echoResponse[4 + sizeof(uint64_t)], &now, sizeof(now));
+        m_commandSocket.send_to(boost::asio::buffer(m_echoResponse), m_requester, 0, ec);
+      } else if (messageId == NAT_REQUEST) {
+        const std::string command(m_request + 4, strnlen(m_request + 4, length - 4));
+        const bool subscription = command.compare(0, 16, "SubscribeToData,") == 0;
+        if (subscription) {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_subscriptions.push_back(command);
+        }
+        PacketWriter w(NAT_RESPONSE);
+        w.put<int32_t>(subscription ? 0 : 1);
+        m_commandSocket.send_to(boost::asio::buffer(w.finish()), m_requester, 0, ec);
+      } else if (messageId == NAT_KEEPALIVE) {
+        ++m_keepAlives;
+      }
+      if (ec) {
+        fprintf(stderr, "NatNetServer: %s\n", ec.message().c_str());
+      }
+    }
+
+  private:
+    boost::asio::io_context m_commandContext;
+    boost::asio::ip::udp::socket m_commandSocket;
+    boost::asio::ip::udp::endpoint m_requester;
+    char m_request[1024];
+    std::thread m_commandThread;
+
+    int m_versionMajor;
+    int m_versionMinor;
+    size_t m_markers;
+
+    boost::asio::io_context m_dataContext;
+    boost::asio::ip::udp::socket m_dataSocket;
+    uint16_t m_dataPort;
+    bool m_multicast;
+
+    mutable std::mutex m_mutex; // protects m_dataTarget, m_modelDef and m_subscriptions
+    boost::asio::ip::udp::endpoint m_dataTarget;
+    std::atomic<bool> m_clientConnected;
+    std::atomic<uint64_t> m_keepAlives;
+
+    std::vector<char> m_serverInfo;
+    std::vector<char> m_modelDef;
+    std::vector<std::string> m_subscriptions;
+    std::vector<char> m_echoResponse;
+    std::vector<char> m_frame;
+    std::atomic<uint64_t> m_framesSent;
+    bool m_modelsChanged; // flag the next frame
+  };
+
+} // namespace bench
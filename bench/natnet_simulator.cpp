@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "natnet_server.h"
+
+// Loopback stand-in for a Motive NatNet server, see NatNetServer. Options
+// (defaults in brackets):
+//   version        NatNet version to emulate, 3.0 or later [4.1]
+//   bodies         rigid bodies per frame [10]
+//   markers        markers per frame [0]
+//   rate           frames per second, 0 sends as fast as possible [120]
+//   address        address of the command port [0.0.0.0]
+//   port_command   [1510]
+//   port_data      [1511]
+//   multicast      multicast group, e.g. 239.255.42.99 [unicast to the client]
+
+int main(int argc, char **argv)
+{
+  std::map<std::string, std::string> cfg;
+  cfg["version"] = "4.1";
+  cfg["bodies"] = "10";
+  cfg["markers"] = "0";
+  cfg["rate"] = "120";
+  cfg["address"] = "0.0.0.0";
+  cfg["port_command"] = "1510";
+  cfg["port_data"] = "1511";
+  cfg["multicast"] = "";
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc || cfg.find(argv[i]) == cfg.end()) {
+      std::cerr << "Use ./natnet_simulator [option1] [value1] ... (options: version, bodies, markers, rate, address, port_command, port_data, multicast)" << std::endl;
+      return 1;
+    }
+    cfg[argv[i]] = argv[i+1];
+  }
+
+  int major = 0, minor = 0;
+  if (std::sscanf(cfg["version"].c_str(), "%d.%d", &major, &minor) != 2) {
+    std::cerr << "Invalid NatNet version " << cfg["version"] << std::endl;
+    return 1;
+  }
+  const double rate = std::stod(cfg["rate"]);
+
+  bench::NatNetServer server(major, minor,
+    std::stoul(cfg["bodies"]), std::stoul(cfg["markers"]),
+    cfg["address"], std::stoi(cfg["port_command"]), std::stoi(cfg["port_data"]),
+    cfg["multicast"]);
+
+  std::cout << "NatNet " << cfg["version"] << " on " << cfg["address"] << ":" << server.commandPort()
+            << ", frames of " << server.frameSize() << " bytes to port " << server.dataPort()
+            << (cfg["multicast"].empty() ? " (unicast)" : " (multicast " + cfg["multicast"] + ")") << std::endl;
+
+  const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(rate > 0 ? 1.0 / rate : 0.0));
+  auto next = std::chrono::steady_clock::now();
+  auto report = next + std::chrono::seconds(1);
+  uint64_t reported = 0;
+  while (true) {
+    if (rate > 0) {
+      next += period;
+      std::this_thread::sleep_until(next);
+    }
+    if (!server.sendFrame()) {
+      // wait for a client to connect
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      next = std::chrono::steady_clock::now();
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= report) {
+      const uint64_t sent = server.framesSent();
+      std::cout << "sent " << sent - reported << " frames/s" << std::endl;
+      reported = sent;
+      report = now + std::chrono::seconds(1);
+    }
+  }
+
+  return 0;
+}
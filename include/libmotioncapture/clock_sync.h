@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace libmotioncapture {
+
+  // Online estimate of offset and drift between a device clock and the host
+  // steady clock, from pairs of device timestamps (us, Frame::timeStamp())
+  // and host receive timestamps (ns, Frame::hostTimeStamp()).
+  //
+  // A line is fit over a sliding window of samples: least squares first, then
+  // refit on the less delayed half of the samples to reject queueing spikes.
+  // Network and processing delays only ever add to the host time, so the
+  // line is finally shifted onto the lower envelope of the samples. The
+  // result maps device time to the earliest possible arrival time; it
+  // includes the minimum one-way delay, which cannot be observed from
+  // received frames alone.
+  class ClockSync
+  {
+  public:
+    explicit ClockSync(size_t window = 256);
+
+    void addSample(uint64_t deviceTime, uint64_t hostTime);
+
+    void reset();
+
+    // true, once at least one sample was added
+    bool valid() const {
+      return m_count > 0;
+    }
+
+    size_t sampleCount() const {
+      return m_count;
+    }
+
+    // converts a device timestamp (us) into host time (ns)
+    uint64_t toHostTime(uint64_t deviceTime) const;
+
+    // host nanoseconds per device microsecond (1000 without drift)
+    double rate() const {
+      return m_rate;
+    }
+
+  private:
+    void fit();
+
+  private:
+    std::vector<uint64_t> m_deviceTimes;
+    std::vector<uint64_t> m_hostTimes;
+    std::vector<double> m_residuals; // scratch for fit()
+    size_t m_window;
+    size_t m_count;
+    size_t m_head; // next position to write
+
+    // host = m_hostRef + m_hostOffset + m_rate * (device - m_deviceRef)
+    uint64_t m_deviceRef;
+    uint64_t m_hostRef;
+    double m_hostOffset;
+    double m_rate;
+  };
+
+} // namespace libmotioncapture
@@ -174,7 +174,6 @@ namespace libmotioncapture {
 		int32 m_iRemoteCPort;
 		int32 m_iDataReceivePort;
 
-		mutable int32 m_uPreviousFrame;
 		int32 m_uFrameNumber;
 
 		uint32 m_uPagkageSize;
@@ -192,6 +191,7 @@ namespace libmotioncapture {
 
 		vector<LMarker> m_vctMarkData;
 		vector<LRigidBody> m_vctRigidbodyData;
+		vector<byte, ResourceAllocator<byte> > m_vctReceiveBuffer;	//reused for every received frame, see connect()
 		mutable map<uint32, LRigidbodyTag> m_mapRigidbodyTagList;
 		
 		//initailzie the instance
@@ -203,11 +203,11 @@ namespace libmotioncapture {
 		//parse rigidbody tag list
 		void parseRigidbodyTagList(const byte* const pData, map<uint32, LRigidbodyTag>& mapTagList);
 
-		//parse marker and rigibody data
-		void parseData(const byte* const pData, vector<LMarker>& allMarkers, vector<LRigidBody>& allRigidBodys);
+		//wait until the transmission socket is readable, at most timeout
+		bool waitReadable(std::chrono::nanoseconds timeout);
 
-		//receive and parse each frame data
-		void receiveFrameData();
+		//receive and parse each frame data, false if no frame was parsed
+		bool receiveFrameData();
 
 		//set the connection flag
 		inline void setConnected(const bool bIsConnected) { this->m_bIsConnected = bIsConnected; }
@@ -215,6 +215,8 @@ namespace libmotioncapture {
 		//set the first frame flag
 		inline void setFirstFrame(const bool bFirstFrame) { this->m_bFirstFrame = bFirstFrame; }
 	protected:
+		//receive the next frame (MotionCapture interface)
+		bool receiveFrame(std::chrono::nanoseconds timeout);
 	public:
 		//get current unque instance
 		inline static MotionCaptureFZMotion* getInstance() {
@@ -240,6 +242,7 @@ namespace libmotioncapture {
 		}
 
 		virtual ~MotionCaptureFZMotion() {
+			this->stopReceiveThread();
 			s_mutex.lock();
 
 			this->disconnect();
@@ -263,10 +266,10 @@ namespace libmotioncapture {
 
 		inline bool isConnected() const { return this->m_bIsConnected; }
 
+		//parse marker and rigibody data of a motion capture data message (other messages are ignored)
+		static void parseData(const byte* const pData, int32& iFrameNumber, vector<LMarker>& allMarkers, vector<LRigidBody>& allRigidBodys);
+
 		//overload virtual functions
-		void waitForNextFrame();
-		const std::map<std::string, RigidBody>& rigidBodies() const;
-		const PointCloud& pointCloud() const;
 		inline bool supportsRigidBodyTracking() const { return true; }
 		inline bool supportsPointCloud() const { return true; }
 	};
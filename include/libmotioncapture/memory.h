@@ -0,0 +1,157 @@
+#pragma once
+#include <cstddef>
+#include <stdint.h>
+#include <type_traits>
+
+namespace libmotioncapture {
+
+  // Source of the memory for per-frame storage, modeled after
+  // std::pmr::memory_resource (which needs C++17). See
+  // MotionCapture::connect().
+  class MemoryResource
+  {
+  public:
+    virtual ~MemoryResource() {}
+
+    void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t))
+    {
+      return doAllocate(bytes, alignment);
+    }
+
+    void deallocate(void* p, size_t bytes, size_t alignment = alignof(std::max_align_t))
+    {
+      doDeallocate(p, bytes, alignment);
+    }
+
+    bool isEqual(const MemoryResource& other) const
+    {
+      return this == &other || doIsEqual(other);
+    }
+
+  protected:
+    virtual void* doAllocate(size_t bytes, size_t alignment) = 0;
+    virtual void doDeallocate(void* p, size_t bytes, size_t alignment) = 0;
+    virtual bool doIsEqual(const MemoryResource& /*other*/) const
+    {
+      return false;
+    }
+  };
+
+  // global operator new and delete (the default)
+  MemoryResource* newDeleteResource();
+
+  // Monotonic arena on one contiguous block: allocations are carved off the
+  // front, deallocate() is a no-op and memory is only released with the
+  // arena. Throws std::bad_alloc when the block is exhausted. Not
+  // thread-safe; storage is allocated by the decoding thread only, once the
+  // rigid bodies are known.
+  //
+  // For real-time use, lock() the block into RAM. The pages are placed on
+  // the NUMA node of the thread that touches them first (Linux default
+  // policy), so construct the arena on a thread that runs on the node of
+  // the NIC, or pass a block obtained from numa_alloc_onnode().
+  class Arena : public MemoryResource
+  {
+  public:
+    // allocates a zeroed block of 'capacity' bytes
+    explicit Arena(size_t capacity);
+
+    // uses the caller's block, which must outlive the arena
+    Arena(void* buffer, size_t capacity);
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena();
+
+    // Locks the block into RAM (mlock() on POSIX); throws if that fails,
+    // e.g. because of RLIMIT_MEMLOCK
+    void lock();
+
+    bool locked() const {
+      return m_locked;
+    }
+
+    size_t capacity() const {
+      return m_capacity;
+    }
+
+    // bytes allocated so far (including alignment padding); run once with a
+    // generous arena to size it
+    size_t used() const {
+      return m_used;
+    }
+
+  protected:
+    virtual void* doAllocate(size_t bytes, size_t alignment);
+    virtual void doDeallocate(void* p, size_t bytes, size_t alignment);
+
+  private:
+    char* m_buffer;
+    size_t m_capacity;
+    size_t m_used;
+    bool m_owned;
+    bool m_locked;
+  };
+
+  // Allocator for standard containers that draws from a MemoryResource
+  // (like std::pmr::polymorphic_allocator). The resource moves and swaps
+  // with the storage, so frames can be swapped between buffers; copies of a
+  // container use newDeleteResource().
+  template<typename T>
+  class ResourceAllocator
+  {
+  public:
+    typedef T value_type;
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    // nullptr selects newDeleteResource()
+    ResourceAllocator(MemoryResource* resource = nullptr) noexcept
+      : m_resource(resource ? resource : newDeleteResource())
+    {
+    }
+
+    template<typename U>
+    ResourceAllocator(const ResourceAllocator<U>& other) noexcept
+      : m_resource(other.resource())
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+      return static_cast<T*>(m_resource->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+      m_resource->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    ResourceAllocator select_on_container_copy_construction() const
+    {
+      return ResourceAllocator();
+    }
+
+    MemoryResource* resource() const {
+      return m_resource;
+    }
+
+  private:
+    MemoryResource* m_resource;
+  };
+
+  template<typename T, typename U>
+  bool operator==(const ResourceAllocator<T>& a, const ResourceAllocator<U>& b)
+  {
+    return a.resource()->isEqual(*b.resource());
+  }
+
+  template<typename T, typename U>
+  bool operator!=(const ResourceAllocator<T>& a, const ResourceAllocator<U>& b)
+  {
+    return !(a == b);
+  }
+
+} // namespace libmotioncapture
@@ -13,13 +13,6 @@ namespace libmotioncapture {
 
     virtual ~MotionCaptureMock();
 
-    // implementations for MotionCapture interface
-    virtual void waitForNextFrame();
-
-    const std::map<std::string, RigidBody>& rigidBodies() const;
-
-    const PointCloud& pointCloud() const;
-
     virtual bool supportsRigidBodyTracking() const
     {
       return true;
@@ -30,6 +23,10 @@ namespace libmotioncapture {
       return true;
     }
 
+  protected:
+    // implementation for MotionCapture interface
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout);
+
   private:
     MotionCaptureMockImpl * pImpl;
   };
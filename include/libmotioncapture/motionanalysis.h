@@ -16,15 +16,13 @@ namespace libmotioncapture {
 
         const std::string &version() const;
 
-        virtual void waitForNextFrame() override;
-
-        virtual const std::map<std::string, RigidBody> &rigidBodies() const override;
-
-        virtual RigidBody rigidBodyByName(const std::string &name) const override;
-
         virtual bool supportsRigidBodyTracking() const override;
 
+    protected:
+        virtual bool receiveFrame(std::chrono::nanoseconds timeout) override;
+
     private:
+        friend class MotionCaptureMotionAnalysisImpl;
         MotionCaptureMotionAnalysisImpl *pImpl;
     };
 
@@ -4,23 +4,41 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <atomic>
 
 // Eigen
 #include <Eigen/Geometry>
 
+#include "libmotioncapture/clock_sync.h"
+#include "libmotioncapture/memory.h"
+#include "libmotioncapture/stats.h"
+
 namespace libmotioncapture {
 
   typedef Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> PointCloud;
 
   const char* version();
 
+  // current host time in nanoseconds of the steady clock, the clock domain
+  // of Frame::hostTimeStamp()
+  inline uint64_t hostTime()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
   class RigidBody
   {
   public:
     RigidBody(
       const std::string& name,
       const Eigen::Vector3f& position,
-      Eigen::Quaternionf& rotation)
+      const Eigen::Quaternionf& rotation)
       : m_name(name)
       , m_position(position)
       , m_rotation(rotation)
@@ -40,6 +58,9 @@ namespace libmotioncapture {
     }
 
   private:
+    // updates the poses of rigidBodies() in place
+    friend class MotionCapture;
+
     std::string m_name;
     Eigen::Vector3f m_position;
     Eigen::Quaternionf m_rotation;
@@ -69,6 +90,335 @@ namespace libmotioncapture {
     double m_value;
   };
 
+  // Stable index of a rigid body within a Frame, see MotionCapture::resolve()
+  typedef int BodyHandle;
+
+  // Pose of a rigid body without its name (cheap to copy)
+  class Pose
+  {
+  public:
+    Pose(
+      const Eigen::Vector3f& position,
+      const Eigen::Quaternionf& rotation,
+      bool valid)
+      : m_position(position)
+      , m_rotation(rotation)
+      , m_valid(valid)
+    {
+    }
+
+    const Eigen::Vector3f& position() const {
+      return m_position;
+    }
+
+    const Eigen::Quaternionf& rotation() const {
+      return m_rotation;
+    }
+
+    // false, if the rigid body was not tracked in this frame
+    bool valid() const {
+      return m_valid;
+    }
+
+  private:
+    Eigen::Vector3f m_position;
+    Eigen::Quaternionf m_rotation;
+    bool m_valid;
+  };
+
+  // Snapshot of one frame. Rigid bodies are stored as structure-of-arrays.
+  // Backends keep one slot per known rigid body and reuse the storage across
+  // frames, so updating a frame does not allocate once all bodies are known.
+  // Slots are never removed; bodies that are not tracked are marked invalid.
+  // The slot arrays are allocated from a MemoryResource; copies of a frame
+  // use the heap, assignment keeps the resource of the target.
+  class Frame
+  {
+  public:
+    typedef std::vector<Eigen::Vector3f, ResourceAllocator<Eigen::Vector3f> > Vector3Vector;
+    typedef std::vector<Eigen::Quaternionf, ResourceAllocator<Eigen::Quaternionf> > QuaternionVector;
+
+    // nullptr allocates from newDeleteResource()
+    explicit Frame(MemoryResource* resource = nullptr)
+      : m_ids(ResourceAllocator<int>(resource))
+      , m_names(ResourceAllocator<std::string>(resource))
+      , m_valid(ResourceAllocator<uint8_t>(resource))
+      , m_positions(ResourceAllocator<Eigen::Vector3f>(resource))
+      , m_rotations(ResourceAllocator<Eigen::Quaternionf>(resource))
+      , m_velocities(ResourceAllocator<Eigen::Vector3f>(resource))
+      , m_angularVelocities(ResourceAllocator<Eigen::Vector3f>(resource))
+      , m_timeStamp(0)
+      , m_hostTimeStamp(0)
+      , m_sequence(0)
+      , m_frameNumber(0)
+      , m_gap(0)
+    {
+    }
+
+    // increasing number assigned to every received frame (starts at 1)
+    uint64_t sequence() const {
+      return m_sequence;
+    }
+
+    // Frame number of the motion capture system, extended to 64 bits so it
+    // does not wrap. Increases by one per frame the system produced, so
+    // jumps reveal lost frames. When the numbers jump far back (the server
+    // restarted), they continue from the new value. Backends without native
+    // frame numbers (VRPN) count the frames they deliver.
+    uint64_t frameNumber() const {
+      return m_frameNumber;
+    }
+
+    // Number of frames the motion capture system produced between the
+    // previously received frame and this one, which were lost. Only
+    // determined with MotionCapture::DeliverAllWithGapReport (0 otherwise).
+    uint64_t gap() const {
+      return m_gap;
+    }
+
+    // native device timestamp in microseconds (as reported by the motion
+    // capture system, in its own clock domain; 0 if not supported)
+    uint64_t timeStamp() const {
+      return m_timeStamp;
+    }
+
+    // Time of reception in nanoseconds, see hostTime(). Captured as close to
+    // the network as the backend allows (kernel timestamps for the OptiTrack
+    // and FZMotion sockets on Linux, entry of the SDK callback otherwise).
+    uint64_t hostTimeStamp() const {
+      return m_hostTimeStamp;
+    }
+
+    // all unlabeled markers
+    const PointCloud& pointCloud() const {
+      return m_pointCloud;
+    }
+
+    const std::vector<LatencyInfo>& latency() const {
+      return m_latencies;
+    }
+
+    // number of rigid body slots (tracked or not)
+    size_t size() const {
+      return m_ids.size();
+    }
+
+    // native ID of the rigid body in slot i
+    int id(size_t i) const {
+      return m_ids[i];
+    }
+
+    const std::string& name(size_t i) const {
+      return m_names[i];
+    }
+
+    // true, if the rigid body in slot i was tracked in this frame
+    bool valid(size_t i) const {
+      return m_valid[i] != 0;
+    }
+
+    const Eigen::Vector3f& position(size_t i) const {
+      return m_positions[i];
+    }
+
+    const Eigen::Quaternionf& rotation(size_t i) const {
+      return m_rotations[i];
+    }
+
+    // linear velocity in m/s (zero unless velocity estimation is enabled)
+    const Eigen::Vector3f& velocity(size_t i) const {
+      return m_velocities[i];
+    }
+
+    // angular velocity in rad/s, in body coordinates (zero unless velocity
+    // estimation is enabled)
+    const Eigen::Vector3f& angularVelocity(size_t i) const {
+      return m_angularVelocities[i];
+    }
+
+    // contiguous arrays with size() elements each
+    const int* ids() const {
+      return m_ids.data();
+    }
+
+    const uint8_t* validFlags() const {
+      return m_valid.data();
+    }
+
+    const Eigen::Vector3f* positions() const {
+      return m_positions.data();
+    }
+
+    const Eigen::Quaternionf* rotations() const {
+      return m_rotations.data();
+    }
+
+    const Eigen::Vector3f* velocities() const {
+      return m_velocities.data();
+    }
+
+    const Eigen::Vector3f* angularVelocities() const {
+      return m_angularVelocities.data();
+    }
+
+    // returns the slot of the rigid body with the given name, or -1
+    int find(const char* name) const
+    {
+      for (size_t i = 0; i < m_names.size(); ++i) {
+        if (m_names[i] == name) {
+          return (int)i;
+        }
+      }
+      return -1;
+    }
+
+    // resource of the slot arrays
+    MemoryResource* resource() const {
+      return m_ids.get_allocator().resource();
+    }
+
+    // Interface for backends
+
+    // preallocates 'bodies' slots (e.g. from the model definitions), so that
+    // the arrays are allocated once
+    void reserve(size_t bodies)
+    {
+      m_ids.reserve(bodies);
+      m_names.reserve(bodies);
+      m_valid.reserve(bodies);
+      m_positions.reserve(bodies);
+      m_rotations.reserve(bodies);
+      m_velocities.reserve(bodies);
+      m_angularVelocities.reserve(bodies);
+    }
+
+    PointCloud& pointCloud() {
+      return m_pointCloud;
+    }
+
+    std::vector<LatencyInfo>& latency() {
+      return m_latencies;
+    }
+
+    void setTimeStamp(uint64_t timeStamp) {
+      m_timeStamp = timeStamp;
+    }
+
+    void setHostTimeStamp(uint64_t hostTimeStamp) {
+      m_hostTimeStamp = hostTimeStamp;
+    }
+
+    void setSequence(uint64_t sequence) {
+      m_sequence = sequence;
+    }
+
+    // backends pass the native (at most 32 bit) frame number
+    void setFrameNumber(uint64_t frameNumber) {
+      m_frameNumber = frameNumber;
+    }
+
+    void setGap(uint64_t gap) {
+      m_gap = gap;
+    }
+
+    // adds a new (untracked) slot and returns its index
+    size_t addBody(int id, const char* name)
+    {
+      m_ids.push_back(id);
+      m_names.emplace_back(name);
+      m_valid.push_back(0);
+      m_positions.emplace_back(Eigen::Vector3f::Zero());
+      m_rotations.emplace_back(Eigen::Quaternionf::Identity());
+      m_velocities.emplace_back(Eigen::Vector3f::Zero());
+      m_angularVelocities.emplace_back(Eigen::Vector3f::Zero());
+      return m_ids.size() - 1;
+    }
+
+    // returns the slot of the named rigid body, adding it if unknown;
+    // slot 'hint' is checked first, which makes stable orderings O(1)
+    size_t findOrAddBody(int id, const char* name, size_t hint)
+    {
+      if (hint < m_names.size() && m_names[hint] == name) {
+        return hint;
+      }
+      int slot = find(name);
+      if (slot >= 0) {
+        return slot;
+      }
+      return addBody(id, name);
+    }
+
+    // removes all slots
+    void clear()
+    {
+      m_ids.clear();
+      m_names.clear();
+      m_valid.clear();
+      m_positions.clear();
+      m_rotations.clear();
+      m_velocities.clear();
+      m_angularVelocities.clear();
+    }
+
+    // marks all slots as not tracked
+    void invalidate()
+    {
+      std::fill(m_valid.begin(), m_valid.end(), 0);
+    }
+
+    void setPose(
+      size_t i,
+      const Eigen::Vector3f& position,
+      const Eigen::Quaternionf& rotation)
+    {
+      m_positions[i] = position;
+      m_rotations[i] = rotation;
+      m_valid[i] = 1;
+    }
+
+    void setVelocity(
+      size_t i,
+      const Eigen::Vector3f& velocity,
+      const Eigen::Vector3f& angularVelocity)
+    {
+      m_velocities[i] = velocity;
+      m_angularVelocities[i] = angularVelocity;
+    }
+
+  private:
+    std::vector<int, ResourceAllocator<int> > m_ids;
+    std::vector<std::string, ResourceAllocator<std::string> > m_names;
+    std::vector<uint8_t, ResourceAllocator<uint8_t> > m_valid;
+    Vector3Vector m_positions;
+    QuaternionVector m_rotations;
+    Vector3Vector m_velocities;
+    Vector3Vector m_angularVelocities;
+    PointCloud m_pointCloud;
+    std::vector<LatencyInfo> m_latencies;
+    uint64_t m_timeStamp;
+    uint64_t m_hostTimeStamp;
+    uint64_t m_sequence;
+    uint64_t m_frameNumber;
+    uint64_t m_gap;
+  };
+
+  // Pose of a rigid body in a recorded frame, see MotionCapture::history()
+  struct TimedPose
+  {
+    uint64_t sequence;
+    uint64_t hostTimeStamp;
+    Eigen::Vector3f position;
+    Eigen::Quaternionf rotation;
+  };
+
+  typedef std::vector<TimedPose, Eigen::aligned_allocator<TimedPose> > TimedPoseVector;
+
+  class MotionCaptureThread;
+  class FrameHistory;
+  class FrameNumberTracker;
+  class StatsCollector;
+  class VelocityFilter;
+
   class MotionCapture
   {
   public:
@@ -76,44 +426,193 @@ namespace libmotioncapture {
       const std::string &type,
       const std::map<std::string, std::string> &cfg);
 
-    virtual ~MotionCapture()
+    // Like connect() above, but allocates the per-frame storage (rigid body
+    // slots of all frames, frame buffers and queues, the frame history and
+    // the receive buffers of the backend) from 'resource', which must outlive
+    // the returned object. Bodies are preallocated from the model
+    // definitions where the backend has them. Use an Arena to lock this
+    // memory into RAM and to place it on a NUMA node. Point clouds, latency
+    // entries and body names remain on the heap.
+    static MotionCapture *connect(
+      const std::string &type,
+      const std::map<std::string, std::string> &cfg,
+      MemoryResource* resource);
+
+    MotionCapture();
+
+    virtual ~MotionCapture();
+
+    // waits until a new frame is available
+    void waitForNextFrame();
+
+    // waits at most 'timeout' for a new frame; returns false if none arrived
+    bool waitForNextFrame(std::chrono::nanoseconds timeout);
+
+    // makes a new frame current only if one is already available; never
+    // blocks on the network
+    bool tryGetNextFrame();
+
+    // Threaded mode (option "threaded" of connect()): a background thread
+    // receives and decodes frames and hands them over to the consumer through
+    // a lock-free triple buffer. All query functions must then be called from
+    // a single consumer thread. Stopping waits for the pending receive slice
+    // (at most ~100 ms) to end.
+    void startReceiveThread();
+    void stopReceiveThread();
+
+    bool isThreaded() const
     {
+      return thread_ != nullptr;
     }
 
-    // waits until a new frame is available
-    virtual void waitForNextFrame() = 0;
+    // makes the newest received frame current without blocking (wait-free
+    // in threaded mode) and returns it
+    const Frame& latestFrame();
 
-    // Query data
+    // blocks until a frame with a sequence number larger than 'sequence' is
+    // available, makes it current and returns it
+    const Frame& waitForFrameAfter(uint64_t sequence);
 
-    // returns reference to rigid bodies available in the current frame
-    virtual const std::map<std::string, RigidBody>& rigidBodies() const
+    // Frame history (option "history" of connect()): keeps the poses of the
+    // last 'capacity' frames in a preallocated ring. Call before frames are
+    // received; 0 disables it. The queries below are thread-safe.
+    void enableHistory(size_t capacity);
+
+    // Clears 'poses' and fills it with the tracked poses of the given body
+    // received in [t0, t1] (host time stamps, ns), oldest first. Returns the
+    // number of poses. Does not allocate once 'poses' reached its capacity.
+    size_t history(
+      BodyHandle handle,
+      uint64_t t0,
+      uint64_t t1,
+      TimedPoseVector& poses) const;
+
+    // Copies the recorded poses of frame 'sequence' into 'frame', which must
+    // have the current slots (e.g. a copy of currentFrame()). Returns false if
+    // the frame is not (or no longer) recorded.
+    bool frameAt(uint64_t sequence, Frame& frame) const;
+
+    // Converts a device timestamp (us, Frame::timeStamp()) into host time
+    // (ns, see hostTime()), using an online estimate of offset and drift of
+    // the device clock (see ClockSync). Throws if the backend did not report
+    // device timestamps yet.
+    uint64_t toHostTime(uint64_t deviceTime) const;
+
+    // Velocity estimation (option "velocity" of connect()): an alpha-beta
+    // filter fills Frame::velocity() and Frame::angularVelocity() of every
+    // decoded frame (see VelocityFilter). Call before frames are received.
+    void enableVelocityEstimation(
+      bool enable,
+      float alpha = 0.5f,
+      float beta = 1.0f / 6.0f);
+
+    enum PredictionModel
+    {
+      ConstantVelocity,     // uses the last two tracked samples
+      ConstantAcceleration, // uses the last three tracked samples
+    };
+
+    // Extrapolates the pose of a body from the frame history (see
+    // enableHistory()) to host time 'hostTimeNs' (see hostTime()). Samples
+    // are placed at their estimated exposure time: host receive time minus
+    // the latency reported by the backend. Falls back to simpler models if
+    // fewer samples are tracked; returns an invalid pose if there are none.
+    // Does not allocate.
+    Pose predictPose(
+      BodyHandle handle,
+      uint64_t hostTimeNs,
+      PredictionModel model = ConstantVelocity) const;
+
+    enum DeliveryPolicy
     {
-      rigidBodies_.clear();
-      return rigidBodies_;
+      DeliverLatest,           // skip frames that queued up, newest first
+      DeliverAll,              // deliver every frame in order
+      DeliverAllWithGapReport, // like DeliverAll, and fill Frame::gap()
+    };
+
+    // Frame delivery (option "delivery_policy" of connect(): "latest", "all"
+    // or "all_with_gap_report"). With DeliverLatest (default), frames that
+    // arrived while the consumer was busy are skipped, so waitForNextFrame()
+    // returns the newest one. Otherwise every frame the backend receives is
+    // decoded and delivered in order; in threaded mode the consumer still
+    // sees the newest frame, but the frame callback and the history see all
+    // of them. Backends whose SDK pushes frames buffer a limited number of
+    // them; if the consumer falls further behind, the oldest are discarded,
+    // counted as dropped (see frameCounters()) and reported in the gap of the
+    // next delivered frame. VRPN has no notion of frames and always delivers
+    // the latest state. Call before frames are received.
+    virtual void setDeliveryPolicy(DeliveryPolicy policy);
+
+    DeliveryPolicy deliveryPolicy() const
+    {
+      return deliveryPolicy_.load(std::memory_order_relaxed);
     }
 
+    // Counts lost, duplicated and reordered frames based on the frame
+    // numbers of the motion capture system (see Frame::frameNumber()). With
+    // DeliverLatest, frames skipped on purpose count as dropped as well; use
+    // DeliverAll to measure losses on the network. A late frame that was
+    // counted as dropped is moved to the reordered ones. Thread-safe.
+    FrameCounters frameCounters() const;
+
+    // Runtime metrics since construction (see Stats). Collecting them costs
+    // a few relaxed atomic increments per frame and never allocates.
+    // Thread-safe; entries are read one by one, so a snapshot taken while
+    // frames arrive may be slightly inconsistent.
+    Stats stats() const;
+
+    typedef std::function<void(const Frame&)> FrameCallback;
+
+    // Registers a function that is called for every decoded frame, on the
+    // thread that decoded it (receive thread, SDK thread, or the caller of
+    // waitForNextFrame()). The frame is only valid during the call. The
+    // callback must not call setFrameCallback(). Pass nullptr to remove.
+    void setFrameCallback(FrameCallback callback);
+
+    // Query data
+
+    // returns reference to the current frame (no copies)
+    virtual const Frame& currentFrame() const;
+
+    // returns reference to rigid bodies available in the current frame
+    // (built from currentFrame())
+    virtual const std::map<std::string, RigidBody>& rigidBodies() const;
+
     // returns copy of rigid body with a specified name
     virtual RigidBody rigidBodyByName(
       const std::string& name) const;
 
+    // returns a handle for the rigid body with a specified name, which stays
+    // valid for the lifetime of this object (throws if the body is unknown)
+    virtual BodyHandle resolve(
+      const std::string& name) const;
+
+    // returns pose of a rigid body in the current frame (O(1))
+    Pose pose(BodyHandle handle) const
+    {
+      const Frame& frame = currentFrame();
+      if (handle < 0 || (size_t)handle >= frame.size()) {
+        throw std::runtime_error("Invalid rigid body handle!");
+      }
+      return Pose(frame.position(handle), frame.rotation(handle), frame.valid(handle));
+    }
+
     // returns pointer to point cloud (all unlabled markers)
     virtual const PointCloud& pointCloud() const
     {
-      pointcloud_.resize(0, Eigen::NoChange);
-      return pointcloud_;
+      return currentFrame().pointCloud();
     }
 
     // return latency information
     virtual const std::vector<LatencyInfo>& latency() const
     {
-      latencies_.clear();
-      return latencies_;
+      return currentFrame().latency();
     }
 
     // returns timestamp in microseconds
     virtual uint64_t timeStamp() const
     {
-      return 0;
+      return currentFrame().timeStamp();
     }
 
     // Query API capabilities
@@ -140,10 +639,54 @@ namespace libmotioncapture {
     }
 
   protected:
+    // Implemented by backends: waits at most 'timeout' for the next frame and
+    // decodes it into frame_. Returns true if a frame was decoded (and
+    // frameReceived() called); a zero timeout only consumes data that is
+    // already available. Called by waitForNextFrame() or, in threaded mode,
+    // by the receive thread. Backends must call stopReceiveThread() first
+    // thing in their destructor, so that the thread does not outlive them.
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout) = 0;
+
+    // Called by backends once per decoded frame (with its host time stamp
+    // and native frame number set), on the thread that decoded it: assigns
+    // the sequence number, extends the frame number and counts gaps,
+    // updates the clock estimate, estimates velocities, records the frame in
+    // the history and invokes the frame callback.
+    void frameReceived(Frame& frame);
+
+    // Called by backends that can measure it (see stats()): one decoded
+    // frame took 'datagrams' packets with 'bytes' of payload off the wire
+    void recordReceived(size_t bytes, size_t datagrams);
+
+    // Called by backends that buffer frames for DeliverAll, on the thread
+    // that decoded them: 'frames' frames went through frameReceived() but
+    // were discarded because the buffer was full
+    void recordDropped(uint64_t frames);
+
+    // called by backends: decoding one frame took 'ns' nanoseconds
+    void recordParseTime(uint64_t ns);
+
+  protected:
+    // resource for per-frame storage, see connect() (never nullptr)
+    MemoryResource* memoryResource_;
+    Frame frame_;
     mutable std::map<std::string, RigidBody> rigidBodies_;
-    mutable PointCloud pointcloud_;
-    mutable std::vector<LatencyInfo> latencies_;
-    mutable uint64_t timestamp_;
+
+  private:
+    void receiveLoop();
+
+  private:
+    MotionCaptureThread* thread_;
+    FrameHistory* history_;
+    uint64_t sequence_;
+    FrameNumberTracker* frameNumbers_;
+    StatsCollector* stats_;
+    std::atomic<DeliveryPolicy> deliveryPolicy_;
+    FrameCallback callback_;
+    VelocityFilter* velocityFilter_;
+    std::mutex callbackMutex_; // protects callback_, history_ and velocityFilter_
+    ClockSync clockSync_;
+    mutable std::mutex clockSyncMutex_;
   };
 
 } // namespace libobjecttracker
@@ -0,0 +1,112 @@
+#pragma once
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace libmotioncapture {
+
+  // Rigid body as transmitted in a NatNet frame of mocap data
+  struct NatNetRigidBody
+  {
+    int id;
+    float x, y, z;
+    float qx, qy, qz, qw;
+    float meanError; // mean marker error (NatNet 2.0 and later)
+    bool tracked;    // rigid body was successfully tracked in this frame
+  };
+
+  // Rigid body description from a NatNet model definition
+  struct NatNetRigidBodyDescription
+  {
+    std::string name; // empty before NatNet 2.0
+    int id;
+    int parentId;
+    float xOffset, yOffset, zOffset;
+  };
+
+  // Receives the contents of a frame of mocap data in stream order. All
+  // functions have empty defaults, so visitors only implement what they need.
+  class NatNetFrameVisitor
+  {
+  public:
+    virtual ~NatNetFrameVisitor() {}
+
+    virtual void beginFrame(int /*frameNumber*/) {}
+
+    // called before each marker section (legacy unlabeled markers, then
+    // labeled markers) with the number of markers that follow
+    virtual void beginMarkers(size_t /*count*/) {}
+    virtual void marker(float /*x*/, float /*y*/, float /*z*/) {}
+
+    virtual void rigidBody(const NatNetRigidBody& /*rigidBody*/) {}
+
+    // high resolution timestamps in ticks of the server clock (NatNet 3.0
+    // and later)
+    virtual void timestamps(
+      uint64_t /*cameraMidExposure*/,
+      uint64_t /*cameraDataReceived*/,
+      uint64_t /*transmit*/) {}
+
+    // called last, only for completely decoded frames
+    virtual void endFrame(uint16_t /*params*/) {}
+  };
+
+  // Single-pass, bounds-checked decoder for NatNet frame of mocap data packets
+  // (message ID 7). Skeletons, assets, force plates and devices are skipped.
+  // Also decodes the rigid bodies of model definitions (message ID 5).
+  class NatNetFrameDecoder
+  {
+  public:
+    enum {
+      MESSAGE_MODELDEF = 5,
+      MESSAGE_FRAMEOFDATA = 7,
+    };
+
+    NatNetFrameDecoder(
+      int versionMajor = 0,
+      int versionMinor = 0)
+    {
+      setVersion(versionMajor, versionMinor);
+    }
+
+    // Also selects the frame layout, so that decode() does not check the
+    // version for every element
+    void setVersion(int versionMajor, int versionMinor);
+
+    // returns the message ID of a packet, or -1 if it is too short
+    static int messageId(const char* data, size_t size);
+
+    // Decodes a complete packet (including its 4 byte header). Returns false
+    // for other message types and for truncated or malformed packets; in the
+    // latter case the visitor may have seen part of the frame, but endFrame()
+    // is not called.
+    bool decode(
+      const char* data,
+      size_t size,
+      NatNetFrameVisitor& visitor) const;
+
+    // Decodes the rigid body descriptions of a model definition packet
+    // (including its 4 byte header) into 'bodies', in packet order. Before
+    // NatNet 4.1, descriptions carry no size, so decoding stops at the first
+    // one of a type without rigid bodies after skeletons (force plates,
+    // devices, cameras). Returns false for other message types and for
+    // truncated or malformed packets.
+    bool decodeModelDef(
+      const char* data,
+      size_t size,
+      std::vector<NatNetRigidBodyDescription>& bodies) const;
+
+  private:
+    enum Layout {
+      LAYOUT_GENERIC, // before NatNet 3.0 and unknown versions
+      LAYOUT_3,       // NatNet 3.0 to 4.0
+      LAYOUT_4_1,     // NatNet 4.1 and later
+    };
+
+    int m_major;
+    int m_minor;
+    Layout m_layout;
+  };
+
+} // namespace libmotioncapture
@@ -19,14 +19,14 @@ namespace libmotioncapture {
     const std::string& version() const;
 
     // implementations for MotionCapture interface
-    virtual void waitForNextFrame();
-	virtual const std::map<std::string, RigidBody>& rigidBodies() const override;
-	virtual RigidBody rigidBodyByName(const std::string& name) const override;
-	virtual const PointCloud& pointCloud() const override;
 	virtual bool supportsRigidBodyTracking() const override;
     virtual bool supportsPointCloud() const;
 
+  protected:
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout) override;
+
   private:
+    friend class MotionCaptureNokovImpl;
     MotionCaptureNokovImpl* pImpl;
   };
 
@@ -6,21 +6,28 @@ namespace libmotioncapture {
 
   class MotionCaptureOptitrack : public MotionCapture{
   public:
+    // With unicast streaming from a NatNet 4.0 or later server, the client
+    // subscribes to the data it uses: rigid bodies (all, or the ones named in
+    // 'subscribe_rigid_bodies', separated by ';') if 'enable_objects', and
+    // labeled markers if 'enable_pointcloud'. The server then omits
+    // everything else, such as marker sets, skeletons and devices. Multicast
+    // streams are not filtered.
     MotionCaptureOptitrack(
       const std::string &hostname,
       const std::string& interface_ip = "0.0.0.0",
-      int port_command = 1510);
+      int port_command = 1510,
+      bool enable_objects = true,
+      bool enable_pointcloud = true,
+      const std::string& subscribe_rigid_bodies = "");
 
     virtual ~MotionCaptureOptitrack();
 
     const std::string& version() const;
 
-    // implementations for MotionCapture interface
-    virtual void waitForNextFrame();
-    virtual const std::map<std::string, RigidBody>& rigidBodies() const;
-    virtual const PointCloud& pointCloud() const;
-    virtual const std::vector<LatencyInfo> &latency() const;
-    virtual uint64_t timeStamp() const;
+    // False while the NatNet server does not answer on its command port
+    // (e.g. Motive is restarting). Servers that do not answer echo requests
+    // are not watched and always count as responding. Thread-safe.
+    bool serverResponding() const;
 
     virtual bool supportsRigidBodyTracking() const
     {
@@ -41,6 +48,10 @@ namespace libmotioncapture {
       return true;
     }
 
+  protected:
+    // implementation for MotionCapture interface
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout);
+
   private:
     MotionCaptureOptitrackImpl * pImpl;
   };
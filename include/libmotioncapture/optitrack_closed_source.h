@@ -14,13 +14,6 @@ namespace libmotioncapture {
 
     const std::string& version() const;
 
-    // implementations for MotionCapture interface
-    virtual void waitForNextFrame();
-    virtual const std::map<std::string, RigidBody>& rigidBodies() const;
-    virtual const PointCloud& pointCloud() const;
-    virtual const std::vector<LatencyInfo> &latency() const;
-    virtual uint64_t timeStamp() const;
-
     virtual bool supportsRigidBodyTracking() const
     {
       return true;
@@ -40,7 +33,12 @@ namespace libmotioncapture {
       return true;
     }
 
+  protected:
+    // implementation for MotionCapture interface
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout);
+
   private:
+    friend class MotionCaptureOptitrackClosedSourceImpl;
     MotionCaptureOptitrackClosedSourceImpl * pImpl;
   };
 }
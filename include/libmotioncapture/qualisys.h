@@ -19,12 +19,9 @@ namespace libmotioncapture {
 
     const std::string& version() const;
 
-    // implementations for MotionCapture interface
-    virtual void waitForNextFrame();
-    virtual const std::map<std::string, RigidBody>& rigidBodies() const;
-    virtual RigidBody rigidBodyByName(const std::string &name) const;
-    virtual const PointCloud& pointCloud() const;
-    virtual uint64_t timeStamp() const;
+    // rotation of 6DOF Euler angles in degrees (rotation order of the QTM
+    // default settings)
+    static Eigen::Quaternionf eulerToQuaternion(float rx, float ry, float rz);
 
     virtual bool supportsRigidBodyTracking() const
     {
@@ -41,6 +38,10 @@ namespace libmotioncapture {
       return true;
     }
 
+  protected:
+    // implementation for MotionCapture interface
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout);
+
   private:
     MotionCaptureQualisysImpl* pImpl;
   };
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <stdint.h>
+
+namespace libmotioncapture {
+
+  // Histogram with fixed, logarithmic buckets: bucket 0 counts the value 0
+  // and 1, bucket i > 0 counts values in [2^i, 2^(i+1)). The last bucket
+  // also counts everything larger.
+  struct Histogram
+  {
+    enum { BUCKETS = 40 };
+
+    uint64_t counts[BUCKETS];
+    uint64_t count; // number of samples
+    uint64_t sum;   // sum of all samples
+    uint64_t max;   // largest sample
+
+    // average of all samples (0 if there are none)
+    double mean() const;
+
+    // Upper bound of the bucket that contains the given quantile (0..1), so
+    // the true value is at most twice smaller. Returns 0 if there are no
+    // samples.
+    uint64_t quantile(double q) const;
+
+    // bucket that counts 'value'
+    static size_t bucket(uint64_t value);
+  };
+
+  // Frame loss statistics, see MotionCapture::frameCounters()
+  struct FrameCounters
+  {
+    uint64_t received;   // frames delivered by the backend
+    uint64_t dropped;    // frame numbers that were skipped, or frames the
+                         // backend had to discard (see DeliverAll)
+    uint64_t duplicated; // frames repeating the newest frame number
+    uint64_t reordered;  // frames older than the newest frame
+  };
+
+  // Runtime metrics, see MotionCapture::stats(). Times are in nanoseconds.
+  // Backends report what they can measure; other entries stay 0.
+  struct Stats
+  {
+    FrameCounters frames;
+
+    uint64_t bytesReceived;   // payload of all received datagrams/packets
+    Histogram drainDepth;     // datagrams received per decoded frame
+    Histogram parseTime;      // decoding one frame from the wire or the SDK
+    Histogram conversionTime; // building rigidBodies()
+    Histogram frameInterval;  // between host timestamps of consecutive frames
+    Histogram intervalJitter; // change of frameInterval from frame to frame
+    Histogram waitTime;       // spent in waitForNextFrame()
+  };
+
+} // namespace libmotioncapture
@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+
+// Tracing of the receive path. Built with the CMake option
+// LIBMOTIONCAPTURE_ENABLE_TRACING, the library records a span for every
+// receive, decode, rigidBodies() conversion, frame callback and
+// waitForNextFrame() call into a fixed-size buffer per thread (the newest
+// 65536 spans per thread are kept). Without the option, nothing is recorded
+// and the functions below do nothing.
+
+namespace libmotioncapture {
+
+  // true, if the library was built with tracing
+  bool tracingEnabled();
+
+  // Writes the recorded spans of all threads as Chrome trace JSON (open in
+  // chrome://tracing or ui.perfetto.dev). Can be called while frames are
+  // being received. Returns false if tracing is disabled or the file could
+  // not be written.
+  bool writeChromeTrace(const std::string& filename);
+
+  // discards all recorded spans
+  void clearTrace();
+
+} // namespace libmotioncapture
@@ -0,0 +1,43 @@
+#pragma once
+#include "libmotioncapture/motioncapture.h"
+
+namespace libmotioncapture {
+
+  // Alpha-beta filter estimating linear and angular velocity of all rigid
+  // bodies of a frame. The translational state is kept as structure-of-arrays
+  // and updated in one branch-free pass over all bodies, so it vectorizes.
+  // The default gains are the critically damped choice beta = alpha^2/(2-alpha).
+  class VelocityFilter
+  {
+  public:
+    explicit VelocityFilter(
+      float alpha = 0.5f,
+      float beta = 1.0f / 6.0f);
+
+    // updates the estimates with the tracked poses of 'frame' (using its host
+    // time stamps) and stores the velocities in it
+    void update(Frame& frame);
+
+    void reset();
+
+  private:
+    void resize(size_t count);
+
+  private:
+    float m_alpha;
+    float m_beta;
+    uint64_t m_lastTime;
+
+    // position and velocity estimates, one array per axis
+    std::vector<float> m_position[3];
+    std::vector<float> m_velocity[3];
+    // rotation and angular velocity (body coordinates) estimates
+    Frame::QuaternionVector m_rotations;
+    std::vector<Eigen::Vector3f> m_angularVelocities;
+    // 1 if the body has an estimate
+    std::vector<float> m_active;
+    // number of consecutive frames the body was not tracked
+    std::vector<uint32_t> m_missed;
+  };
+
+} // namespace libmotioncapture
@@ -31,12 +31,9 @@ namespace libmotioncapture {
 
     const std::string& version() const;
 
-    // implementations for MotionCapture interface
-    virtual void waitForNextFrame();
-    virtual const std::map<std::string, RigidBody>& rigidBodies() const;
-    virtual RigidBody rigidBodyByName(const std::string& name) const;
-    virtual const PointCloud& pointCloud() const;
-    virtual const std::vector<LatencyInfo>& latency() const;
+    // sizes the SDK's frame buffer: one frame for DeliverLatest, a backlog
+    // otherwise
+    virtual void setDeliveryPolicy(DeliveryPolicy policy);
 
     virtual bool supportsRigidBodyTracking() const
     {
@@ -53,7 +50,12 @@ namespace libmotioncapture {
       return true;
     }
 
+  protected:
+    // implementation for MotionCapture interface
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout);
+
   private:
+    friend class MotionCaptureViconImpl;
     MotionCaptureViconImpl* pImpl;
   };
 
@@ -15,12 +15,6 @@ namespace libmotioncapture {
 
     virtual ~MotionCaptureVrpn();
 
-    // implementations for MotionCapture interface
-    virtual void waitForNextFrame();
-    virtual const std::map<std::string, RigidBody> &rigidBodies() const;
-    virtual RigidBody rigidBodyByName(const std::string &name) const;
-    virtual uint64_t timeStamp() const;
-
     virtual bool supportsRigidBodyTracking() const
     {
       return true;
@@ -31,6 +25,10 @@ namespace libmotioncapture {
       return true;
     }
 
+  protected:
+    // implementation for MotionCapture interface
+    virtual bool receiveFrame(std::chrono::nanoseconds timeout);
+
   private:
     MotionCaptureVrpnImpl* pImpl;
   };
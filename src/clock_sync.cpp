@@ -0,0 +1,132 @@
+#include "libmotioncapture/clock_sync.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace libmotioncapture {
+
+  ClockSync::ClockSync(size_t window)
+    : m_deviceTimes(std::max<size_t>(window, 2))
+    , m_hostTimes(m_deviceTimes.size())
+    , m_residuals(m_deviceTimes.size())
+    , m_window(m_deviceTimes.size())
+    , m_count(0)
+    , m_head(0)
+    , m_deviceRef(0)
+    , m_hostRef(0)
+    , m_hostOffset(0)
+    , m_rate(1000.0)
+  {
+  }
+
+  void ClockSync::addSample(uint64_t deviceTime, uint64_t hostTime)
+  {
+    if (m_count > 0) {
+      const uint64_t newest = m_deviceTimes[(m_head + m_window - 1) % m_window];
+      if (deviceTime == newest) {
+        return;
+      }
+      // the device clock jumped back (e.g. server restarted)
+      if (deviceTime < newest) {
+        reset();
+      }
+    }
+    m_deviceTimes[m_head] = deviceTime;
+    m_hostTimes[m_head] = hostTime;
+    m_head = (m_head + 1) % m_window;
+    m_count = std::min(m_count + 1, m_window);
+    fit();
+  }
+
+  void ClockSync::reset()
+  {
+    m_count = 0;
+    m_head = 0;
+    m_rate = 1000.0;
+  }
+
+  uint64_t ClockSync::toHostTime(uint64_t deviceTime) const
+  {
+    const double dx = (double)(int64_t)(deviceTime - m_deviceRef);
+    return m_hostRef + (int64_t)std::llround(m_hostOffset + m_rate * dx);
+  }
+
+  void ClockSync::fit()
+  {
+    // work relative to the newest sample to keep the doubles small
+    const size_t newest = (m_head + m_window - 1) % m_window;
+    const uint64_t x0 = m_deviceTimes[newest];
+    const uint64_t y0 = m_hostTimes[newest];
+    const size_t first = (m_head + m_window - m_count) % m_window;
+
+    double rate = m_rate;
+    double intercept = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+      // in the second pass, only use samples below the median residual
+      double threshold = 0;
+      if (pass == 1) {
+        std::vector<double>::iterator median = m_residuals.begin() + m_count / 2;
+        std::nth_element(m_residuals.begin(), median, m_residuals.begin() + m_count);
+        threshold = *median;
+      }
+
+      double n = 0, sx = 0, sy = 0;
+      for (size_t k = 0; k < m_count; ++k) {
+        const size_t i = (first + k) % m_window;
+        const double x = (double)(int64_t)(m_deviceTimes[i] - x0);
+        const double y = (double)(int64_t)(m_hostTimes[i] - y0);
+        if (pass == 1 && y - (intercept + rate * x) > threshold) {
+          continue;
+        }
+        n += 1;
+        sx += x;
+        sy += y;
+      }
+      const double mx = sx / n;
+      const double my = sy / n;
+      double sxx = 0, sxy = 0;
+      for (size_t k = 0; k < m_count; ++k) {
+        const size_t i = (first + k) % m_window;
+        const double x = (double)(int64_t)(m_deviceTimes[i] - x0);
+        const double y = (double)(int64_t)(m_hostTimes[i] - y0);
+        if (pass == 1 && y - (intercept + rate * x) > threshold) {
+          continue;
+        }
+        sxx += (x - mx) * (x - mx);
+        sxy += (x - mx) * (y - my);
+      }
+      // with too few distinct samples keep the previous rate
+      const double newRate = sxx > 0 ? sxy / sxx : rate;
+      const double newIntercept = my - newRate * mx;
+
+      if (pass == 0) {
+        for (size_t k = 0; k < m_count; ++k) {
+          const size_t i = (first + k) % m_window;
+          const double x = (double)(int64_t)(m_deviceTimes[i] - x0);
+          const double y = (double)(int64_t)(m_hostTimes[i] - y0);
+          m_residuals[k] = y - (newIntercept + newRate * x);
+        }
+      }
+      rate = newRate;
+      intercept = newIntercept;
+    }
+
+    // shift onto the lower envelope: delays are never negative
+    double minResidual = 0;
+    for (size_t k = 0; k < m_count; ++k) {
+      const size_t i = (first + k) % m_window;
+      const double x = (double)(int64_t)(m_deviceTimes[i] - x0);
+      const double y = (double)(int64_t)(m_hostTimes[i] - y0);
+      const double residual = y - (intercept + rate * x);
+      if (k == 0 || residual < minResidual) {
+        minResidual = residual;
+      }
+    }
+
+    m_rate = rate;
+    m_deviceRef = x0;
+    m_hostRef = y0;
+    m_hostOffset = intercept + minResidual;
+  }
+
+} // namespace libmotioncapture
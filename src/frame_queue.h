@@ -0,0 +1,73 @@
+#pragma once
+#include "libmotioncapture/motioncapture.h"
+
+// Bounded queue of frames for backends whose SDK delivers frames on its own
+// thread (internal header).
+
+namespace libmotioncapture {
+
+  // FIFO ring of frames used with MotionCapture::DeliverAll. The SDK thread
+  // pushes copies, receiveFrame() swaps them out. Slots are reused, so once
+  // all slots have seen a frame of the current size, pushing does not
+  // allocate. Slots allocate from 'resource' (nullptr: heap). When full, the
+  // oldest frame is dropped: push() reports it, so that the backend can count
+  // it (MotionCapture::recordDropped()), and pop() adds the frames dropped
+  // since the previous pop to the gap of the frame it returns, which is the
+  // one that followed them. Not thread-safe.
+  class FrameQueue
+  {
+  public:
+    explicit FrameQueue(size_t capacity = 64, MemoryResource* resource = nullptr)
+      : m_frames(ResourceAllocator<Frame>(resource))
+      , m_head(0)
+      , m_size(0)
+      , m_overflow(0)
+    {
+      m_frames.reserve(capacity);
+      for (size_t i = 0; i < capacity; ++i) {
+        m_frames.emplace_back(resource);
+      }
+    }
+
+    bool empty() const
+    {
+      return m_size == 0;
+    }
+
+    // returns false if the queue was full and its oldest frame was dropped
+    bool push(const Frame& frame)
+    {
+      bool dropped = false;
+      if (m_size == m_frames.size()) {
+        m_head = (m_head + 1) % m_frames.size();
+        --m_size;
+        ++m_overflow;
+        dropped = true;
+      }
+      m_frames[(m_head + m_size) % m_frames.size()] = frame;
+      ++m_size;
+      return !dropped;
+    }
+
+    // swaps the oldest frame into 'frame'; the queue must not be empty. With
+    // 'reportGap' (MotionCapture::DeliverAllWithGapReport), frames dropped
+    // right before it are added to its gap.
+    void pop(Frame& frame, bool reportGap)
+    {
+      std::swap(frame, m_frames[m_head]);
+      m_head = (m_head + 1) % m_frames.size();
+      --m_size;
+      if (reportGap && m_overflow > 0) {
+        frame.setGap(frame.gap() + m_overflow);
+      }
+      m_overflow = 0;
+    }
+
+  private:
+    std::vector<Frame, ResourceAllocator<Frame> > m_frames;
+    size_t m_head;
+    size_t m_size;
+    uint64_t m_overflow; // frames dropped since the last pop()
+  };
+
+} // namespace libmotioncapture
@@ -1,4 +1,6 @@
 #include "libmotioncapture/fzmotion.h"
+#include "receive_timestamp.h"
+#include "trace.h"
 namespace libmotioncapture {
     recursive_mutex MotionCaptureFZMotion::s_mutex;
     MotionCaptureFZMotion* MotionCaptureFZMotion::s_pInstance = nullptr;
@@ -19,6 +21,8 @@ namespace libmotioncapture {
         this->m_mapRigidbodyTagList.clear();
         this->m_vctMarkData.clear();
         this->m_vctRigidbodyData.clear();
+        this->m_vctReceiveBuffer = vector<byte, ResourceAllocator<byte> >(
+            MAX_FRAME_SIZE, 0, ResourceAllocator<byte>(this->memoryResource_));
 
         this->setConnected(false);
         this->setFirstFrame(true);
@@ -35,7 +39,6 @@ namespace libmotioncapture {
         this->m_iRemoteCPort = 0;
         this->m_iDataReceivePort = 0;
         this->m_uPagkageSize = 0;
-        this->m_uPreviousFrame = -1;
         this->m_uFrameNumber = 0;
 
         this->m_localCEndpoint = udp::endpoint();			//local connection endpoint
@@ -168,6 +171,7 @@ namespace libmotioncapture {
             this->m_TransmissionSocket.set_option(ip::multicast::enable_loopback(true));
             this->m_TransmissionSocket.set_option(ip::multicast::join_group(make_address_v4(this->m_strMulticastGroup), make_address_v4(this->m_strLocalIP)));
             this->m_TransmissionSocket.bind(this->m_localMEndpoint);
+            enableReceiveTimestamps(this->m_TransmissionSocket);
         }
 
         this->setConnected(true);
@@ -207,7 +211,6 @@ namespace libmotioncapture {
         this->m_iRemoteCPort = 0;
         this->m_iDataReceivePort = 0;
         this->m_uPagkageSize = 0;
-        this->m_uPreviousFrame = -1;
         this->m_uFrameNumber = 0;
 
         this->m_localCEndpoint = udp::endpoint();			//local connection endpoint
@@ -288,17 +291,28 @@ namespace libmotioncapture {
         }
     }
     //receive and parse each frame data
-    void MotionCaptureFZMotion::receiveFrameData() {
-        byte* pBuffer = GetEmptyBuffer(MAX_FRAME_SIZE);
+    bool MotionCaptureFZMotion::receiveFrameData() {
+        byte* pBuffer = this->m_vctReceiveBuffer.data();
         boost:system::error_code ec;
         udp::endpoint multicastEndpoint;
-        cout << "receiveiFrameData" << endl;
+        uint64_t uHostTimeStamp = 0;
+        bool bParsed = false;
+        size_t uDatagrams = 0;
+        size_t uBytes = 0;
+        uint64_t uParseTime = 0;
         do{
         	//receive motion capture data
-            if (this->m_TransmissionSocket.receive_from(boost::asio::buffer(pBuffer, MAX_FRAME_SIZE), multicastEndpoint,0, ec) <= 0) {
+            size_t uLength;
+            {
+                TRACE_SCOPE("receive");
+                uLength = receiveTimestamped(this->m_TransmissionSocket, pBuffer, MAX_FRAME_SIZE, multicastEndpoint, uHostTimeStamp, ec);
+            }
+            if (uLength <= 0) {
                 cout << "Failed to receve data frame." << endl;
             	continue;
             }
+            uDatagrams++;
+            uBytes += uLength;
             //get message
             Message eMessage;
             CopyBuffer((byte*)&eMessage, pBuffer, sizeof(Message));
@@ -313,16 +327,65 @@ namespace libmotioncapture {
             }
 
             //parse data
-            parseData(pBuffer, this->m_vctMarkData, this->m_vctRigidbodyData);
+            uint64_t uParseStart = hostTime();
+            parseData(pBuffer, this->m_uFrameNumber, this->m_vctMarkData, this->m_vctRigidbodyData);
+            uParseTime = hostTime() - uParseStart;
+            TRACE_SPAN("decode", uParseStart);
 
             //clear buffer
             EmptyBuffer(pBuffer, MAX_FRAME_SIZE);
-        }while (this->m_TransmissionSocket.available() > 0);
+            bParsed = true;
+            //with DeliverAll, the next call handles the next frame
+        }while ((!bParsed || this->deliveryPolicy() == DeliverLatest) && this->m_TransmissionSocket.available() > 0);
+
+        //no motion capture data, keep the current frame
+        if (bParsed == false) {
+            this->recordReceived(uBytes, uDatagrams);
+            return false;
+        }
 
-        ReleaseBuffer(pBuffer);
+        //update frame
+        uint64_t uUpdateStart = hostTime();
+        this->frame_.invalidate();
+        for (uint32 i = 0; i < this->m_vctRigidbodyData.size(); i++) {
+            auto& lrb = this->m_vctRigidbodyData[i];
+            auto iter = this->m_mapRigidbodyTagList.find(lrb.ID);
+            if (iter == this->m_mapRigidbodyTagList.end()) {
+                continue;
+            }
+            auto& tag = iter->second;
+            Eigen::Vector3f position(
+                lrb.sPosition.x + tag.sCenteroidTransform.x,
+                lrb.sPosition.y + tag.sCenteroidTransform.y,
+                lrb.sPosition.z + tag.sCenteroidTransform.z
+            );
+            Eigen::Quaternionf rotation(
+                lrb.sOrientation.qw,
+                lrb.sOrientation.qx,
+                lrb.sOrientation.qy,
+                lrb.sOrientation.qz
+            );
+            size_t slot = this->frame_.findOrAddBody(lrb.ID, tag.szName, i);
+            this->frame_.setPose(slot, position, rotation);
+        }
+
+        auto& pointcloud = this->frame_.pointCloud();
+        pointcloud.resize(this->m_vctMarkData.size(), Eigen::NoChange);
+        for (uint32 row = 0; row < this->m_vctMarkData.size(); row++) {
+            auto& marker = this->m_vctMarkData[row];
+            pointcloud.row(row) << marker.sPosition.x, marker.sPosition.y, marker.sPosition.z;
+        }
+
+        this->frame_.setHostTimeStamp(uHostTimeStamp);
+        this->frame_.setFrameNumber((uint32)this->m_uFrameNumber);
+        this->recordParseTime(uParseTime + hostTime() - uUpdateStart);
+        TRACE_SPAN("convert", uUpdateStart);
+        this->recordReceived(uBytes, uDatagrams);
+        this->frameReceived(this->frame_);
+        return true;
     }
     //parse marker and rigibody data
-    void MotionCaptureFZMotion::parseData(const byte* const pData, vector<LMarker>& allMarkers, vector<LRigidBody>& allRigidBodys) {
+    void MotionCaptureFZMotion::parseData(const byte* const pData, int32& iFrameNumber, vector<LMarker>& allMarkers, vector<LRigidBody>& allRigidBodys) {
         //parse received data
         byte* ptr = const_cast<byte*>(pData);
 
@@ -336,7 +399,7 @@ namespace libmotioncapture {
         uint16 uDataBytes;
         CopyBuffer((byte*)&uDataBytes, ptr, sizeof(uint16));
         ptr += sizeof(uint16);
-        CopyBuffer((byte*)&this->m_uFrameNumber, ptr, sizeof(uint32));
+        CopyBuffer((byte*)&iFrameNumber, ptr, sizeof(uint32));
         ptr += sizeof(int32);
         uint32 uMarkerSets;
         CopyBuffer((byte*)&uMarkerSets, ptr, sizeof(uint32));
@@ -364,60 +427,40 @@ namespace libmotioncapture {
             ptr += uCopySize;
         }
     }
-    void MotionCaptureFZMotion::waitForNextFrame() {
-        s_mutex.lock();
-
-        if (this->isConnected() == true) {
-            receiveFrameData();
+    bool MotionCaptureFZMotion::waitReadable(std::chrono::nanoseconds timeout) {
+        if (this->m_TransmissionSocket.available() > 0) {
+            return true;
         }
-        s_mutex.unlock();
-    }
-    const std::map<std::string, RigidBody>& MotionCaptureFZMotion::rigidBodies() const {
-        s_mutex.lock();
-        if (this->m_uPreviousFrame == this->m_uFrameNumber) {
-            s_mutex.unlock();
-            return rigidBodies_;
+        if (timeout <= std::chrono::nanoseconds::zero()) {
+            return false;
         }
-
-        rigidBodies_.clear();
-       
-        for (auto& lrb : this->m_vctRigidbodyData) {
-            auto& tag = m_mapRigidbodyTagList[lrb.ID];
-            Eigen::Vector3f position(
-                lrb.sPosition.x + tag.sCenteroidTransform.x,
-                lrb.sPosition.y + tag.sCenteroidTransform.y,
-                lrb.sPosition.z + tag.sCenteroidTransform.z
-            );
-            Eigen::Quaternionf rotation(Eigen::Quaternionf(
-                lrb.sOrientation.qw,
-                lrb.sOrientation.qx,
-                lrb.sOrientation.qy,
-                lrb.sOrientation.qz
-            ));
-            RigidBody rigidbody(tag.szName, position, rotation);
-            rigidBodies_.emplace(tag.szName, rigidbody);
+        bool bReadable = false;
+        this->m_TransmissionSocket.async_wait(udp::socket::wait_read,
+            [&bReadable](const boost::system::error_code& ec) { bReadable = !ec; });
+        this->m_IOContext.restart();
+        if (this->m_IOContext.run_for(timeout) == 0) {
+            //timed out, cancel the pending wait and let its handler run
+            this->m_TransmissionSocket.cancel();
+            this->m_IOContext.restart();
+            this->m_IOContext.run();
         }
-
-        this->m_uPreviousFrame = this->m_uFrameNumber;
-        s_mutex.unlock();
-        return rigidBodies_;
+        return bReadable;
     }
-    const PointCloud& MotionCaptureFZMotion::pointCloud() const {
+
+    bool MotionCaptureFZMotion::receiveFrame(std::chrono::nanoseconds timeout) {
+        bool bReceived = false;
         s_mutex.lock();
-        if (this->m_uPreviousFrame == this->m_uFrameNumber) {
-            s_mutex.unlock();
-            return pointcloud_;
-        }
 
-        if (pointcloud_.size() != this->m_vctMarkData.size()) {
-            pointcloud_.resize(this->m_vctMarkData.size(), Eigen::NoChange);
-        }
-        
-        for (uint32 row = 0; row < this->m_vctMarkData.size(); row++) {
-            auto& marker = this->m_vctMarkData[row];
-            pointcloud_.row(row) << marker.sPosition.x, marker.sPosition.y, marker.sPosition.z;
+        bool bConnected = this->isConnected();
+        if (bConnected == true && this->waitReadable(timeout) == true) {
+            bReceived = receiveFrameData();
         }
         s_mutex.unlock();
-        return pointcloud_;
+
+        //nothing to wait for, but honor the timeout rather than spin
+        if (bConnected == false) {
+            std::this_thread::sleep_for(timeout);
+        }
+        return bReceived;
     }
 }
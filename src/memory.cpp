@@ -0,0 +1,119 @@
+#include "libmotioncapture/memory.h"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace libmotioncapture {
+
+  namespace {
+
+    class NewDeleteResource : public MemoryResource
+    {
+    protected:
+      virtual void* doAllocate(size_t bytes, size_t alignment)
+      {
+        if (alignment <= alignof(std::max_align_t)) {
+          return ::operator new(bytes);
+        }
+        // over-align by hand (no aligned operator new before C++17); the
+        // original pointer is stored right before the returned one
+        char* raw = static_cast<char*>(::operator new(bytes + alignment + sizeof(void*)));
+        uintptr_t p = reinterpret_cast<uintptr_t>(raw + sizeof(void*));
+        p = (p + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        reinterpret_cast<void**>(p)[-1] = raw;
+        return reinterpret_cast<void*>(p);
+      }
+
+      virtual void doDeallocate(void* p, size_t /*bytes*/, size_t alignment)
+      {
+        if (alignment <= alignof(std::max_align_t)) {
+          ::operator delete(p);
+        } else if (p) {
+          ::operator delete(static_cast<void**>(p)[-1]);
+        }
+      }
+    };
+
+  } // namespace
+
+  MemoryResource* newDeleteResource()
+  {
+    static NewDeleteResource resource;
+    return &resource;
+  }
+
+  Arena::Arena(size_t capacity)
+    : m_buffer(new char[capacity]())
+    , m_capacity(capacity)
+    , m_used(0)
+    , m_owned(true)
+    , m_locked(false)
+  {
+  }
+
+  Arena::Arena(void* buffer, size_t capacity)
+    : m_buffer(static_cast<char*>(buffer))
+    , m_capacity(capacity)
+    , m_used(0)
+    , m_owned(false)
+    , m_locked(false)
+  {
+  }
+
+  Arena::~Arena()
+  {
+    if (m_locked) {
+#ifdef _WIN32
+      VirtualUnlock(m_buffer, m_capacity);
+#else
+      munlock(m_buffer, m_capacity);
+#endif
+    }
+    if (m_owned) {
+      delete[] m_buffer;
+    }
+  }
+
+  void Arena::lock()
+  {
+    if (m_locked || m_capacity == 0) {
+      return;
+    }
+#ifdef _WIN32
+    if (!VirtualLock(m_buffer, m_capacity)) {
+      throw std::runtime_error("VirtualLock failed with error " + std::to_string(GetLastError()));
+    }
+#else
+    if (mlock(m_buffer, m_capacity) != 0) {
+      throw std::runtime_error(std::string("mlock failed: ") + strerror(errno));
+    }
+#endif
+    m_locked = true;
+  }
+
+  void* Arena::doAllocate(size_t bytes, size_t alignment)
+  {
+    const uintptr_t base = reinterpret_cast<uintptr_t>(m_buffer);
+    const uintptr_t p = (base + m_used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    const uintptr_t end = base + m_capacity;
+    if (p > end || bytes > end - p) {
+      throw std::bad_alloc();
+    }
+    m_used = p + bytes - base;
+    return reinterpret_cast<void*>(p);
+  }
+
+  void Arena::doDeallocate(void* /*p*/, size_t /*bytes*/, size_t /*alignment*/)
+  {
+  }
+
+} // namespace libmotioncapture
@@ -7,11 +7,14 @@ namespace libmotioncapture {
   class MotionCaptureMockImpl{
   public:
     MotionCaptureMockImpl()
+      : frameNumber(0)
     {
     }
 
   public:
     float dt;
+    std::chrono::steady_clock::time_point nextFrame;
+    uint64_t frameNumber; // number of the last produced frame
   };
 
   MotionCaptureMock::MotionCaptureMock(
@@ -21,29 +24,45 @@ namespace libmotioncapture {
   {
     pImpl = new MotionCaptureMockImpl;
     pImpl->dt = dt;
-    for (const auto& obj : objects) {
-      rigidBodies_.insert(std::make_pair(obj.name(), obj));
+    pImpl->nextFrame = std::chrono::steady_clock::now()
+      + std::chrono::milliseconds((int)(dt * 1000));
+    frame_.reserve(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+      const auto& obj = objects[i];
+      size_t slot = frame_.findOrAddBody(i, obj.name().c_str(), i);
+      frame_.setPose(slot, obj.position(), obj.rotation());
     }
-    pointcloud_ = pointCloud;
+    frame_.pointCloud() = pointCloud;
   }
 
-  void MotionCaptureMock::waitForNextFrame()
+  bool MotionCaptureMock::receiveFrame(std::chrono::nanoseconds timeout)
   {
-    std::this_thread::sleep_for(std::chrono::milliseconds((int)(pImpl->dt * 1000)));
-  }
-
-  const std::map<std::string, RigidBody>& MotionCaptureMock::rigidBodies() const
-  {
-    return rigidBodies_;
-  }
-
-  const PointCloud& MotionCaptureMock::pointCloud() const
-  {
-    return pointcloud_;
+    // frames are "produced" every dt seconds
+    const auto period = std::chrono::milliseconds((int)(pImpl->dt * 1000));
+    const auto now = std::chrono::steady_clock::now();
+    if (pImpl->nextFrame < now
+        && deliveryPolicy() == DeliverLatest
+        && period.count() > 0) {
+      // consumer fell behind: the newest frame is ready, older ones are dropped
+      const auto behind = (now - pImpl->nextFrame) / period;
+      pImpl->nextFrame += behind * period;
+      pImpl->frameNumber += behind;
+    }
+    if (pImpl->nextFrame - now > timeout) {
+      std::this_thread::sleep_for(timeout);
+      return false;
+    }
+    std::this_thread::sleep_until(pImpl->nextFrame);
+    pImpl->nextFrame += period;
+    frame_.setHostTimeStamp(hostTime());
+    frame_.setFrameNumber(++pImpl->frameNumber);
+    frameReceived(frame_);
+    return true;
   }
 
   MotionCaptureMock::~MotionCaptureMock()
   {
+    stopReceiveThread();
     delete pImpl;
   }
 }
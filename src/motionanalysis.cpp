@@ -1,5 +1,8 @@
 #include "libmotioncapture/motionanalysis.h"
+#include "frame_queue.h"
+#include "trace.h"
 
+#include <condition_variable>
 #include <mutex>
 #include <unordered_map>
 #include <thread>
@@ -7,18 +10,6 @@
 
 namespace libmotioncapture {
 
-    std::mutex mtx;
-    sFrameOfData frameOfData = {0};
-
-    const sFrameOfData &GetCurrentFrame() {
-        static sFrameOfData frame = {0};
-        {
-            std::lock_guard<std::mutex> lck(mtx);
-            frame = frameOfData;
-        }
-        return frame;
-    }
-
     void ErrorMsgHandler(int iLevel, const char *szMsg) {
         const char *szLevel = nullptr;
 
@@ -35,17 +26,76 @@ namespace libmotioncapture {
         printf("    %s: %s\n", szLevel, szMsg);
     }
 
-    void DataHandler(sFrameOfData *pFrameOfData) {
-        std::lock_guard<std::mutex> lck(mtx);
-        frameOfData = *pFrameOfData;
-    }
-
     class MotionCaptureMotionAnalysisImpl {
     public:
         std::string version = "0.0.0";
         sBodyDefs *pBodyDefs = nullptr;
 
-        int lastFrame = 0;
+        MotionCaptureMotionAnalysis *owner = nullptr;
+        Frame frame; // written by the Cortex thread
+
+        std::mutex mtx; // protects latest, queue and received
+        std::condition_variable cv;
+        bool received = false;
+        Frame latest; // newest frame, handed over in receiveFrame()
+        FrameQueue queue; // frames not yet handed over (DeliverAll)
+
+        explicit MotionCaptureMotionAnalysisImpl(MemoryResource *resource)
+                : frame(resource), latest(resource), queue(64, resource) {
+        }
+
+        // Cortex callbacks carry no user data, so the active instance is global
+        static MotionCaptureMotionAnalysisImpl *instance;
+
+        void handleFrame(const sFrameOfData *pFrameOfData) {
+            const uint64_t hostTimeStamp = hostTime();
+            const uint64_t start = hostTime();
+            frame.setHostTimeStamp(hostTimeStamp);
+            frame.setFrameNumber((uint32_t)pFrameOfData->iFrame);
+
+            frame.invalidate();
+            for (int iBody = 0; iBody < pFrameOfData->nBodies; iBody++) {
+                const sBodyData *Body = &pFrameOfData->BodyData[iBody];
+
+                float centroid[3] = {0, 0, 0};
+
+                for (int iMarker = 0; iMarker < Body->nMarkers; iMarker++) {
+                    centroid[0] += Body->Markers[iMarker][0];
+                    centroid[1] += Body->Markers[iMarker][1];
+                    centroid[2] += Body->Markers[iMarker][2];
+                }
+
+                centroid[0] /= (float) Body->nMarkers;
+                centroid[1] /= (float) Body->nMarkers;
+                centroid[2] /= (float) Body->nMarkers;
+
+                Eigen::Vector3f position(centroid[0], centroid[1], centroid[2]);
+                Eigen::Quaternionf rotation = Eigen::Quaternionf::Identity();
+
+                // bodies are reported in the same order, so slot iBody is checked first
+                size_t slot = frame.findOrAddBody(iBody, Body->szName, iBody);
+                frame.setPose(slot, position, rotation);
+            }
+
+            // invoke the frame callback right here on the Cortex thread,
+            // before the frame is handed over and without holding mtx
+            owner->recordParseTime(hostTime() - start);
+            TRACE_SPAN("decode", start);
+            owner->frameReceived(frame);
+
+            {
+                std::lock_guard<std::mutex> lck(mtx);
+                if (owner->deliveryPolicy() != MotionCapture::DeliverLatest) {
+                    if (!queue.push(frame)) {
+                        owner->recordDropped(1);
+                    }
+                }
+                // bodies are added on the fly, so copy (rather than swap) to keep slots stable
+                latest = frame;
+                received = true;
+            }
+            cv.notify_all();
+        }
 
         ~MotionCaptureMotionAnalysisImpl() {
             if (nullptr != pBodyDefs) {
@@ -54,10 +104,20 @@ namespace libmotioncapture {
         }
     };
 
+    MotionCaptureMotionAnalysisImpl *MotionCaptureMotionAnalysisImpl::instance = nullptr;
+
+    void DataHandler(sFrameOfData *pFrameOfData) {
+        if (MotionCaptureMotionAnalysisImpl::instance) {
+            MotionCaptureMotionAnalysisImpl::instance->handleFrame(pFrameOfData);
+        }
+    }
+
     MotionCaptureMotionAnalysis::MotionCaptureMotionAnalysis(
             const std::string &hostname,
             int updateFrequency) {
-        pImpl = new MotionCaptureMotionAnalysisImpl();
+        pImpl = new MotionCaptureMotionAnalysisImpl(memoryResource_);
+        pImpl->owner = this;
+        MotionCaptureMotionAnalysisImpl::instance = pImpl;
 
         unsigned char SDK_Version[4];
         int retval;
@@ -80,6 +140,9 @@ namespace libmotioncapture {
     }
 
     MotionCaptureMotionAnalysis::~MotionCaptureMotionAnalysis() {
+        stopReceiveThread();
+        Cortex_Exit();
+        MotionCaptureMotionAnalysisImpl::instance = nullptr;
         if (nullptr != pImpl) {
             delete pImpl;
             pImpl = nullptr;
@@ -90,76 +153,24 @@ namespace libmotioncapture {
         return pImpl->version;
     }
 
-    void MotionCaptureMotionAnalysis::waitForNextFrame() {
-        static auto lastTime = std::chrono::high_resolution_clock::now();
-        auto now = std::chrono::high_resolution_clock::now();
-
-        int frameNo;
-        do {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            frameNo = GetCurrentFrame().iFrame;
-        } while (frameNo == pImpl->lastFrame);
-        pImpl->lastFrame = frameNo;
-        lastTime = now;
-    }
-
-    const std::map<std::string, RigidBody> &MotionCaptureMotionAnalysis::rigidBodies() const {
-        rigidBodies_.clear();
-
-        sFrameOfData pFrameOfData = GetCurrentFrame();
-
-        for (int iBody = 0; iBody < pFrameOfData.nBodies; iBody++) {
-            sBodyData *Body = &pFrameOfData.BodyData[iBody];
-
-            float centroid[3] = {0, 0, 0};
-
-            for (int iMarker = 0; iMarker < Body->nMarkers; iMarker++) {
-                centroid[0] += Body->Markers[iMarker][0];
-                centroid[1] += Body->Markers[iMarker][1];
-                centroid[2] += Body->Markers[iMarker][2];
+    bool MotionCaptureMotionAnalysis::receiveFrame(std::chrono::nanoseconds timeout) {
+        // wait for the Cortex thread to deliver a new frame
+        std::unique_lock<std::mutex> lck(pImpl->mtx);
+        if (deliveryPolicy() != DeliverLatest) {
+            if (!pImpl->cv.wait_for(lck, timeout, [this] { return !pImpl->queue.empty(); })) {
+                return false;
             }
-
-            centroid[0] /= (float) Body->nMarkers;
-            centroid[1] /= (float) Body->nMarkers;
-            centroid[2] /= (float) Body->nMarkers;
-
-            Eigen::Vector3f position(centroid[0], centroid[1], centroid[2]);
-            Eigen::Quaternionf rotation = Eigen::Quaternionf::Identity();
-
-            char *bodyName = Body->szName;
-
-            rigidBodies_.emplace(bodyName, RigidBody(bodyName, position, rotation));
+            pImpl->queue.pop(frame_, deliveryPolicy() == DeliverAllWithGapReport);
+            return true;
         }
-
-        return rigidBodies_;
-    }
-
-    RigidBody MotionCaptureMotionAnalysis::rigidBodyByName(const std::string &name) const {
-        sFrameOfData pFrameOfData = GetCurrentFrame();
-
-        for (int iBody = 0; iBody < pFrameOfData.nBodies; iBody++) {
-            sBodyData *Body = &pFrameOfData.BodyData[iBody];
-
-            if (Body->szName == name) {
-                float centroid[3] = {0, 0, 0};
-
-                for (int iMarker = 0; iMarker < Body->nMarkers; iMarker++) {
-                    centroid[0] += Body->Markers[iMarker][0];
-                    centroid[1] += Body->Markers[iMarker][1];
-                    centroid[2] += Body->Markers[iMarker][2];
-                }
-
-                centroid[0] /= (float) Body->nMarkers;
-                centroid[1] /= (float) Body->nMarkers;
-                centroid[2] /= (float) Body->nMarkers;
-
-                Eigen::Vector3f position(centroid[0], centroid[1], centroid[2]);
-                Eigen::Quaternionf rotation = Eigen::Quaternionf::Identity();
-
-                return RigidBody(name, position, rotation);
-            }
+        if (!pImpl->cv.wait_for(lck, timeout, [this] { return pImpl->received; })) {
+            return false;
         }
-        throw std::runtime_error("Rigid body not found");
+        pImpl->received = false;
+
+        // latest is overwritten as a whole by the next frame
+        std::swap(frame_, pImpl->latest);
+        return true;
     }
 
     bool MotionCaptureMotionAnalysis::supportsRigidBodyTracking() const {
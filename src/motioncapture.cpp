@@ -1,5 +1,14 @@
 #include "libmotioncapture/motioncapture.h"
 #include "libmotioncapture/mock.h"
+#include "libmotioncapture/velocity_filter.h"
+#include "trace.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
 #ifdef ENABLE_VICON
 #include "libmotioncapture/vicon.h"
 #endif
@@ -36,13 +45,821 @@ namespace libmotioncapture {
     return version_string;
   }
 
+  // Blocking receives are split into slices of this length, so that the
+  // receive thread notices a stop request.
+  static const std::chrono::milliseconds receiveSlice(100);
+
+  // Receive thread and lock-free single-producer/single-consumer triple
+  // buffer. The producer writes into 'back' and swaps it with 'middle'; the
+  // consumer swaps 'front' with 'middle' if the latter holds a newer frame.
+  class MotionCaptureThread
+  {
+  public:
+    static constexpr int INDEX_MASK = 0x3;
+    static constexpr int NEW_DATA = 0x4;
+
+    explicit MotionCaptureThread(MemoryResource* resource)
+      : buffers{Frame(resource), Frame(resource), Frame(resource)}
+      , middle(1)
+      , back(0)
+      , front(2)
+      , published(0)
+      , waiters(0)
+      , failed(false)
+      , running(false)
+    {
+    }
+
+    // producer
+    void publish(const Frame& frame)
+    {
+      buffers[back] = frame;
+      back = middle.exchange(back | NEW_DATA, std::memory_order_acq_rel) & INDEX_MASK;
+      published.store(frame.sequence());
+
+      // only pay for the mutex if a consumer is blocked
+      if (waiters.load() > 0) {
+        std::lock_guard<std::mutex> lk(mutex);
+        cv.notify_all();
+      }
+    }
+
+    void fail(std::exception_ptr e)
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      error = e;
+      failed = true;
+      cv.notify_all();
+    }
+
+    void check()
+    {
+      if (failed.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lk(mutex);
+        std::rethrow_exception(error);
+      }
+    }
+
+    // consumer (wait-free)
+    bool update()
+    {
+      if ((middle.load(std::memory_order_relaxed) & NEW_DATA) == 0) {
+        return false;
+      }
+      front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+      return true;
+    }
+
+    // consumer (blocking)
+    void wait(uint64_t sequence)
+    {
+      if (published.load() <= sequence) {
+        ++waiters;
+        std::unique_lock<std::mutex> lk(mutex);
+        cv.wait(lk, [&] { return published.load() > sequence || error; });
+        --waiters;
+      }
+      check();
+    }
+
+    // consumer (blocking with deadline); returns false on timeout
+    bool waitUntil(uint64_t sequence, std::chrono::steady_clock::time_point deadline)
+    {
+      bool ok = true;
+      if (published.load() <= sequence) {
+        ++waiters;
+        std::unique_lock<std::mutex> lk(mutex);
+        ok = cv.wait_until(lk, deadline, [&] { return published.load() > sequence || error; });
+        --waiters;
+      }
+      check();
+      return ok;
+    }
+
+  public:
+    Frame buffers[3];
+    std::atomic<int> middle;
+    int back;
+    int front;
+    std::atomic<uint64_t> published;
+    std::atomic<int> waiters;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr error;
+    std::atomic<bool> failed;
+
+    std::atomic<bool> running;
+    std::thread thread;
+  };
+
+  // Fixed-capacity ring of the poses of the last frames. Storage is
+  // body-major ([slot][position in ring]), so the history of one body is
+  // contiguous. It only reallocates when bodies are added.
+  class FrameHistory
+  {
+  public:
+    FrameHistory(size_t capacity, size_t bodies, MemoryResource* resource)
+      : capacity(capacity)
+      , size(0)
+      , head(0)
+      , bodies(0)
+      , sequences(capacity, 0, ResourceAllocator<uint64_t>(resource))
+      , hostTimeStamps(capacity, 0, ResourceAllocator<uint64_t>(resource))
+      , exposureTimes(capacity, 0, ResourceAllocator<int64_t>(resource))
+      , valid(ResourceAllocator<uint8_t>(resource))
+      , positions(ResourceAllocator<Eigen::Vector3f>(resource))
+      , rotations(ResourceAllocator<Eigen::Quaternionf>(resource))
+    {
+      resize(bodies);
+    }
+
+    void push(const Frame& frame)
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      if (frame.size() > bodies) {
+        resize(frame.size());
+      }
+      sequences[head] = frame.sequence();
+      hostTimeStamps[head] = frame.hostTimeStamp();
+      double latency = 0;
+      for (const auto& info : frame.latency()) {
+        latency += info.value();
+      }
+      exposureTimes[head] = (int64_t)frame.hostTimeStamp() - (int64_t)(latency * 1e9);
+      for (size_t i = 0; i < frame.size(); ++i) {
+        const size_t k = i * capacity + head;
+        valid[k] = frame.validFlags()[i];
+        positions[k] = frame.positions()[i];
+        rotations[k] = frame.rotations()[i];
+      }
+      head = (head + 1) % capacity;
+      size = std::min(size + 1, capacity);
+    }
+
+    size_t poses(BodyHandle handle, uint64_t t0, uint64_t t1, TimedPoseVector& result) const
+    {
+      result.clear();
+      std::lock_guard<std::mutex> lk(mutex);
+      if (handle < 0 || (size_t)handle >= bodies) {
+        return 0;
+      }
+      // records are ordered by time, so binary search for the first one >= t0
+      size_t lo = 0;
+      size_t hi = size;
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (hostTimeStamps[ring(mid)] < t0) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      for (size_t r = lo; r < size; ++r) {
+        const size_t p = ring(r);
+        if (hostTimeStamps[p] > t1) {
+          break;
+        }
+        const size_t k = handle * capacity + p;
+        if (valid[k]) {
+          TimedPose pose;
+          pose.sequence = sequences[p];
+          pose.hostTimeStamp = hostTimeStamps[p];
+          pose.position = positions[k];
+          pose.rotation = rotations[k];
+          result.push_back(pose);
+        }
+      }
+      return result.size();
+    }
+
+    bool frameAt(uint64_t sequence, Frame& frame) const
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      if (size == 0) {
+        return false;
+      }
+      // sequence numbers are consecutive within the ring
+      const uint64_t newest = sequences[ring(size - 1)];
+      if (sequence > newest || newest - sequence >= size) {
+        return false;
+      }
+      const size_t p = ring(size - 1 - (newest - sequence));
+      frame.setSequence(sequences[p]);
+      frame.setHostTimeStamp(hostTimeStamps[p]);
+      frame.invalidate();
+      const size_t count = std::min(frame.size(), bodies);
+      for (size_t i = 0; i < count; ++i) {
+        const size_t k = i * capacity + p;
+        if (valid[k]) {
+          frame.setPose(i, positions[k], rotations[k]);
+        }
+      }
+      return true;
+    }
+
+    Pose predict(BodyHandle handle, uint64_t time, MotionCapture::PredictionModel model) const
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      const Pose invalid(Eigen::Vector3f::Zero(), Eigen::Quaternionf::Identity(), false);
+      if (handle < 0 || (size_t)handle >= bodies) {
+        return invalid;
+      }
+
+      // newest tracked samples, newest first
+      const size_t needed = model == MotionCapture::ConstantAcceleration ? 3 : 2;
+      size_t p[3];
+      size_t n = 0;
+      for (size_t r = size; r > 0 && n < needed; --r) {
+        const size_t pos = ring(r - 1);
+        if (valid[handle * capacity + pos]) {
+          p[n++] = pos;
+        }
+      }
+      if (n == 0) {
+        return invalid;
+      }
+
+      const size_t k0 = handle * capacity + p[0];
+      const Eigen::Vector3f& x0 = positions[k0];
+      const Eigen::Quaternionf& q0 = rotations[k0];
+      if (n == 1) {
+        return Pose(x0, q0, true);
+      }
+
+      const size_t k1 = handle * capacity + p[1];
+      const float dt01 = (exposureTimes[p[0]] - exposureTimes[p[1]]) * 1e-9f;
+      const float dt = ((int64_t)time - exposureTimes[p[0]]) * 1e-9f;
+      if (dt01 <= 0) {
+        return Pose(x0, q0, true);
+      }
+
+      // velocities over the last interval (valid at its midpoint)
+      Eigen::Vector3f v = (x0 - positions[k1]) / dt01;
+      Eigen::Vector3f w = rotationVector(rotations[k1], q0) / dt01;
+      Eigen::Vector3f a = Eigen::Vector3f::Zero();
+      Eigen::Vector3f alpha = Eigen::Vector3f::Zero();
+
+      if (n == 3) {
+        const size_t k2 = handle * capacity + p[2];
+        const float dt12 = (exposureTimes[p[1]] - exposureTimes[p[2]]) * 1e-9f;
+        if (dt12 > 0) {
+          const Eigen::Vector3f v1 = (positions[k1] - positions[k2]) / dt12;
+          const Eigen::Vector3f w1 = rotationVector(rotations[k2], rotations[k1]) / dt12;
+          const float dtMid = 0.5f * (dt01 + dt12);
+          a = (v - v1) / dtMid;
+          alpha = (w - w1) / dtMid;
+        }
+      }
+      // advance the velocities from the interval midpoint to the newest sample
+      v += a * (0.5f * dt01);
+      w += alpha * (0.5f * dt01);
+
+      const Eigen::Vector3f position = x0 + v * dt + 0.5f * a * dt * dt;
+      const Eigen::Vector3f theta = w * dt + 0.5f * alpha * dt * dt;
+      const float angle = theta.norm();
+      Eigen::Quaternionf rotation = q0;
+      if (angle > 0) {
+        // angular velocity is in body coordinates
+        rotation = (q0 * Eigen::Quaternionf(Eigen::AngleAxisf(angle, theta / angle))).normalized();
+      }
+      return Pose(position, rotation, true);
+    }
+
+  private:
+    // rotation from 'from' to 'to' in body coordinates, as axis * angle
+    static Eigen::Vector3f rotationVector(const Eigen::Quaternionf& from, const Eigen::Quaternionf& to)
+    {
+      Eigen::Quaternionf dq = from.conjugate() * to;
+      if (dq.w() < 0) {
+        dq.coeffs() = -dq.coeffs(); // shortest path
+      }
+      const Eigen::AngleAxisf aa(dq.normalized());
+      return aa.axis() * aa.angle();
+    }
+
+    // position in the ring of the r-th oldest record
+    size_t ring(size_t r) const
+    {
+      return (head + capacity - size + r) % capacity;
+    }
+
+    void resize(size_t count)
+    {
+      bodies = count;
+      valid.resize(bodies * capacity, 0);
+      positions.resize(bodies * capacity, Eigen::Vector3f::Zero());
+      rotations.resize(bodies * capacity, Eigen::Quaternionf::Identity());
+    }
+
+  private:
+    size_t capacity;
+    size_t size;
+    size_t head; // next position to write
+    size_t bodies;
+    std::vector<uint64_t, ResourceAllocator<uint64_t> > sequences;
+    std::vector<uint64_t, ResourceAllocator<uint64_t> > hostTimeStamps;
+    std::vector<int64_t, ResourceAllocator<int64_t> > exposureTimes; // host clock, ns
+    std::vector<uint8_t, ResourceAllocator<uint8_t> > valid;
+    Frame::Vector3Vector positions;
+    Frame::QuaternionVector rotations;
+    mutable std::mutex mutex;
+  };
+
+  // Extends native frame numbers to 64 bits and counts lost, duplicated and
+  // reordered frames. update() is only called by the decoding thread; the
+  // counters may be read concurrently.
+  class FrameNumberTracker
+  {
+  public:
+    // frames more than this far behind the newest one mean that the frame
+    // numbers restarted (e.g. server restarted), not that a frame is late
+    static constexpr uint64_t MAX_REORDER = 1000;
+
+    FrameNumberTracker()
+      : m_newest(0)
+      , m_started(false)
+      , m_received(0)
+      , m_dropped(0)
+      , m_duplicated(0)
+      , m_reordered(0)
+    {
+    }
+
+    // returns the extended frame number and sets 'gap' to the number of
+    // frames skipped right before it
+    uint64_t update(uint64_t native, uint64_t& gap)
+    {
+      increment(m_received, 1);
+      gap = 0;
+      if (!m_started) {
+        m_started = true;
+        m_newest = native;
+        return native;
+      }
+
+      // choose the 64 bit number closest to the newest frame
+      const uint64_t period = 1ULL << 32;
+      uint64_t number = (m_newest & ~(period - 1)) | (native & (period - 1));
+      if (number + period / 2 < m_newest) {
+        number += period;
+      } else if (number > m_newest + period / 2 && number >= period) {
+        number -= period;
+      }
+
+      if (number == m_newest) {
+        increment(m_duplicated, 1);
+      } else if (number + MAX_REORDER < m_newest) {
+        // continue from the new numbers; the counters are kept
+        m_newest = number;
+      } else if (number < m_newest) {
+        increment(m_reordered, 1);
+        if (m_dropped.load(std::memory_order_relaxed) > 0) {
+          increment(m_dropped, -1);
+        }
+      } else {
+        gap = number - m_newest - 1;
+        increment(m_dropped, gap);
+        m_newest = number;
+      }
+      return number;
+    }
+
+    // frames that were received but then discarded by the backend
+    void addDropped(uint64_t count)
+    {
+      increment(m_dropped, count);
+    }
+
+    FrameCounters counters() const
+    {
+      FrameCounters result;
+      result.received = m_received.load(std::memory_order_relaxed);
+      result.dropped = m_dropped.load(std::memory_order_relaxed);
+      result.duplicated = m_duplicated.load(std::memory_order_relaxed);
+      result.reordered = m_reordered.load(std::memory_order_relaxed);
+      return result;
+    }
+
+  private:
+    // single writer: no read-modify-write needed
+    static void increment(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+  private:
+    uint64_t m_newest;
+    bool m_started;
+    std::atomic<uint64_t> m_received;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_duplicated;
+    std::atomic<uint64_t> m_reordered;
+  };
+
+  // Histogram that can be recorded into from several threads
+  class AtomicHistogram
+  {
+  public:
+    AtomicHistogram()
+      : m_count(0)
+      , m_sum(0)
+      , m_max(0)
+    {
+      for (auto& count : m_counts) {
+        count.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    void record(uint64_t value)
+    {
+      m_counts[Histogram::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+      m_count.fetch_add(1, std::memory_order_relaxed);
+      m_sum.fetch_add(value, std::memory_order_relaxed);
+      uint64_t max = m_max.load(std::memory_order_relaxed);
+      while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+      }
+    }
+
+    void load(Histogram& result) const
+    {
+      for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+        result.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+      }
+      result.count = m_count.load(std::memory_order_relaxed);
+      result.sum = m_sum.load(std::memory_order_relaxed);
+      result.max = m_max.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> m_counts[Histogram::BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+  };
+
+  // Storage behind MotionCapture::stats()
+  class StatsCollector
+  {
+  public:
+    StatsCollector()
+      : bytesReceived(0)
+      , lastHostTimeStamp(0)
+      , lastInterval(0)
+    {
+    }
+
+    // called by the decoding thread for every frame
+    void recordFrame(uint64_t hostTimeStamp)
+    {
+      if (lastHostTimeStamp != 0 && hostTimeStamp > lastHostTimeStamp) {
+        const uint64_t interval = hostTimeStamp - lastHostTimeStamp;
+        frameInterval.record(interval);
+        if (lastInterval != 0) {
+          intervalJitter.record(interval > lastInterval ? interval - lastInterval : lastInterval - interval);
+        }
+        lastInterval = interval;
+      }
+      lastHostTimeStamp = hostTimeStamp;
+    }
+
+  public:
+    std::atomic<uint64_t> bytesReceived;
+    AtomicHistogram drainDepth;
+    AtomicHistogram parseTime;
+    AtomicHistogram conversionTime;
+    AtomicHistogram frameInterval;
+    AtomicHistogram intervalJitter;
+    AtomicHistogram waitTime;
+
+  private:
+    uint64_t lastHostTimeStamp;
+    uint64_t lastInterval;
+  };
+
+  // resource for the backend that connect() constructs on this thread
+  static thread_local MemoryResource* constructionResource = nullptr;
+
+  MotionCapture::MotionCapture()
+    : memoryResource_(constructionResource ? constructionResource : newDeleteResource())
+    , frame_(memoryResource_)
+    , thread_(nullptr)
+    , history_(nullptr)
+    , sequence_(0)
+    , frameNumbers_(new FrameNumberTracker())
+    , stats_(new StatsCollector())
+    , deliveryPolicy_(DeliverLatest)
+    , velocityFilter_(nullptr)
+  {
+  }
+
+  MotionCapture::~MotionCapture()
+  {
+    stopReceiveThread();
+    delete history_;
+    delete velocityFilter_;
+    delete frameNumbers_;
+    delete stats_;
+  }
+
+  void MotionCapture::waitForNextFrame()
+  {
+    TRACE_SCOPE("waitForNextFrame");
+    const uint64_t start = hostTime();
+    if (thread_) {
+      waitForFrameAfter(thread_->buffers[thread_->front].sequence());
+    } else {
+      while (!receiveFrame(receiveSlice)) {
+      }
+    }
+    stats_->waitTime.record(hostTime() - start);
+  }
+
+  bool MotionCapture::waitForNextFrame(std::chrono::nanoseconds timeout)
+  {
+    TRACE_SCOPE("waitForNextFrame");
+    const uint64_t start = hostTime();
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    bool received = false;
+    if (thread_) {
+      received = thread_->waitUntil(thread_->buffers[thread_->front].sequence(), deadline);
+      if (received) {
+        thread_->update();
+      }
+    } else {
+      // backends may return early, e.g. for non-frame packets
+      do {
+        received = receiveFrame(std::max(deadline - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration::zero()));
+      } while (!received && std::chrono::steady_clock::now() < deadline);
+    }
+    stats_->waitTime.record(hostTime() - start);
+    return received;
+  }
+
+  bool MotionCapture::tryGetNextFrame()
+  {
+    if (thread_) {
+      if (thread_->update()) {
+        return true;
+      }
+      thread_->check();
+      return false;
+    }
+    return receiveFrame(std::chrono::nanoseconds::zero());
+  }
+
+  void MotionCapture::setFrameCallback(FrameCallback callback)
+  {
+    std::lock_guard<std::mutex> lk(callbackMutex_);
+    callback_ = callback;
+  }
+
+  void MotionCapture::frameReceived(Frame& frame)
+  {
+    frame.setSequence(++sequence_);
+
+    uint64_t gap;
+    frame.setFrameNumber(frameNumbers_->update(frame.frameNumber(), gap));
+    frame.setGap(deliveryPolicy() == DeliverAllWithGapReport ? gap : 0);
+    stats_->recordFrame(frame.hostTimeStamp());
+
+    if (frame.timeStamp() != 0) {
+      std::lock_guard<std::mutex> lk(clockSyncMutex_);
+      clockSync_.addSample(frame.timeStamp(), frame.hostTimeStamp());
+    }
+
+    std::lock_guard<std::mutex> lk(callbackMutex_);
+    if (velocityFilter_) {
+      velocityFilter_->update(frame);
+    }
+    if (history_) {
+      history_->push(frame);
+    }
+    if (callback_) {
+      TRACE_SCOPE("callback");
+      callback_(frame);
+    }
+  }
+
+  void MotionCapture::setDeliveryPolicy(DeliveryPolicy policy)
+  {
+    deliveryPolicy_.store(policy, std::memory_order_relaxed);
+  }
+
+  FrameCounters MotionCapture::frameCounters() const
+  {
+    return frameNumbers_->counters();
+  }
+
+  Stats MotionCapture::stats() const
+  {
+    Stats result;
+    result.frames = frameNumbers_->counters();
+    result.bytesReceived = stats_->bytesReceived.load(std::memory_order_relaxed);
+    stats_->drainDepth.load(result.drainDepth);
+    stats_->parseTime.load(result.parseTime);
+    stats_->conversionTime.load(result.conversionTime);
+    stats_->frameInterval.load(result.frameInterval);
+    stats_->intervalJitter.load(result.intervalJitter);
+    stats_->waitTime.load(result.waitTime);
+    return result;
+  }
+
+  void MotionCapture::recordDropped(uint64_t frames)
+  {
+    frameNumbers_->addDropped(frames);
+  }
+
+  void MotionCapture::recordReceived(size_t bytes, size_t datagrams)
+  {
+    stats_->bytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+    stats_->drainDepth.record(datagrams);
+  }
+
+  void MotionCapture::recordParseTime(uint64_t ns)
+  {
+    stats_->parseTime.record(ns);
+  }
+
+  void MotionCapture::enableHistory(size_t capacity)
+  {
+    // SDK threads may already deliver frames
+    std::lock_guard<std::mutex> lk(callbackMutex_);
+    delete history_;
+    history_ = capacity > 0 ? new FrameHistory(capacity, frame_.size(), memoryResource_) : nullptr;
+  }
+
+  void MotionCapture::enableVelocityEstimation(
+    bool enable,
+    float alpha,
+    float beta)
+  {
+    std::lock_guard<std::mutex> lk(callbackMutex_);
+    delete velocityFilter_;
+    velocityFilter_ = enable ? new VelocityFilter(alpha, beta) : nullptr;
+  }
+
+  size_t MotionCapture::history(
+    BodyHandle handle,
+    uint64_t t0,
+    uint64_t t1,
+    TimedPoseVector& poses) const
+  {
+    if (!history_) {
+      throw std::runtime_error("Frame history is not enabled!");
+    }
+    return history_->poses(handle, t0, t1, poses);
+  }
+
+  Pose MotionCapture::predictPose(
+    BodyHandle handle,
+    uint64_t hostTimeNs,
+    PredictionModel model) const
+  {
+    if (!history_) {
+      throw std::runtime_error("Frame history is not enabled!");
+    }
+    return history_->predict(handle, hostTimeNs, model);
+  }
+
+  bool MotionCapture::frameAt(uint64_t sequence, Frame& frame) const
+  {
+    if (!history_) {
+      throw std::runtime_error("Frame history is not enabled!");
+    }
+    return history_->frameAt(sequence, frame);
+  }
+
+  uint64_t MotionCapture::toHostTime(uint64_t deviceTime) const
+  {
+    std::lock_guard<std::mutex> lk(clockSyncMutex_);
+    if (!clockSync_.valid()) {
+      throw std::runtime_error("No device timestamps received!");
+    }
+    return clockSync_.toHostTime(deviceTime);
+  }
+
+  void MotionCapture::startReceiveThread()
+  {
+    if (thread_) {
+      return;
+    }
+    thread_ = new MotionCaptureThread(memoryResource_);
+    // all buffers start with the known rigid body slots
+    for (auto& buffer : thread_->buffers) {
+      buffer = frame_;
+    }
+    thread_->published = frame_.sequence();
+    thread_->running = true;
+    thread_->thread = std::thread(&MotionCapture::receiveLoop, this);
+  }
+
+  void MotionCapture::stopReceiveThread()
+  {
+    if (!thread_) {
+      return;
+    }
+    thread_->running = false;
+    thread_->thread.join();
+    delete thread_;
+    thread_ = nullptr;
+  }
+
+  void MotionCapture::receiveLoop()
+  {
+    try {
+      while (thread_->running) {
+        if (receiveFrame(receiveSlice)) {
+          thread_->publish(frame_);
+        }
+      }
+    } catch (...) {
+      // reported to the consumer on its next blocking call
+      thread_->fail(std::current_exception());
+    }
+  }
+
+  const Frame& MotionCapture::latestFrame()
+  {
+    if (thread_) {
+      thread_->update();
+    }
+    return currentFrame();
+  }
+
+  const Frame& MotionCapture::waitForFrameAfter(uint64_t sequence)
+  {
+    if (thread_) {
+      thread_->wait(sequence);
+      thread_->update();
+    } else {
+      while (frame_.sequence() <= sequence) {
+        waitForNextFrame();
+      }
+    }
+    return currentFrame();
+  }
+
+  const Frame& MotionCapture::currentFrame() const
+  {
+    if (thread_) {
+      return thread_->buffers[thread_->front];
+    }
+    return frame_;
+  }
+
+  const std::map<std::string, RigidBody>& MotionCapture::rigidBodies() const
+  {
+    TRACE_SCOPE("rigidBodies");
+    const uint64_t start = hostTime();
+    const Frame& frame = currentFrame();
+
+    // while the same bodies are tracked, update the entries in place so
+    // that steady-state calls do not allocate
+    size_t tracked = 0;
+    bool known = true;
+    for (size_t i = 0; i < frame.size() && known; ++i) {
+      if (frame.valid(i)) {
+        ++tracked;
+        const auto iter = rigidBodies_.find(frame.name(i));
+        if (iter != rigidBodies_.end()) {
+          iter->second.m_position = frame.position(i);
+          iter->second.m_rotation = frame.rotation(i);
+        } else {
+          known = false;
+        }
+      }
+    }
+
+    if (!known || tracked != rigidBodies_.size()) {
+      rigidBodies_.clear();
+      for (size_t i = 0; i < frame.size(); ++i) {
+        if (frame.valid(i)) {
+          rigidBodies_.emplace(frame.name(i), RigidBody(frame.name(i), frame.position(i), frame.rotation(i)));
+        }
+      }
+    }
+    stats_->conversionTime.record(hostTime() - start);
+    return rigidBodies_;
+  }
+
   RigidBody MotionCapture::rigidBodyByName(
       const std::string& name) const
   {
-    const auto& obj = rigidBodies();
-    const auto iter = obj.find(name);
-    if (iter != obj.end()) {
-      return iter->second;
+    const Frame& frame = currentFrame();
+    int slot = frame.find(name.c_str());
+    if (slot >= 0 && frame.valid(slot)) {
+      return RigidBody(name, frame.position(slot), frame.rotation(slot));
+    }
+    throw std::runtime_error("Rigid body not found!");
+  }
+
+  BodyHandle MotionCapture::resolve(
+      const std::string& name) const
+  {
+    int slot = currentFrame().find(name.c_str());
+    if (slot >= 0) {
+      return slot;
     }
     throw std::runtime_error("Rigid body not found!");
   }
@@ -93,6 +910,16 @@ namespace libmotioncapture {
   {
     MotionCapture* mocap = nullptr;
 
+    DeliveryPolicy deliveryPolicy = DeliverLatest;
+    const std::string deliveryPolicyName = getString(cfg, "delivery_policy", "latest");
+    if (deliveryPolicyName == "all") {
+      deliveryPolicy = DeliverAll;
+    } else if (deliveryPolicyName == "all_with_gap_report") {
+      deliveryPolicy = DeliverAllWithGapReport;
+    } else if (deliveryPolicyName != "latest") {
+      throw std::runtime_error("Unknown delivery policy " + deliveryPolicyName + "!");
+    }
+
     if (false)
     {
     }
@@ -171,7 +998,10 @@ namespace libmotioncapture {
       mocap = new libmotioncapture::MotionCaptureOptitrack(
         getString(cfg, "hostname", "localhost"),
         getString(cfg, "interface_ip", "0.0.0.0"),
-        getInt(cfg, "port_command", 1510));
+        getInt(cfg, "port_command", 1510),
+        getBool(cfg, "enable_objects", true),
+        getBool(cfg, "enable_pointcloud", true),
+        getString(cfg, "subscribe_rigid_bodies", ""));
     }
 #endif
 #ifdef ENABLE_OPTITRACK_CLOSED_SOURCE
@@ -230,7 +1060,40 @@ namespace libmotioncapture {
       throw std::runtime_error("Unknown motion capture type!");
     }
 
+    mocap->setDeliveryPolicy(deliveryPolicy);
+
+    int history = getInt(cfg, "history", 0);
+    if (history > 0) {
+      mocap->enableHistory(history);
+    }
+    if (getBool(cfg, "velocity", false)) {
+      mocap->enableVelocityEstimation(true);
+    }
+    if (getBool(cfg, "threaded", false)) {
+      mocap->startReceiveThread();
+    }
+
     return mocap;
   }
 
+  MotionCapture *MotionCapture::connect(
+      const std::string &type,
+      const std::map<std::string, std::string> &cfg,
+      MemoryResource* resource)
+  {
+    struct ConstructionScope
+    {
+      explicit ConstructionScope(MemoryResource* resource)
+      {
+        constructionResource = resource;
+      }
+
+      ~ConstructionScope()
+      {
+        constructionResource = nullptr;
+      }
+    } scope(resource);
+    return connect(type, cfg);
+  }
+
 }
@@ -0,0 +1,429 @@
+#include "libmotioncapture/natnet.h"
+
+#include <cstring>
+
+namespace libmotioncapture {
+
+  namespace {
+
+    struct Truncated {};
+
+    // Reads little-endian values from a packet; throws Truncated instead of
+    // reading past its end
+    class Reader
+    {
+    public:
+      Reader(const char* data, size_t size)
+        : m_ptr(data)
+        , m_end(data + size)
+      {
+      }
+
+      template<typename T>
+      T read()
+      {
+        T value;
+        require(sizeof(T));
+        memcpy(&value, m_ptr, sizeof(T));
+        m_ptr += sizeof(T);
+        return value;
+      }
+
+      // reads a count that is followed by at least 'elementSize' bytes per element
+      size_t readCount(size_t elementSize)
+      {
+        int32_t count = read<int32_t>();
+        if (count < 0 || (size_t)count * elementSize > remaining()) {
+          throw Truncated();
+        }
+        return count;
+      }
+
+      void skip(size_t bytes)
+      {
+        require(bytes);
+        m_ptr += bytes;
+      }
+
+      std::string readString()
+      {
+        const char* begin = m_ptr;
+        skipString();
+        return std::string(begin, m_ptr - 1);
+      }
+
+      void skipString()
+      {
+        const void* nul = memchr(m_ptr, 0, remaining());
+        if (!nul) {
+          throw Truncated();
+        }
+        m_ptr = static_cast<const char*>(nul) + 1;
+      }
+
+      size_t remaining() const
+      {
+        return m_end - m_ptr;
+      }
+
+      const char* position() const
+      {
+        return m_ptr;
+      }
+
+      // returns the next 'bytes' bytes and skips them
+      const char* take(size_t bytes)
+      {
+        require(bytes);
+        const char* begin = m_ptr;
+        m_ptr += bytes;
+        return begin;
+      }
+
+    private:
+      void require(size_t bytes) const
+      {
+        if (bytes > remaining()) {
+          throw Truncated();
+        }
+      }
+
+    private:
+      const char* m_ptr;
+      const char* m_end;
+    };
+
+    template<typename T>
+    T load(const char* p)
+    {
+      T value;
+      memcpy(&value, p, sizeof(T));
+      return value;
+    }
+
+    // Which fields a frame of mocap data has. This one covers all versions
+    // at runtime (needed before NatNet 3.0, where they change with almost
+    // every minor version); the ones below fix the layout at compile time.
+    struct FrameLayout
+    {
+      FrameLayout(int major, int minor)
+        : dataSizes((major == 4 && minor > 0) || major > 4)
+        , params((major == 2 && minor >= 6) || major > 2 || major == 0)
+        , meanError(major >= 2)
+        , skeletons((major == 2 && minor > 0) || major > 2)
+        , labeledMarkers((major == 2 && minor >= 3) || major > 2)
+        , residual(major >= 3 || major == 0)
+        , forcePlates((major == 2 && minor >= 9) || major > 2)
+        , devices((major == 2 && minor >= 11) || major > 2)
+        , softwareLatency(major < 3)
+        , doubleTimestamp((major == 2 && minor >= 7) || major > 2)
+        , highResTimestamps(major >= 3 || major == 0)
+      {
+      }
+
+      bool dataSizes;         // data sets are prefixed with their size (4.1)
+      bool params;            // rigid bodies and markers have params (2.6)
+      bool meanError;         // of rigid bodies (2.0)
+      bool skeletons;         // (2.1)
+      bool labeledMarkers;    // (2.3)
+      bool residual;          // of labeled markers (3.0)
+      bool forcePlates;       // (2.9)
+      bool devices;           // (2.11)
+      bool softwareLatency;   // (removed in 3.0)
+      bool doubleTimestamp;   // (2.7)
+      bool highResTimestamps; // (3.0)
+    };
+
+    // NatNet 3.0 to 4.0
+    struct FrameLayout3
+    {
+      static constexpr bool dataSizes = false;
+      static constexpr bool params = true;
+      static constexpr bool meanError = true;
+      static constexpr bool skeletons = true;
+      static constexpr bool labeledMarkers = true;
+      static constexpr bool residual = true;
+      static constexpr bool forcePlates = true;
+      static constexpr bool devices = true;
+      static constexpr bool softwareLatency = false;
+      static constexpr bool doubleTimestamp = true;
+      static constexpr bool highResTimestamps = true;
+    };
+
+    // NatNet 4.1 and later
+    struct FrameLayout41 : FrameLayout3
+    {
+      static constexpr bool dataSizes = true;
+    };
+
+    // Decodes the frame after the packet header. The arrays of markers and
+    // rigid bodies are bounds-checked as a whole and then read at a fixed
+    // stride.
+    template<typename Layout>
+    void decodeFrame(Reader& r, const Layout& layout, NatNetFrameVisitor& visitor)
+    {
+      const size_t rigidBodySize = 32 + (layout.meanError ? 4 : 0) + (layout.params ? 2 : 0);
+      const size_t labeledMarkerSize = 20 + (layout.params ? 2 : 0) + (layout.residual ? 4 : 0);
+
+      visitor.beginFrame(r.read<int32_t>());
+
+      // marker sets (we do not support them)
+      size_t nMarkerSets = r.readCount(1);
+      if (layout.dataSizes) {
+        r.skip(4);
+      }
+      for (size_t i = 0; i < nMarkerSets; ++i) {
+        r.skipString();
+        size_t nMarkers = r.readCount(12);
+        r.skip(nMarkers * 12);
+      }
+
+      // legacy unlabeled markers
+      size_t nOtherMarkers = r.readCount(12);
+      if (layout.dataSizes) {
+        r.skip(4);
+      }
+      visitor.beginMarkers(nOtherMarkers);
+      const char* p = r.take(nOtherMarkers * 12);
+      for (size_t i = 0; i < nOtherMarkers; ++i, p += 12) {
+        visitor.marker(load<float>(p), load<float>(p + 4), load<float>(p + 8));
+      }
+
+      // rigid bodies
+      size_t nRigidBodies = r.readCount(rigidBodySize);
+      if (layout.dataSizes) {
+        r.skip(4);
+      }
+      p = r.take(nRigidBodies * rigidBodySize);
+      for (size_t i = 0; i < nRigidBodies; ++i, p += rigidBodySize) {
+        NatNetRigidBody rb;
+        rb.id = load<int32_t>(p);
+        rb.x = load<float>(p + 4);
+        rb.y = load<float>(p + 8);
+        rb.z = load<float>(p + 12);
+        rb.qx = load<float>(p + 16);
+        rb.qy = load<float>(p + 20);
+        rb.qz = load<float>(p + 24);
+        rb.qw = load<float>(p + 28);
+        rb.meanError = layout.meanError ? load<float>(p + 32) : 0.0f;
+        // older versions do not report tracking state
+        rb.tracked = layout.params
+          ? (load<int16_t>(p + rigidBodySize - 2) & 0x01) != 0
+          : true;
+        visitor.rigidBody(rb);
+      }
+
+      // skeletons (we do not support them)
+      if (layout.skeletons) {
+        size_t nSkeletons = r.readCount(8);
+        if (layout.dataSizes) {
+          r.skip(4);
+        }
+        for (size_t i = 0; i < nSkeletons; ++i) {
+          r.skip(4); // skeleton ID
+          size_t nBones = r.readCount(rigidBodySize);
+          r.skip(nBones * rigidBodySize);
+        }
+      }
+
+      // assets (NatNet 4.1 and later; we do not support them)
+      if (layout.dataSizes) {
+        r.skip(4); // asset count
+        int32_t nBytes = r.read<int32_t>();
+        if (nBytes < 0) {
+          throw Truncated();
+        }
+        r.skip(nBytes);
+      }
+
+      // labeled markers
+      if (layout.labeledMarkers) {
+        size_t nLabeledMarkers = r.readCount(labeledMarkerSize);
+        if (layout.dataSizes) {
+          r.skip(4);
+        }
+        visitor.beginMarkers(nLabeledMarkers);
+        p = r.take(nLabeledMarkers * labeledMarkerSize);
+        for (size_t i = 0; i < nLabeledMarkers; ++i, p += labeledMarkerSize) {
+          // after the ID; followed by size, params and residual
+          visitor.marker(load<float>(p + 4), load<float>(p + 8), load<float>(p + 12));
+        }
+      }
+
+      // force plates and devices share a layout: ID, then per channel a
+      // list of floats
+      for (int section = 0; section < 2; ++section) {
+        if ((section == 0 && !layout.forcePlates) || (section == 1 && !layout.devices)) {
+          continue;
+        }
+        size_t nItems = r.readCount(8);
+        if (layout.dataSizes) {
+          r.skip(4);
+        }
+        for (size_t i = 0; i < nItems; ++i) {
+          r.skip(4); // ID
+          size_t nChannels = r.readCount(4);
+          for (size_t c = 0; c < nChannels; ++c) {
+            size_t nFrames = r.readCount(4);
+            r.skip(nFrames * 4);
+          }
+        }
+      }
+
+      if (layout.softwareLatency) {
+        r.skip(4);
+      }
+
+      // timecode and sub-frame
+      r.skip(8);
+
+      r.skip(layout.doubleTimestamp ? 8 : 4);
+
+      if (layout.highResTimestamps) {
+        uint64_t cameraMidExposure = r.read<uint64_t>();
+        uint64_t cameraDataReceived = r.read<uint64_t>();
+        uint64_t transmit = r.read<uint64_t>();
+        visitor.timestamps(cameraMidExposure, cameraDataReceived, transmit);
+      }
+
+      visitor.endFrame(r.read<uint16_t>());
+    }
+
+  } // namespace
+
+  int NatNetFrameDecoder::messageId(const char* data, size_t size)
+  {
+    if (size < 4) {
+      return -1;
+    }
+    uint16_t id;
+    memcpy(&id, data, 2);
+    return id;
+  }
+
+  void NatNetFrameDecoder::setVersion(int versionMajor, int versionMinor)
+  {
+    m_major = versionMajor;
+    m_minor = versionMinor;
+    if ((versionMajor == 4 && versionMinor > 0) || versionMajor > 4) {
+      m_layout = LAYOUT_4_1;
+    } else if (versionMajor >= 3) {
+      m_layout = LAYOUT_3;
+    } else {
+      m_layout = LAYOUT_GENERIC;
+    }
+  }
+
+  bool NatNetFrameDecoder::decode(
+    const char* data,
+    size_t size,
+    NatNetFrameVisitor& visitor) const
+  {
+    if (messageId(data, size) != MESSAGE_FRAMEOFDATA) {
+      return false;
+    }
+
+    try {
+      Reader r(data, size);
+      r.skip(4); // message ID and byte count
+      switch (m_layout) {
+      case LAYOUT_4_1:
+        decodeFrame(r, FrameLayout41(), visitor);
+        break;
+      case LAYOUT_3:
+        decodeFrame(r, FrameLayout3(), visitor);
+        break;
+      default:
+        decodeFrame(r, FrameLayout(m_major, m_minor), visitor);
+        break;
+      }
+    } catch (const Truncated&) {
+      return false;
+    }
+    return true;
+  }
+
+  bool NatNetFrameDecoder::decodeModelDef(
+    const char* data,
+    size_t size,
+    std::vector<NatNetRigidBodyDescription>& bodies) const
+  {
+    bodies.clear();
+    if (messageId(data, size) != MESSAGE_MODELDEF) {
+      return false;
+    }
+
+    const int major = m_major;
+    const int minor = m_minor;
+    const bool hasDataSizes = (major == 4 && minor > 0) || major > 4;
+
+    try {
+      Reader r(data, size);
+      r.skip(4); // message ID and byte count
+
+      size_t nDatasets = r.readCount(4);
+      for (size_t i = 0; i < nDatasets; ++i) {
+        int32_t type = r.read<int32_t>();
+        const char* end = nullptr;
+        if (hasDataSizes) {
+          size_t nBytes = r.readCount(1);
+          end = r.position() + nBytes;
+        }
+
+        if (type == 1) { // rigid body
+          NatNetRigidBodyDescription rb;
+          if (major >= 2) {
+            rb.name = r.readString();
+          }
+          rb.id = r.read<int32_t>();
+          rb.parentId = r.read<int32_t>();
+          rb.xOffset = r.read<float>();
+          rb.yOffset = r.read<float>();
+          rb.zOffset = r.read<float>();
+          bodies.push_back(rb);
+          if (!hasDataSizes && major >= 3) {
+            // marker positions and required active labels
+            size_t nMarkers = r.readCount(16);
+            r.skip(nMarkers * 16);
+            if (major >= 4) {
+              for (size_t j = 0; j < nMarkers; ++j) {
+                r.skipString();
+              }
+            }
+          }
+        } else if (!hasDataSizes) {
+          if (type == 0) { // marker set
+            r.skipString();
+            size_t nMarkers = r.readCount(1);
+            for (size_t j = 0; j < nMarkers; ++j) {
+              r.skipString();
+            }
+          } else if (type == 2) { // skeleton
+            r.skipString();
+            r.skip(4); // ID
+            size_t nBones = r.readCount(20);
+            for (size_t j = 0; j < nBones; ++j) {
+              if (major >= 2) {
+                r.skipString();
+              }
+              r.skip(20); // ID, parent ID and offset
+            }
+          } else {
+            break;
+          }
+        }
+
+        if (end) {
+          if (end < r.position()) {
+            return false;
+          }
+          r.skip(end - r.position());
+        }
+      }
+    } catch (const Truncated&) {
+      return false;
+    }
+    return true;
+  }
+
+} // namespace libmotioncapture
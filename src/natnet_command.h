@@ -0,0 +1,357 @@
+#pragma once
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libmotioncapture/natnet.h"
+
+// Command channel to a NatNet server (internal header).
+
+namespace libmotioncapture {
+
+  constexpr int NAT_CONNECT              = 0;
+  constexpr int NAT_SERVERINFO           = 1;
+  constexpr int NAT_REQUEST              = 2;
+  constexpr int NAT_RESPONSE             = 3;
+  constexpr int NAT_REQUEST_MODELDEF     = 4;
+  constexpr int NAT_MODELDEF             = 5;
+  constexpr int NAT_KEEPALIVE            = 10;
+  constexpr int NAT_ECHOREQUEST          = 12;
+  constexpr int NAT_ECHORESPONSE         = 13;
+  constexpr int NAT_UNRECOGNIZED_REQUEST = 100;
+
+  // Request/response over the command port of a NatNet server, served by
+  // its own thread. Replies carry no request ID, so requests are sent one at
+  // a time: a reply (or NAT_UNRECOGNIZED_REQUEST) always answers the request
+  // in flight, and the next one is sent once it is answered. Requests are
+  // resent after 'timeout', up to 'retries' times.
+  //
+  // Once started, keep-alive runs a tick every second: it sends NAT_KEEPALIVE
+  // for unicast subscriptions and, as a heartbeat, an echo request from
+  // preallocated packets. Whether the server answers echo requests is
+  // probed first (and after every reconnect); servers that do not are not
+  // watched. Otherwise, a server that sends nothing for three seconds is
+  // considered lost (see lost()); when it replies again (e.g. after a
+  // restart) the reconnect callback is invoked.
+  class NatNetCommandChannel
+  {
+  public:
+    // called with the reply packet, or with nullptr if there was none
+    typedef std::function<void(const char* data, size_t length)> ReplyHandler;
+
+    NatNetCommandChannel(
+      const boost::asio::ip::udp::endpoint& server,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(1000),
+      int retries = 3)
+      : m_server(server)
+      , m_timeout(timeout)
+      , m_retries(retries)
+      , m_socket(m_context, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0))
+      , m_buffer(MAX_PACKETSIZE)
+      , m_keepAlivePacket(makePacket(NAT_KEEPALIVE, std::string()))
+      , m_echoPacket(makePacket(NAT_ECHOREQUEST, std::string(sizeof(uint64_t), '\0')))
+      , m_tickTimer(m_context)
+      , m_attempt(0)
+      , m_keepAlive(false)
+      , m_rejected(false)
+      , m_echoSupported(false)
+      , m_lastReply(std::chrono::steady_clock::now())
+      , m_lost(false)
+    {
+      receive();
+      m_thread = std::thread([this]() { m_context.run(); });
+    }
+
+    ~NatNetCommandChannel()
+    {
+      m_context.stop();
+      m_thread.join();
+    }
+
+    // Sends a request and waits for its reply; throws std::runtime_error if
+    // the server does not reply. Must not be called from a handler.
+    std::vector<char> request(
+      uint16_t messageId,
+      uint16_t replyId,
+      const std::string& payload = std::string())
+    {
+      auto promise = std::make_shared<std::promise<std::vector<char> > >();
+      std::future<std::vector<char> > reply = promise->get_future();
+      requestAsync(messageId, replyId, [promise](const char* data, size_t length) {
+        if (data) {
+          promise->set_value(std::vector<char>(data, data + length));
+        } else {
+          promise->set_value(std::vector<char>());
+        }
+      }, payload);
+      std::vector<char> result = reply.get();
+      if (result.empty()) {
+        throw std::runtime_error("NatNet server " + m_server.address().to_string() + ":"
+          + std::to_string(m_server.port()) + " did not reply to command "
+          + std::to_string(messageId) + "!");
+      }
+      return result;
+    }
+
+    // Sends a request; 'handler' is called on the channel thread. Thread-safe.
+    void requestAsync(
+      uint16_t messageId,
+      uint16_t replyId,
+      ReplyHandler handler,
+      const std::string& payload = std::string())
+    {
+      std::vector<char> packet = makePacket(messageId, payload);
+      boost::asio::post(m_context, [this, packet, replyId, handler]() {
+        enqueue(packet, replyId, handler);
+      });
+    }
+
+    // Starts the keep-alive ticks (see above) and returns once the server
+    // was probed for echo requests. Packets that match no pending request go
+    // to 'unsolicited'. Must not be called from a handler.
+    void start(
+      bool sendKeepAlive,
+      std::function<void()> onReconnect,
+      ReplyHandler unsolicited)
+    {
+      auto probed = std::make_shared<std::promise<void> >();
+      std::future<void> done = probed->get_future();
+      boost::asio::post(m_context, [this, sendKeepAlive, onReconnect, unsolicited, probed]() {
+        m_keepAlive = sendKeepAlive;
+        m_onReconnect = onReconnect;
+        m_unsolicited = unsolicited;
+        m_lastReply = std::chrono::steady_clock::now();
+        probeEcho([probed]() { probed->set_value(); });
+        tick();
+      });
+      done.wait();
+    }
+
+    // true while a watched server is not responding. Thread-safe.
+    bool lost() const
+    {
+      return m_lost.load(std::memory_order_relaxed);
+    }
+
+  private:
+    enum {
+      MAX_PACKETSIZE = 65503,
+      TICK_INTERVAL_MS = 1000,
+      SERVER_TIMEOUT_MS = 3000,
+    };
+
+    struct Request
+    {
+      Request(
+        boost::asio::io_context& context,
+        const std::vector<char>& packet,
+        uint16_t replyId,
+        int retries,
+        const ReplyHandler& handler)
+        : packet(packet)
+        , replyId(replyId)
+        , retries(retries)
+        , handler(handler)
+        , timer(context)
+      {
+      }
+
+      std::vector<char> packet;
+      uint16_t replyId;
+      int retries; // left
+      ReplyHandler handler;
+      boost::asio::steady_timer timer;
+    };
+
+    static std::vector<char> makePacket(uint16_t messageId, const std::string& payload)
+    {
+      const uint16_t size = payload.size();
+      std::vector<char> packet(4 + payload.size());
+      memcpy(&packet[0], &messageId, 2);
+      memcpy(&packet[2], &size, 2);
+      memcpy(packet.data() + 4, payload.data(), payload.size());
+      return packet;
+    }
+
+    // on the channel thread
+    void enqueue(const std::vector<char>& packet, uint16_t replyId, const ReplyHandler& handler)
+    {
+      m_pending.emplace_back(new Request(m_context, packet, replyId, m_retries, handler));
+      if (m_pending.size() == 1) {
+        transmit();
+      }
+    }
+
+    // Sends one echo request as a regular request, so that a
+    // NAT_UNRECOGNIZED_REQUEST maps to it. Until it is answered, tick()
+    // sends no echo requests, whose rejection could not be told apart from
+    // that of another request, and does not watch the server. A server that
+    // does not reply at all is watched (it may just have gone away). 'done'
+    // is called once the probe is answered.
+    void probeEcho(std::function<void()> done = std::function<void()>())
+    {
+      m_echoSupported = false;
+      enqueue(m_echoPacket, NAT_ECHORESPONSE, [this, done](const char*, size_t) {
+        m_echoSupported = !m_rejected;
+        if (!m_echoSupported) {
+          printf("NatNet server %s does not answer echo requests; not watching it.\n",
+            m_server.address().to_string().c_str());
+        }
+        if (done) {
+          done();
+        }
+      });
+    }
+
+    // (re)sends the request in flight, the first pending one
+    void transmit()
+    {
+      Request& request = *m_pending.front();
+      boost::system::error_code ec;
+      m_socket.send_to(boost::asio::buffer(request.packet), m_server, 0, ec);
+      request.timer.expires_after(m_timeout);
+      // a timeout that was already queued when the request was answered
+      // must not touch the next request
+      const uint64_t attempt = ++m_attempt;
+      request.timer.async_wait([this, attempt](const boost::system::error_code& ec) {
+        if (ec == boost::asio::error::operation_aborted || attempt != m_attempt) {
+          return; // answered or channel destroyed
+        }
+        if (m_pending.front()->retries-- > 0) {
+          transmit();
+        } else {
+          complete(nullptr, 0);
+        }
+      });
+    }
+
+    // removes the request in flight, calls its handler and sends the next one
+    void complete(const char* data, size_t length)
+    {
+      std::unique_ptr<Request> done(std::move(m_pending.front()));
+      m_pending.pop_front();
+      ++m_attempt;
+      done->timer.cancel();
+      done->handler(data, length);
+      if (!m_pending.empty()) {
+        transmit();
+      }
+    }
+
+    void receive()
+    {
+      m_socket.async_receive_from(
+        boost::asio::buffer(m_buffer), m_sender,
+        [this](const boost::system::error_code& ec, size_t length) {
+          if (ec == boost::asio::error::operation_aborted) {
+            return;
+          }
+          if (!ec) {
+            handle(length);
+          }
+          receive();
+        });
+    }
+
+    void handle(size_t length)
+    {
+      const int messageId = NatNetFrameDecoder::messageId(m_buffer.data(), length);
+      if (messageId < 0) {
+        return;
+      }
+      m_lastReply = std::chrono::steady_clock::now();
+      if (m_lost.load(std::memory_order_relaxed)) {
+        m_lost.store(false, std::memory_order_relaxed);
+        printf("NatNet server %s is back.\n", m_server.address().to_string().c_str());
+        if (m_onReconnect) {
+          m_onReconnect();
+        }
+        // it may be a different server
+        probeEcho();
+      }
+
+      if (!m_pending.empty()) {
+        if (messageId == NAT_UNRECOGNIZED_REQUEST) {
+          m_rejected = true;
+          complete(nullptr, 0);
+          m_rejected = false;
+          return;
+        }
+        if (messageId == m_pending.front()->replyId) {
+          complete(m_buffer.data(), length);
+          return;
+        }
+      }
+      if (m_unsolicited && messageId != NAT_ECHORESPONSE) {
+        m_unsolicited(m_buffer.data(), length);
+      }
+    }
+
+    void tick()
+    {
+      const auto now = std::chrono::steady_clock::now();
+      boost::system::error_code ec;
+      if (m_keepAlive) {
+        m_socket.send_to(boost::asio::buffer(m_keepAlivePacket), m_server, 0, ec);
+      }
+      if (m_echoSupported) {
+        if (!lost() && now - m_lastReply > std::chrono::milliseconds(SERVER_TIMEOUT_MS)) {
+          m_lost.store(true, std::memory_order_relaxed);
+          printf("NatNet server %s is not responding.\n", m_server.address().to_string().c_str());
+        }
+        // any reply proves the server alive; the echo is just the cheapest,
+        // and as it is not a pending request, its reply needs no matching
+        const uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          now.time_since_epoch()).count();
+        memcpy(m_echoPacket.data() + 4, &timestamp, sizeof(timestamp));
+        m_socket.send_to(boost::asio::buffer(m_echoPacket), m_server, 0, ec);
+      }
+
+      m_tickTimer.expires_after(std::chrono::milliseconds(TICK_INTERVAL_MS));
+      m_tickTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (!ec) {
+          tick();
+        }
+      });
+    }
+
+  private:
+    boost::asio::ip::udp::endpoint m_server;
+    std::chrono::milliseconds m_timeout;
+    int m_retries;
+
+    boost::asio::io_context m_context;
+    boost::asio::ip::udp::socket m_socket;
+    boost::asio::ip::udp::endpoint m_sender;
+    std::vector<char> m_buffer;
+    std::thread m_thread;
+
+    // sent by tick()
+    const std::vector<char> m_keepAlivePacket;
+    std::vector<char> m_echoPacket;
+
+    // channel thread only
+    std::deque<std::unique_ptr<Request> > m_pending; // the first one is in flight
+    boost::asio::steady_timer m_tickTimer;
+    uint64_t m_attempt; // counts transmissions, see transmit()
+    bool m_keepAlive;
+    std::function<void()> m_onReconnect;
+    ReplyHandler m_unsolicited;
+    bool m_rejected; // while completing a request with NAT_UNRECOGNIZED_REQUEST
+    bool m_echoSupported; // the server did not reject the echo probe
+    std::chrono::steady_clock::time_point m_lastReply;
+    std::atomic<bool> m_lost; // also read by lost()
+  };
+
+} // namespace libmotioncapture
@@ -1,7 +1,10 @@
 #include "libmotioncapture/nokov.h"
+#include "frame_queue.h"
+#include "trace.h"
 
 #include <string>
 #include <thread>
+#include <condition_variable>
 #include <mutex>   
 #include <unordered_map>
 #include <Eigen/Geometry> 
@@ -12,81 +15,6 @@
 
 namespace libmotioncapture {
 
-    typedef struct
-    {
-        int ID;                                 // RigidBody identifier
-        float x, y, z;                          // Position
-        float qx, qy, qz, qw;                   // Orientation
-    } sBodyData;
-
-    typedef struct
-    {
-        int iFrame;                                     // host defined frame number
-        int nOtherMarkers;                              // # of undefined markers
-        MarkerData OtherMarkers[MAX_MARKERS];           // undefined marker data
-        int nRigidBodies;                               // # of rigid bodies
-        sBodyData RigidBodies[MAX_RIGIDBODIES];    // Rigid body data
-        float fLatency;                                 // host defined time delta between capture and send
-        unsigned int Timecode;                          // SMPTE timecode (if available)
-        unsigned int TimecodeSubframe;                  // timecode sub-frame data
-        long long iTimeStamp;                           // FrameGroup timestamp
-        short params;                                   // host defined parameters
-
-    } sFrameOfObjData;
-
-    // Global Var
-    sFrameOfObjData frameObjData = {0};
-    std::mutex mtx;
-
-    const sFrameOfObjData& GetCurrentFrame()
-    {
-        static sFrameOfObjData frame = {0};
-        {
-            std::lock_guard<std::mutex> lck (mtx);
-            frame = frameObjData;
-        }
-        return frame;
-    }
-
-    void DataHandler(sFrameOfMocapData* pFrameOfData, void* pUserData)
-    {
-        if (nullptr == pFrameOfData)
-            return;
-
-        // Store the frame
-        std::lock_guard<std::mutex> lck (mtx);
-
-        int nmaker = (pFrameOfData->nOtherMarkers < MAX_MARKERS)?pFrameOfData->nOtherMarkers:MAX_MARKERS;
-
-        frameObjData.iFrame = pFrameOfData->iFrame;
-        frameObjData.nOtherMarkers = nmaker;
-        frameObjData.nRigidBodies = pFrameOfData->nRigidBodies;
-        frameObjData.fLatency = pFrameOfData->fLatency;
-        frameObjData.Timecode = pFrameOfData->Timecode;
-        frameObjData.TimecodeSubframe = pFrameOfData->TimecodeSubframe;
-        frameObjData.iTimeStamp = pFrameOfData->iTimeStamp;
-        frameObjData.params = pFrameOfData->params;
-        
-        for(int i = 0; i< nmaker; ++i)
-        {
-            frameObjData.OtherMarkers[i][0] = pFrameOfData->OtherMarkers[i][0] * 0.001;
-            frameObjData.OtherMarkers[i][1] = pFrameOfData->OtherMarkers[i][1] * 0.001;
-            frameObjData.OtherMarkers[i][2] = pFrameOfData->OtherMarkers[i][2] * 0.001;          
-        }
-
-        for(int i = 0; i< pFrameOfData->nRigidBodies; ++i)
-        {
-            frameObjData.RigidBodies[i].ID =  pFrameOfData->RigidBodies[i].ID;
-            frameObjData.RigidBodies[i].x =  pFrameOfData->RigidBodies[i].x * 0.001;
-            frameObjData.RigidBodies[i].y =  pFrameOfData->RigidBodies[i].y * 0.001;
-            frameObjData.RigidBodies[i].z =  pFrameOfData->RigidBodies[i].z * 0.001;
-            frameObjData.RigidBodies[i].qx =  pFrameOfData->RigidBodies[i].qx;
-            frameObjData.RigidBodies[i].qy =  pFrameOfData->RigidBodies[i].qy;
-            frameObjData.RigidBodies[i].qz =  pFrameOfData->RigidBodies[i].qz;
-            frameObjData.RigidBodies[i].qw =  pFrameOfData->RigidBodies[i].qw;
-        }
-    }
-
     class MotionCaptureNokovImpl
     {
     public:
@@ -95,28 +23,81 @@ namespace libmotioncapture {
         bool enableFixedUpdate = false;
         sDataDescriptions* pBodyDefs = nullptr;
         NokovSDKClient* pClient = nullptr;
-        int lastFrame = 0;
-        std::unordered_map<std::string, size_t> bodyMap;
+        std::unordered_map<int, size_t> slotMap; // body ID -> Frame slot
+
+        MotionCaptureNokov* owner = nullptr;
+        // protects frame and slotMap; never taken by the consumer, so the
+        // frame callback runs without blocking it
+        std::mutex decodeMtx;
+        Frame frame; // written by the SDK thread
+
+        std::mutex mtx; // protects latest, queue and received
+        std::condition_variable cv;
+        bool received = false;
+        Frame latest; // newest frame, handed over in receiveFrame()
+        FrameQueue queue; // frames not yet handed over (DeliverAll)
+
+        explicit MotionCaptureNokovImpl(MemoryResource* resource)
+            : frame(resource)
+            , latest(resource)
+            , queue(64, resource)
+        {
+        }
 
-        size_t GetBodyIdByName(const std::string& name) const {
-            if (bodyMap.find(name) != bodyMap.end())
-            {
-                return bodyMap.at(name);
+        void handleFrame(const sFrameOfMocapData* pFrameOfData)
+        {
+            const uint64_t hostTimeStamp = hostTime();
+            std::lock_guard<std::mutex> decodeLck(decodeMtx);
+            const uint64_t start = hostTime();
+            frame.setHostTimeStamp(hostTimeStamp);
+            frame.setFrameNumber((uint32_t)pFrameOfData->iFrame);
+
+            frame.invalidate();
+            for (int iBody = 0; iBody < pFrameOfData->nRigidBodies; ++iBody) {
+                const auto& rb = pFrameOfData->RigidBodies[iBody];
+                const auto iter = slotMap.find(rb.ID);
+                if (iter == slotMap.end()) {
+                    continue;
+                }
+
+                // NOKOV reports millimeters
+                Eigen::Vector3f position(
+                    rb.x * 0.001f,
+                    rb.y * 0.001f,
+                    rb.z * 0.001f);
+
+                // Convention
+                Eigen::Quaternionf rotation(rb.qw, rb.qx, rb.qy, rb.qz);
+                frame.setPose(iter->second, position, rotation);
             }
 
-            return -1;
-        }
+            auto& pointcloud = frame.pointCloud();
+            size_t count = (pFrameOfData->nOtherMarkers < MAX_MARKERS) ? pFrameOfData->nOtherMarkers : MAX_MARKERS;
+            pointcloud.resize(count, Eigen::NoChange);
+            for (size_t iMarkerIdx = 0; iMarkerIdx < count; ++iMarkerIdx) {
+
+                pointcloud.row(iMarkerIdx) << pFrameOfData->OtherMarkers[iMarkerIdx][0] * 0.001f,
+                    pFrameOfData->OtherMarkers[iMarkerIdx][1] * 0.001f,
+                    pFrameOfData->OtherMarkers[iMarkerIdx][2] * 0.001f;
+            }
+
+            // invoke the frame callback right here on the SDK thread
+            owner->recordParseTime(hostTime() - start);
+            TRACE_SPAN("decode", start);
+            owner->frameReceived(frame);
 
-        const std::string GetBodyNameById(size_t id) const {
-            for (auto pair : bodyMap)
             {
-                if (pair.second == id)
-                {
-                    return pair.first;
+                std::lock_guard<std::mutex> lck(mtx);
+                if (owner->deliveryPolicy() != MotionCapture::DeliverLatest) {
+                    if (!queue.push(frame)) {
+                        owner->recordDropped(1);
+                    }
                 }
+                // all frames have the same slots, so swapping hands over the data without copies
+                std::swap(frame, latest);
+                received = true;
             }
-
-            return std::string();
+            cv.notify_all();
         }
 
         ~MotionCaptureNokovImpl()
@@ -136,12 +117,21 @@ namespace libmotioncapture {
         }
     };
 
+    void DataHandler(sFrameOfMocapData* pFrameOfData, void* pUserData)
+    {
+        if (nullptr == pFrameOfData || nullptr == pUserData)
+            return;
+
+        static_cast<MotionCaptureNokovImpl*>(pUserData)->handleFrame(pFrameOfData);
+    }
+
     MotionCaptureNokov::MotionCaptureNokov(
         const std::string& hostname,
         bool enableFrequency, 
         int updateFrequency)
     {
-        pImpl = new MotionCaptureNokovImpl;
+        pImpl = new MotionCaptureNokovImpl(memoryResource_);
+        pImpl->owner = this;
 
         NokovSDKClient* theClient = new NokovSDKClient();
         unsigned char version[4] = {0};
@@ -152,7 +142,7 @@ namespace libmotioncapture {
             pImpl->version = sstr.str();
         }
 
-        theClient->SetDataCallback(DataHandler);
+        theClient->SetDataCallback(DataHandler, pImpl);
 
         // Check the ret value
         int retValue = theClient->Initialize((char*)hostname.c_str());
@@ -170,13 +160,20 @@ namespace libmotioncapture {
 			throw std::runtime_error(sstr.str());
         }
         
-        for (int iDataDef = 0; iDataDef < pImpl->pBodyDefs->nDataDescriptions; ++iDataDef)
         {
-            if (pImpl->pBodyDefs->arrDataDescriptions[iDataDef].type == Descriptor_RigidBody)
+            std::lock_guard<std::mutex> decodeLck(pImpl->decodeMtx);
+            pImpl->frame.reserve(pImpl->pBodyDefs->nDataDescriptions);
+            for (int iDataDef = 0; iDataDef < pImpl->pBodyDefs->nDataDescriptions; ++iDataDef)
             {
-                auto bodeDef = pImpl->pBodyDefs->arrDataDescriptions[iDataDef].Data.RigidBodyDescription;
-                pImpl->bodyMap[bodeDef->szName] = bodeDef->ID;
+                if (pImpl->pBodyDefs->arrDataDescriptions[iDataDef].type == Descriptor_RigidBody)
+                {
+                    auto bodeDef = pImpl->pBodyDefs->arrDataDescriptions[iDataDef].Data.RigidBodyDescription;
+                    pImpl->slotMap[bodeDef->ID] = pImpl->frame.addBody(bodeDef->ID, bodeDef->szName);
+                }
             }
+            std::lock_guard<std::mutex> lck(pImpl->mtx);
+            frame_ = pImpl->frame;
+            pImpl->latest = pImpl->frame;
         }
 
         pImpl->pClient = theClient;
@@ -186,6 +183,7 @@ namespace libmotioncapture {
 
     MotionCaptureNokov::~MotionCaptureNokov()
     {
+        stopReceiveThread();
         if (pImpl)
         {
             delete pImpl;
@@ -197,10 +195,11 @@ namespace libmotioncapture {
         return pImpl->version;
     }
 
-    void MotionCaptureNokov::waitForNextFrame()
+    bool MotionCaptureNokov::receiveFrame(std::chrono::nanoseconds timeout)
     {
         static auto lastTime = std::chrono::high_resolution_clock::now();
         auto now = std::chrono::high_resolution_clock::now();
+        const auto deadline = now + timeout;
 
         if (pImpl->enableFixedUpdate)
         {
@@ -208,19 +207,34 @@ namespace libmotioncapture {
             auto desiredPeriod = std::chrono::milliseconds(1000 / pImpl->updateFrequency);
             //std::cout <<"elapsed: " << std::chrono::duration<double>(elapsed).count() << "\tdesired:" << std::chrono::duration<double>(desiredPeriod).count() << std::endl;
             if (elapsed < desiredPeriod) {
+                if (desiredPeriod - elapsed > timeout) {
+                    std::this_thread::sleep_for(timeout);
+                    return false;
+                }
                 //std::cout << "Sleep Done" << std::endl;
                 std::this_thread::sleep_for(desiredPeriod - elapsed);
             }
         }
 
-        int frameNo;
-        do
-        {
-            frameNo = GetCurrentFrame().iFrame;
+        // wait for the SDK thread to deliver a new frame
+        std::unique_lock<std::mutex> lck(pImpl->mtx);
+        if (deliveryPolicy() != DeliverLatest) {
+            if (!pImpl->cv.wait_until(lck, deadline, [this] { return !pImpl->queue.empty(); })) {
+                return false;
+            }
+            lastTime = std::chrono::high_resolution_clock::now();
+            pImpl->queue.pop(frame_, deliveryPolicy() == DeliverAllWithGapReport);
+            return true;
         }
-        while (frameNo == pImpl->lastFrame);
-        pImpl->lastFrame = frameNo;  
+        if (!pImpl->cv.wait_until(lck, deadline, [this] { return pImpl->received; })) {
+            return false;
+        }
+        pImpl->received = false;
         lastTime = std::chrono::high_resolution_clock::now();
+
+        // both frames have the same slots, so swapping hands over the data without copies
+        std::swap(frame_, pImpl->latest);
+        return true;
     }
 
 	bool MotionCaptureNokov::supportsPointCloud() const
@@ -228,74 +242,6 @@ namespace libmotioncapture {
 		return true;
 	}
 
-	const std::map<std::string, libmotioncapture::RigidBody>& MotionCaptureNokov::rigidBodies() const
-	{
-        rigidBodies_.clear();
-
-		auto frameData = GetCurrentFrame();
-		for (int iBody = 0; iBody < frameData.nRigidBodies; ++iBody) {
-
-			const auto& rb = frameData.RigidBodies[iBody];
-			Eigen::Vector3f position(
-				rb.x,
-				rb.y,
-				rb.z);
-
-			// Convention
-			Eigen::Quaternionf rotation(rb.qw, rb.qx, rb.qy, rb.qz);
-            auto bodyName = pImpl->GetBodyNameById(rb.ID);
-
-            rigidBodies_.emplace(bodyName, RigidBody(bodyName,position, rotation));
-		}
-
-        return rigidBodies_;
-	}
-
-
-	libmotioncapture::RigidBody MotionCaptureNokov::rigidBodyByName(const std::string& name) const
-	{
-        size_t bodyId = pImpl->GetBodyIdByName(name);
-        if (bodyId < 0)
-        {
-            throw std::runtime_error("Unknown rigid body!");
-        }
-
-		auto frameData = GetCurrentFrame();
-		for (size_t iBody = 0; iBody < frameData.nRigidBodies; ++iBody) {
-
-			const auto& rb = frameData.RigidBodies[iBody];
-
-			if (bodyId == rb.ID)
-			{
-				Eigen::Vector3f position(
-					rb.x,
-					rb.y,
-					rb.z);
-
-		        Eigen::Quaternionf rotation(rb.qw, rb.qx, rb.qy, rb.qz);
-
-                return RigidBody(pImpl->GetBodyNameById(bodyId), position, rotation);
-			}
-		}
-
-        throw std::runtime_error("Unknown rigid body!");
-	}
-
-	const libmotioncapture::PointCloud& MotionCaptureNokov::pointCloud() const
-	{
-		auto frameData = GetCurrentFrame();
-        size_t count = frameData.nOtherMarkers;
-		pointcloud_.resize(count, Eigen::NoChange);
-		for (size_t iMarkerIdx = 0; iMarkerIdx < count; ++iMarkerIdx) {
-
-			pointcloud_.row(iMarkerIdx) << frameData.OtherMarkers[iMarkerIdx][0],
-                frameData.OtherMarkers[iMarkerIdx][1],
-                frameData.OtherMarkers[iMarkerIdx][2];
-		}
-		return pointcloud_;
-	}
-
-
 	bool MotionCaptureNokov::supportsRigidBodyTracking() const
 	{
         return true;
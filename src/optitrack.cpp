@@ -1,7 +1,16 @@
 #include "libmotioncapture/optitrack.h"
+#include "libmotioncapture/natnet.h"
+#include "natnet_command.h"
+#include "receive_timestamp.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <boost/asio.hpp>
+#include <cstddef>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
 
 using boost::asio::ip::udp;
 
@@ -22,48 +31,118 @@ namespace libmotioncapture {
 
   constexpr int MAX_PACKETSIZE = 65503; // max size of packet (actual packet size is dynamic)
   constexpr int MAX_NAMELENGTH = 256;
-
-  constexpr int NAT_CONNECT           = 0;
-  constexpr int NAT_SERVERINFO        = 1;
-  constexpr int NAT_REQUEST_MODELDEF  = 4;
-  constexpr int NAT_MODELDEF          = 5;
-
-  /**
-   * \brief Unpack number of bytes of data for a given data type. 
-   * Useful if you want to skip this type of data. 
-   * \param ptr - input data stream pointer
-   * \param major - NatNet major version
-   * \param minor - NatNet minor version
-   * \return - pointer after decoded object
-  */
-  char* UnpackDataSize(char* ptr, int major, int minor, int& nBytes, bool skip = false )
+  constexpr int MAX_BATCHSIZE = 16; // datagrams drained per system call
+  constexpr uint64_t MODELDEF_REFRESH_INTERVAL = 500000000; // ns between requests
+  constexpr uint64_t MODELDEF_REFRESH_MAX_INTERVAL = 32000000000; // ns, see decode()
+
+  // Rigid body definitions of the model, indexed by streaming ID: dense for
+  // the usual small IDs, sorted by ID for the others. Names are interned in
+  // the Frame slots, so entries only hold what decoding needs.
+  class RigidBodyTable
   {
-      nBytes = 0;
+  public:
+    static constexpr int MAX_DENSE_ID = 1 << 16;
 
-      // size of all data for this data type (in bytes);
-      if (((major == 4) && (minor > 0)) || (major > 4))
-      {
-          memcpy(&nBytes, ptr, 4); ptr += 4;
-          // printf("Byte Count: %d\n", nBytes);
-          if (skip)
-          {
-              ptr += nBytes;
-          }
+    struct Entry
+    {
+      Eigen::Vector3f offset;
+      int parentID;
+      int slot; // index into Frame, -1 if the ID is not defined
+    };
+
+    explicit RigidBodyTable(MemoryResource* resource)
+      : m_dense(ResourceAllocator<Entry>(resource))
+      , m_sparse(ResourceAllocator<std::pair<int, Entry> >(resource))
+    {
+    }
+
+    void clear()
+    {
+      m_dense.clear();
+      m_sparse.clear();
+    }
+
+    void add(int id, int parentID, const Eigen::Vector3f& offset, size_t slot)
+    {
+      const Entry entry = {offset, parentID, (int)slot};
+      if (id >= 0 && id < MAX_DENSE_ID) {
+        if ((size_t)id >= m_dense.size()) {
+          const Entry undefined = {Eigen::Vector3f::Zero(), -1, -1};
+          m_dense.resize(id + 1, undefined);
+        }
+        m_dense[id] = entry;
+        return;
       }
-      return ptr;
-  }
+      auto iter = std::lower_bound(m_sparse.begin(), m_sparse.end(), id, compareID);
+      if (iter != m_sparse.end() && iter->first == id) {
+        iter->second = entry;
+      } else {
+        m_sparse.insert(iter, std::make_pair(id, entry));
+      }
+    }
+
+    // returns nullptr for IDs that are not defined
+    const Entry* find(int id) const
+    {
+      if (id >= 0 && (size_t)id < m_dense.size()) {
+        const Entry& entry = m_dense[id];
+        return entry.slot >= 0 ? &entry : nullptr;
+      }
+      if (m_sparse.empty()) {
+        return nullptr;
+      }
+      auto iter = std::lower_bound(m_sparse.begin(), m_sparse.end(), id, compareID);
+      return iter != m_sparse.end() && iter->first == id ? &iter->second : nullptr;
+    }
+
+  private:
+    static bool compareID(const std::pair<int, Entry>& item, int id)
+    {
+      return item.first < id;
+    }
+
+  private:
+    std::vector<Entry, ResourceAllocator<Entry> > m_dense;
+    std::vector<std::pair<int, Entry>, ResourceAllocator<std::pair<int, Entry> > > m_sparse;
+  };
+
+  // Server description from the reply to NAT_CONNECT
+  struct NatNetServerInfo
+  {
+    int versionMajor;
+    int versionMinor;
+    std::string version;     // NatNet version, "major.minor.build.revision"
+    uint64_t clockFrequency; // ticks/second for timestamps
+    uint16_t dataPort;
+    bool isMulticast;
+    std::string multicastAddress;
+  };
 
   class MotionCaptureOptitrackImpl{
   public:
-    MotionCaptureOptitrackImpl()
-      : version()
-      , versionMajor(0)
-      , versionMinor(0)
+    explicit MotionCaptureOptitrackImpl(MemoryResource* resource)
+      : server()
       , io_context()
       , socket(io_context)
-      , sender_endpoint()
-      , data(MAX_PACKETSIZE)
+      , datagrams(MAX_BATCHSIZE, MAX_PACKETSIZE, resource)
+      , datagramCount(0)
+      , nextDatagram(0)
+      , scratch(resource)
+      , rigidBodies(resource)
+      , unknownBodies(false)
+      , modelDefReceived(false)
+      , serverInfoReceived(false)
+      , refreshWanted(false)
+      , lastRefresh(0)
+      , refreshInterval(MODELDEF_REFRESH_INTERVAL)
+      , modelsChanged(false)
+    {
+    }
+
+    ~MotionCaptureOptitrackImpl()
     {
+      // stop the channel thread before the state its handlers use goes away
+      commands.reset();
     }
     // void getObjectByRigidbody(
     //   const RigidBody& rb,
@@ -98,697 +177,610 @@ namespace libmotioncapture {
     //     }
     //   } 
 
-    void parseModelDef(const char* data)
+    // Rebuilds the rigid body table from the given model definitions,
+    // between frames on the decoding thread. Slots are added for new bodies.
+    // The scratch frame gets the same slots.
+    void applyModelDef(const std::vector<NatNetRigidBodyDescription>& bodies, Frame& frame)
     {
-      const char *ptr = data;
-      int major = versionMajor;
-      int minor = versionMinor;
+      frame.reserve(bodies.size());
+      scratch.reserve(bodies.size());
+      rigidBodies.clear();
+      for (size_t i = 0; i < bodies.size(); ++i) {
+        const auto& rb = bodies[i];
+        // slots follow the order of the definitions, so slot i is checked first
+        const size_t slot = frame.findOrAddBody(rb.id, rb.name.c_str(), i);
+        scratch.findOrAddBody(rb.id, rb.name.c_str(), slot);
+        rigidBodies.add(rb.id, rb.parentId, Eigen::Vector3f(rb.xOffset, rb.yOffset, rb.zOffset), slot);
+      }
+      unknownBodies = false;
+    }
 
-      // First 2 Bytes is message ID
-      int MessageID = 0;
-      memcpy(&MessageID, ptr, 2); ptr += 2;
-      // printf("Message ID : %d\n", MessageID);
+    // returns false if the NAT_SERVERINFO reply is too short
+    static bool parseServerInfo(const char* data, size_t length, NatNetServerInfo& info)
+    {
+      typedef struct
+      {
+        unsigned short iMessage;
+        unsigned short nDataBytes;
+        char szName[MAX_NAMELENGTH];      // host app's name
+        unsigned char Version[4];         // host app's version [major.minor.build.revision]
+        unsigned char NatNetVersion[4];   // host app's NatNet version [major.minor.build.revision]
+        uint8_t HighResClockFrequency[8];   // host's high resolution clock frequency (ticks per second)
+        uint16_t DataPort;
+        bool IsMulticast;
+        uint8_t MulticastGroupAddress[4];
+      } sResponse;
+
+      // the struct may be padded at the end
+      if (!data || length < offsetof(sResponse, MulticastGroupAddress) + 4) {
+        return false;
+      }
+      sResponse response = {};
+      memcpy(&response, data, std::min(length, sizeof(response)));
+
+      std::ostringstream stringStream;
+      stringStream << (int)response.NatNetVersion[0] << "."
+                   << (int)response.NatNetVersion[1] << "."
+                   << (int)response.NatNetVersion[2] << "."
+                   << (int)response.NatNetVersion[3];
+      info.version = stringStream.str();
+      info.versionMajor = response.NatNetVersion[0];
+      info.versionMinor = response.NatNetVersion[1];
+      memcpy(&info.clockFrequency, response.HighResClockFrequency, sizeof(uint64_t));
+      info.dataPort = response.DataPort;
+      info.isMulticast = response.IsMulticast;
 
-      // Second 2 Bytes is the size of the packet
-      int nBytes = 0;
-      memcpy(&nBytes, ptr, 2); ptr += 2;
-      // printf("Byte count : %d\n", nBytes);
+      std::stringstream sstr;
+      sstr << (int)response.MulticastGroupAddress[0] << "."
+           << (int)response.MulticastGroupAddress[1] << "."
+           << (int)response.MulticastGroupAddress[2] << "."
+           << (int)response.MulticastGroupAddress[3];
+      info.multicastAddress = sstr.str();
+      return true;
+    }
 
-      if(MessageID == NAT_MODELDEF) // Data Descriptions
-      {
-        // number of datasets
-        int nDatasets = 0; memcpy(&nDatasets, ptr, 4); ptr += 4;
-        // printf("Dataset Count : %d\n", nDatasets);
-
-        for(int i=0; i < nDatasets; i++)
-        {
-          // printf("Dataset %d\n", i);
-
-          int type = 0; memcpy(&type, ptr, 4); ptr += 4;
-          int description_size = 0;
-          // printf("Type : %d\n", i, type);
-
-          if ((major == 4 && minor >= 1) || major > 4)
-          {
-            // If the NatNet version is 4.1 or greater, next four bytes represent
-            // the number of bytes in the dataset. Just skip them.
-            memcpy(&description_size, ptr, 4); ptr += 4;
-          }
+    // On the decoding thread: sets up the decoder for the NatNet version of
+    // the server and (re)opens the data socket if it is not yet bound to
+    // the data port and multicast group of the server.
+    void applyServerInfo(const NatNetServerInfo& info)
+    {
+      const bool rebind = !socket.is_open()
+        || info.dataPort != server.dataPort
+        || info.isMulticast != server.isMulticast
+        || (info.isMulticast && info.multicastAddress != server.multicastAddress);
+      if (socket.is_open() && info.version != server.version) {
+        printf("NatNet server now uses version %s.\n", info.version.c_str());
+      }
+      server = info;
+      decoder.setVersion(server.versionMajor, server.versionMinor);
+      if (!rebind) {
+        return;
+      }
 
-          if(type == 0)   // markerset
-          {
-            ptr += strlen(ptr) + 1; // name
+      if (socket.is_open()) {
+        socket.close();
+        datagramCount = 0;
+        nextDatagram = 0;
+      }
 
-            // marker data
-            int nMarkers = 0; memcpy(&nMarkers, ptr, 4); ptr += 4;
-            // printf("Marker Count : %d\n", nMarkers);
+      // connect to data port to receive mocap data
+      auto listen_address_boost = boost::asio::ip::make_address_v4(interfaceAddress);
+
+      // Create the socket so that multiple may be bound to the same address.
+      boost::asio::ip::udp::endpoint listen_endpoint(
+          boost::asio::ip::address_v4::any(), server.dataPort);
+      socket.open(listen_endpoint.protocol());
+      socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+      socket.bind(listen_endpoint);
+      enableReceiveTimestamps(socket);
+
+      if (server.isMulticast) {
+        auto multicast_address_boost = boost::asio::ip::make_address_v4(server.multicastAddress);
+        // Join the multicast group on a specific interface
+        socket.set_option(boost::asio::ip::multicast::join_group(multicast_address_boost, listen_address_boost));
+      }
+    }
 
-            for(int j=0; j < nMarkers; j++)
-            {
-              ptr += strlen(ptr) + 1;
-            }
-          }
-          else if(type ==1)   // rigid body
-          {
-            char szName[MAX_NAMELENGTH];
-            if(major >= 2)
-            {
-              // name
-              strcpy(szName, ptr);
-              ptr += strlen(ptr) + 1;
-              // printf("Name: %s\n", szName);
-            }
+    // on the decoding thread, before waiting for data: the data port may
+    // have changed
+    void checkServerInfo()
+    {
+      if (serverInfoReceived.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lk(serverInfoMutex);
+        applyServerInfo(receivedServerInfo);
+        serverInfoReceived.store(false, std::memory_order_relaxed);
+      }
+    }
 
-            int ID = 0; memcpy(&ID, ptr, 4); ptr +=4;
-            // printf("ID : %d\n", ID);
-
-            rigidBodyDefinitions[ID].name = szName;
-            rigidBodyDefinitions[ID].ID = ID;
-         
-            memcpy(&rigidBodyDefinitions[ID].parentID, ptr, 4); ptr +=4;
-            memcpy(&rigidBodyDefinitions[ID].xoffset, ptr, 4); ptr +=4;
-            memcpy(&rigidBodyDefinitions[ID].yoffset, ptr, 4); ptr +=4;
-            memcpy(&rigidBodyDefinitions[ID].zoffset, ptr, 4); ptr +=4;
-
-            // Per-marker data (NatNet 3.0 and later)
-            if ( major >= 3 )
-            {
-              int nMarkers = 0; memcpy( &nMarkers, ptr, 4 ); ptr += 4;
-              // Marker positions
-              nBytes = nMarkers * 3 * sizeof(float);
-              ptr += nBytes;
-              // Marker required active labels
-              nBytes = nMarkers * sizeof(int);
-              ptr += nBytes;
-              // Marker Name
-              if (major >= 4) {
-                for (int markerIdx = 0; markerIdx < nMarkers; ++markerIdx) {
-                  ptr += strlen(ptr) + 1;
-                }
+    // Keeps the command channel alive from now on. When the server comes
+    // back after an outage (e.g. Motive restarted), the client connects
+    // again, hands the new server description to the decoding thread,
+    // refreshes the model definitions and renews its subscriptions.
+    void startCommandChannel(bool unicast)
+    {
+      commands->start(unicast,
+        [this]() {
+          commands->requestAsync(NAT_CONNECT, NAT_SERVERINFO, [this](const char* data, size_t length) {
+            NatNetServerInfo info;
+            bool subscriptionsSupported = true;
+            if (parseServerInfo(data, length, info)) {
+              modelDefDecoder.setVersion(info.versionMajor, info.versionMinor);
+              {
+                std::lock_guard<std::mutex> lk(serverInfoMutex);
+                receivedServerInfo = info;
               }
+              serverInfoReceived.store(true, std::memory_order_release);
+              subscriptionsSupported = !info.isMulticast && info.versionMajor >= 4;
             }
+            fetchModelDef();
+            if (subscriptionsSupported) {
+              subscribe(false);
+            }
+          });
+        },
+        [this](const char* data, size_t length) {
+          // e.g. a late reply to a request that was resent
+          if (NatNetFrameDecoder::messageId(data, length) == NAT_MODELDEF) {
+            handleModelDef(data, length);
           }
-          else if ((major == 4 && minor >= 1) || major > 4)
-          {
-            // We got a description_size for > 4.1, which is simpler to discard
-            // for unsuported datatypes
-            ptr += description_size;
+        });
+    }
+
+    // on the command thread; the result is picked up by decode()
+    void handleModelDef(const char* data, size_t length)
+    {
+      std::vector<NatNetRigidBodyDescription> bodies;
+      if (!modelDefDecoder.decodeModelDef(data, length, bodies)) {
+        printf("Incomplete model definition received; using %zu rigid bodies.\n", bodies.size());
+      }
+      std::lock_guard<std::mutex> lk(modelDefMutex);
+      receivedModelDef.swap(bodies);
+      modelDefReceived.store(true, std::memory_order_release);
+    }
+
+    // Sends the unicast subscriptions; with 'wait', the first frames are
+    // already filtered. A rejected subscription leaves the server streaming
+    // that data type unfiltered.
+    void subscribe(bool wait)
+    {
+      for (const std::string& subscription : subscriptions) {
+        // the command is a null-terminated string
+        const std::string command(subscription.c_str(), subscription.size() + 1);
+        if (wait) {
+          try {
+            const std::vector<char> reply = commands->request(NAT_REQUEST, NAT_RESPONSE, command);
+            checkSubscription(subscription, reply.data(), reply.size());
+          } catch (const std::runtime_error&) {
+            checkSubscription(subscription, nullptr, 0);
           }
-          else if(type ==2)   // skeleton
-          {
-            // char szName[MAX_NAMELENGTH];
-            // strcpy(szName, ptr);
-            ptr += strlen(ptr) + 1;
-            // printf("Name: %s\n", szName);
-
-            // int ID = 0; memcpy(&ID, ptr, 4);
-            ptr +=4;
-            // printf("ID : %d\n", ID);
-
-            int nRigidBodies = 0; memcpy(&nRigidBodies, ptr, 4); ptr +=4;
-            // printf("RigidBody (Bone) Count : %d\n", nRigidBodies);
-
-            for(int i=0; i< nRigidBodies; i++)
-            {
-                if(major >= 2)
-                {
-                    // RB name
-                    // char szName[MAX_NAMELENGTH];
-                    // strcpy(szName, ptr);
-                    ptr += strlen(ptr) + 1;
-                    // printf("Rigid Body Name: %s\n", szName);
-                }
-
-                // int ID = 0; memcpy(&ID, ptr, 4);
-                ptr +=4;
-                // printf("RigidBody ID : %d\n", ID);
-
-                // int parentID = 0; memcpy(&parentID, ptr, 4);
-                ptr +=4;
-                // printf("Parent ID : %d\n", parentID);
-
-                // float xoffset = 0; memcpy(&xoffset, ptr, 4);
-                ptr +=4;
-                // printf("X Offset : %3.2f\n", xoffset);
-
-                // float yoffset = 0; memcpy(&yoffset, ptr, 4);
-                ptr +=4;
-                // printf("Y Offset : %3.2f\n", yoffset);
-
-                // float zoffset = 0; memcpy(&zoffset, ptr, 4);
-                ptr +=4;
-                // printf("Z Offset : %3.2f\n", zoffset);
-            }
+        } else {
+          commands->requestAsync(NAT_REQUEST, NAT_RESPONSE,
+            [subscription](const char* data, size_t length) {
+              checkSubscription(subscription, data, length);
+            },
+            command);
+        }
+      }
+    }
+
+    // the reply carries the result, 0 for success
+    static void checkSubscription(const std::string& subscription, const char* data, size_t length)
+    {
+      int32_t result = 0;
+      if (data && length >= 4 + sizeof(result)) {
+        memcpy(&result, data + 4, sizeof(result));
+      }
+      if (!data || result != 0) {
+        printf("NatNet server did not accept '%s'.\n", subscription.c_str());
+      }
+    }
+
+    void fetchModelDef()
+    {
+      commands->requestAsync(NAT_REQUEST_MODELDEF, NAT_MODELDEF,
+        [this](const char* data, size_t length) {
+          if (data) {
+            handleModelDef(data, length);
           }
-        }   // next dataset
+        });
+    }
+
+    // on the decoding thread
+    void requestModelDef(uint64_t now)
+    {
+      refreshWanted = false;
+      lastRefresh = now;
+      // reset by decode() once no body is unknown
+      refreshInterval = std::min(refreshInterval * 2, MODELDEF_REFRESH_MAX_INTERVAL);
+      fetchModelDef();
+    }
 
-       // printf("End Packet\n-------------\n");
+    // Decodes datagram i of the batch into 'frame'. Returns false for
+    // other packets and truncated frames, which leave 'frame' unchanged.
+    bool decode(size_t i, Frame& frame);
+
+    // receives the datagrams that are queued into the batch; returns their
+    // number and adds their size to 'bytes'
+    size_t receiveBatch(size_t& bytes)
+    {
+      TRACE_SCOPE("receive");
+      boost::system::error_code ec;
+      const size_t count = datagrams.receive(socket, ec);
+      if (ec) {
+        throw boost::system::system_error(ec);
+      }
+      if (count > 0) {
+        datagramCount = count;
+        nextDatagram = 0;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        bytes += datagrams.length(i);
+      }
+      return count;
+    }
 
+    // waits at most 'timeout' until the data socket has a datagram queued
+    bool waitReadable(std::chrono::nanoseconds timeout)
+    {
+      if (socket.available() > 0) {
+        return true;
+      }
+      if (timeout <= std::chrono::nanoseconds::zero()) {
+        return false;
       }
+      bool readable = false;
+      socket.async_wait(boost::asio::ip::udp::socket::wait_read,
+        [&readable](const boost::system::error_code& ec) { readable = !ec; });
+      io_context.restart();
+      if (io_context.run_for(timeout) == 0) {
+        // timed out: cancel the pending wait and let its handler run
+        socket.cancel();
+        io_context.restart();
+        io_context.run();
+      }
+      return readable;
     }
 
   public:
     // NatNetClient client;
-    std::string version;
-    int versionMajor;
-    int versionMinor;
-    uint64_t clockFrequency; // ticks/second for timestamps
+    // what the decoder and the data socket are set up for (decoding thread)
+    NatNetServerInfo server;
+    std::string interfaceAddress; // local interface for multicast
 
     boost::asio::io_context io_context;
     boost::asio::ip::udp::socket socket;
-    boost::asio::ip::udp::endpoint sender_endpoint;
-    std::vector<char> data;
-
-    struct rigidBody {
-      int ID;
-      float x;
-      float y;
-      float z;
-      float qx;
-      float qy;
-      float qz;
-      float qw;
-      float fError; // mean marker error
-      bool bTrackingValid;
-    };
-    std::vector<rigidBody> rigidBodies;
-
-    struct marker {
-      float x;
-      float y;
-      float z;
-    };
-    std::vector<marker> markers;
-
-    struct rigidBodyDefinition {
-      std::string name;
-      int ID;
-      int parentID;
-      float xoffset;
-      float yoffset;
-      float zoffset;
-    };
-    std::map<int, rigidBodyDefinition> rigidBodyDefinitions;
+    DatagramBatch datagrams;
+    size_t datagramCount; // valid datagrams in the batch
+    size_t nextDatagram;  // next one to decode (DeliverAll)
+    NatNetFrameDecoder decoder;
+    NatNetFrameDecoder modelDefDecoder; // command thread once it runs
+
+    // decode() writes here and swaps with the frame on success
+    Frame scratch;
+
+    RigidBodyTable rigidBodies;
+    // set when a frame had a tracked body that the model definitions lack;
+    // such bodies are skipped until the definitions are refreshed
+    bool unknownBodies;
+
+    // model definitions decoded by the command thread, applied by decode()
+    std::mutex modelDefMutex; // protects receivedModelDef
+    std::vector<NatNetRigidBodyDescription> receivedModelDef;
+    std::atomic<bool> modelDefReceived;
+
+    // server description received on reconnect, see checkServerInfo()
+    std::mutex serverInfoMutex; // protects receivedServerInfo
+    NatNetServerInfo receivedServerInfo;
+    std::atomic<bool> serverInfoReceived;
+
+    // refresh state of the decoding thread
+    bool refreshWanted;
+    uint64_t lastRefresh; // host time of the last model definition request
+    uint64_t refreshInterval; // minimum time to the next request
+    bool modelsChanged;   // bTrackedModelsChanged of the previous frame
+
+    // NAT_REQUEST commands that select the data of a unicast stream
+    std::vector<std::string> subscriptions;
+
+    // last, as its thread uses the members above
+    std::unique_ptr<NatNetCommandChannel> commands;
   };
 
-  MotionCaptureOptitrack::MotionCaptureOptitrack(
-    const std::string &hostname,
-    const std::string& interface_ip,
-    int port_command)
+  // Writes decoded NatNet data directly into a Frame
+  class FrameWriter : public NatNetFrameVisitor
   {
-    pImpl = new MotionCaptureOptitrackImpl;
-
-    // Connect to command port to query version
-    boost::asio::io_context io_context_cmd;
-    udp::socket socket_cmd(io_context_cmd, udp::endpoint(udp::v4(), 0));
-    udp::resolver resolver_cmd(io_context_cmd);
-    udp::endpoint endpoint_cmd(boost::asio::ip::make_address(hostname), port_command);
+  public:
+    FrameWriter(const MotionCaptureOptitrackImpl& impl, Frame& frame)
+      : impl_(impl)
+      , frame_(frame)
+      , markerCount_(0)
+      , unknownBodies_(0)
+      , modelsChanged_(false)
+    {
+    }
 
-    typedef struct
+    // tracked bodies of the frame without a definition
+    size_t unknownBodies() const
     {
-      unsigned short iMessage;                // message ID (e.g. NAT_FRAMEOFDATA)
-      unsigned short nDataBytes;              // Num bytes in payload
-    } sRequest;
+      return unknownBodies_;
+    }
 
-    typedef struct
+    // the server flagged that the tracked models changed (bTrackedModelsChanged)
+    bool modelsChanged() const
     {
-      unsigned short iMessage;
-      unsigned short nDataBytes;
-      char szName[MAX_NAMELENGTH];      // host app's name
-      unsigned char Version[4];         // host app's version [major.minor.build.revision]
-      unsigned char NatNetVersion[4];   // host app's NatNet version [major.minor.build.revision]
-      uint8_t HighResClockFrequency[8];   // host's high resolution clock frequency (ticks per second)
-      uint16_t DataPort;
-      bool IsMulticast;
-      uint8_t MulticastGroupAddress[4];
-    } sResponse;
-
-    sRequest connectCmd = {NAT_CONNECT, 0};
-    socket_cmd.send_to(boost::asio::buffer(&connectCmd, sizeof(connectCmd)), endpoint_cmd);
-
-    sResponse response;
-    udp::endpoint sender_endpoint;
-    size_t reply_length = socket_cmd.receive_from(
-        boost::asio::buffer(&response, sizeof(response)), sender_endpoint);
-
-    if (response.iMessage != NAT_SERVERINFO) {
-      throw std::runtime_error("Could not query NatNet version!");
+      return modelsChanged_;
     }
 
-    std::ostringstream stringStream;
-    stringStream << (int)response.NatNetVersion[0] << "."
-                 << (int)response.NatNetVersion[1] << "."
-                 << (int)response.NatNetVersion[2] << "."
-                 << (int)response.NatNetVersion[3];
-    pImpl->version = stringStream.str();
+    virtual void beginFrame(int frameNumber)
+    {
+      frame_.setFrameNumber((uint32_t)frameNumber);
+      frame_.invalidate();
+      frame_.latency().clear();
+      markerCount_ = 0;
+      unknownBodies_ = 0;
+    }
 
-    pImpl->versionMajor = response.NatNetVersion[0];
-    pImpl->versionMinor = response.NatNetVersion[1];
-    memcpy(&pImpl->clockFrequency, response.HighResClockFrequency, sizeof(uint64_t));
+    virtual void beginMarkers(size_t count)
+    {
+      // only grow here (Eigen reallocates on every resize); endFrame() trims
+      auto& pointCloud = frame_.pointCloud();
+      if ((size_t)pointCloud.rows() < markerCount_ + count) {
+        pointCloud.conservativeResize(markerCount_ + count, Eigen::NoChange);
+      }
+    }
 
-    uint16_t port_data = response.DataPort;
+    virtual void marker(float x, float y, float z)
+    {
+      frame_.pointCloud().row(markerCount_++) << x, y, z;
+    }
 
-    // query model def
-    sRequest modelDefCmd = {NAT_REQUEST_MODELDEF, 0};
-    socket_cmd.send_to(boost::asio::buffer(&modelDefCmd, sizeof(modelDefCmd)), endpoint_cmd);
-    std::vector<char> modelDef(MAX_PACKETSIZE);
-    reply_length = socket_cmd.receive_from(
-        boost::asio::buffer(modelDef.data(), modelDef.size()), sender_endpoint);
-    modelDef.resize(reply_length);
-    pImpl->parseModelDef(modelDef.data());
-
-    // connect to data port to receive mocap data
-    auto listen_address_boost = boost::asio::ip::make_address_v4(interface_ip);
-
-    // Create the socket so that multiple may be bound to the same address.
-    boost::asio::ip::udp::endpoint listen_endpoint(
-        boost::asio::ip::address_v4::any(), port_data);
-    pImpl->socket.open(listen_endpoint.protocol());
-    pImpl->socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
-    pImpl->socket.bind(listen_endpoint);
-
-    if (response.IsMulticast) {
-      std::stringstream sstr;
-      sstr << (int)response.MulticastGroupAddress[0] << "."
-           << (int)response.MulticastGroupAddress[1] << "."
-           << (int)response.MulticastGroupAddress[2] << "."
-           << (int)response.MulticastGroupAddress[3];
-      std::string multicast_address = sstr.str();
-      auto multicast_address_boost = boost::asio::ip::make_address_v4(multicast_address);
-      // Join the multicast group on a specific interface
-      pImpl->socket.set_option(boost::asio::ip::multicast::join_group(multicast_address_boost, listen_address_boost));
-    } else {
-      // log some server info
-      std::ostringstream ustr;
-      ustr << "Using unicast from server " << hostname << ":" << port_data;
-      std::cout << ustr.str() << std::endl;
+    virtual void rigidBody(const NatNetRigidBody& rb)
+    {
+      if (!rb.tracked) {
+        return;
+      }
+      const RigidBodyTable::Entry* def = impl_.rigidBodies.find(rb.id);
+      if (!def) {
+        ++unknownBodies_;
+        return;
+      }
+      const Eigen::Vector3f position = Eigen::Vector3f(rb.x, rb.y, rb.z) + def->offset;
+      const Eigen::Quaternionf rotation(
+        rb.qw, // w
+        rb.qx, // x
+        rb.qy, // y
+        rb.qz  // z
+        );
+      frame_.setPose(def->slot, position, rotation);
     }
-  }
 
-  const std::string & MotionCaptureOptitrack::version() const
-  {
-    return pImpl->version;
-  }
+    virtual void timestamps(
+      uint64_t cameraMidExposure,
+      uint64_t cameraDataReceived,
+      uint64_t transmit)
+    {
+      auto& latencies = frame_.latency();
+      const uint64_t cameraLatencyTicks = cameraDataReceived - cameraMidExposure;
+      const double cameraLatencySeconds = cameraLatencyTicks / (double)impl_.server.clockFrequency;
+      latencies.emplace_back(LatencyInfo("Camera", cameraLatencySeconds));
 
-  void MotionCaptureOptitrack::waitForNextFrame()
-  {
-    // use a loop to get latest data
-    do {
-      pImpl->data.resize(MAX_PACKETSIZE);
-      size_t length = pImpl->socket.receive_from(boost::asio::buffer(pImpl->data.data(), pImpl->data.size()), pImpl->sender_endpoint);
-      pImpl->data.resize(length);
-    } while (pImpl->socket.available() > 0);
-
-    if (pImpl->data.size() > 4) {
-      char *ptr = pImpl->data.data();
-      int major = pImpl->versionMajor;
-      int minor = pImpl->versionMinor;
-
-      // First 2 Bytes is message ID
-      int MessageID = 0;
-      memcpy(&MessageID, ptr, 2); ptr += 2;
-      // printf("Message ID : %d\n", MessageID);
-
-      // Second 2 Bytes is the size of the packet
-      int nBytes = 0;
-      memcpy(&nBytes, ptr, 2); ptr += 2;
-      // printf("Byte count : %d\n", nBytes);
-
-      if(MessageID == 7)      // FRAME OF MOCAP DATA packet
-      {
-        // Next 4 Bytes is the frame number
-        int frameNumber = 0; memcpy(&frameNumber, ptr, 4); ptr += 4;
-        // printf("Frame # : %d\n", frameNumber);
-      
-        // Next 4 Bytes is the number of data sets (markersets, rigidbodies, etc)
-        int nMarkerSets = 0; memcpy(&nMarkerSets, ptr, 4); ptr += 4;
-        // printf("Marker Set Count : %d\n", nMarkerSets);
-
-        int nBytes=0;
-        ptr = UnpackDataSize(ptr, major, minor,nBytes);
-
-        // Loop through number of marker sets and get name and data
-        for (int i=0; i < nMarkerSets; i++)
-        {
-          ptr += strlen(ptr) + 1;
-          int nMarkers = 0; memcpy(&nMarkers, ptr, 4); ptr += 4;
-          ptr += nMarkers * 12;
-        }
+      const uint64_t swLatencyTicks = transmit - cameraDataReceived;
+      const double swLatencySeconds = swLatencyTicks / (double)impl_.server.clockFrequency;
+      latencies.emplace_back(LatencyInfo("Motive", swLatencySeconds));
 
-        // Loop through unlabeled markers
-        // OtherMarker list is Deprecated
-        int nOtherMarkers = 0; memcpy(&nOtherMarkers, ptr, 4); ptr += 4;
-        ptr = UnpackDataSize(ptr, major, minor,nBytes);
-        pImpl->markers.resize(nOtherMarkers);
-        for (int j = 0; j < nOtherMarkers; j++)
-        {
-          memcpy(&pImpl->markers[j].x, ptr, 4); ptr += 4;
-          memcpy(&pImpl->markers[j].y, ptr, 4); ptr += 4;
-          memcpy(&pImpl->markers[j].z, ptr, 4); ptr += 4;
-        }
+      // convert actual shutter timestamp to microseconds
+      frame_.setTimeStamp(cameraMidExposure * 1e6 / impl_.server.clockFrequency);
+    }
 
-        // Loop through rigidbodies
-        int nRigidBodies = 0; memcpy(&nRigidBodies, ptr, 4); ptr += 4;
-        ptr = UnpackDataSize(ptr, major, minor,nBytes);
-        pImpl->rigidBodies.resize(nRigidBodies);
-        // printf("Rigid Body Count : %d\n", nRigidBodies);
-        for (int j=0; j < nRigidBodies; j++)
-        {
-          // Rigid body position and orientation 
-          memcpy(&pImpl->rigidBodies[j].ID, ptr, 4); ptr += 4;
-          memcpy(&pImpl->rigidBodies[j].x, ptr, 4); ptr += 4;
-          memcpy(&pImpl->rigidBodies[j].y, ptr, 4); ptr += 4;
-          memcpy(&pImpl->rigidBodies[j].z, ptr, 4); ptr += 4;
-          memcpy(&pImpl->rigidBodies[j].qx, ptr, 4); ptr += 4;
-          memcpy(&pImpl->rigidBodies[j].qy, ptr, 4); ptr += 4;
-          memcpy(&pImpl->rigidBodies[j].qz, ptr, 4); ptr += 4;
-          memcpy(&pImpl->rigidBodies[j].qw, ptr, 4); ptr += 4;
-
-          // NatNet version 2.0 and later
-          if(major >= 2)
-          {
-            // Mean marker error
-            memcpy(&pImpl->rigidBodies[j].fError, ptr, 4); ptr += 4;
-          }
+    virtual void endFrame(uint16_t params)
+    {
+      modelsChanged_ = (params & 0x02) != 0;
+      auto& pointCloud = frame_.pointCloud();
+      if ((size_t)pointCloud.rows() != markerCount_) {
+        pointCloud.conservativeResize(markerCount_, Eigen::NoChange);
+      }
+    }
 
-          // NatNet version 2.6 and later
-          if( ((major == 2)&&(minor >= 6)) || (major > 2) || (major == 0) ) 
-          {
-            // params
-            short params = 0; memcpy(&params, ptr, 2); ptr += 2;
-            pImpl->rigidBodies[j].bTrackingValid = params & 0x01; // 0x01 : rigid body was successfully tracked in this frame
-          }
-        } // Go to next rigid body
-
-        // Skeletons (NatNet version 2.1 and later)
-        // (we do not support skeletons)
-        if( ((major == 2)&&(minor>0)) || (major>2))
-        {
-          int nSkeletons = 0; memcpy(&nSkeletons, ptr, 4); ptr += 4;
-          // printf("Skeleton Count : %d\n", nSkeletons);
-          ptr = UnpackDataSize(ptr, major, minor,nBytes);
-
-          // Loop through skeletons
-          for (int j=0; j < nSkeletons; j++)
-          {
-            // skeleton id
-            // int skeletonID = 0;
-            // memcpy(&skeletonID, ptr, 4);
-            ptr += 4;
-
-            // Number of rigid bodies (bones) in skeleton
-            int nRigidBodies = 0;
-            memcpy(&nRigidBodies, ptr, 4); ptr += 4;
-            // printf("Rigid Body Count : %d\n", nRigidBodies);
-
-            // Loop through rigid bodies (bones) in skeleton
-            for (int j=0; j < nRigidBodies; j++)
-            {
-              // Rigid body position and orientation
-              ptr += 8*4;
-
-              // Mean marker error (NatNet version 2.0 and later)
-              if(major >= 2)
-              {
-                ptr += 4;
-              }
+  private:
+    const MotionCaptureOptitrackImpl& impl_;
+    Frame& frame_;
+    size_t markerCount_;
+    size_t unknownBodies_;
+    bool modelsChanged_;
+  };
 
-              // Tracking flags (NatNet version 2.6 and later)
-              if( ((major == 2)&&(minor >= 6)) || (major > 2) || (major == 0) ) 
-              {
-                ptr += 2;
-              }
-            } // next rigid body
-          } // next skeleton
+  bool MotionCaptureOptitrackImpl::decode(size_t i, Frame& frame)
+  {
+    const char* packet = datagrams.data(i);
+    const size_t length = datagrams.length(i);
+    const int messageId = NatNetFrameDecoder::messageId(packet, length);
+    if (messageId == NatNetFrameDecoder::MESSAGE_FRAMEOFDATA) {
+      if (modelDefReceived.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lk(modelDefMutex);
+        applyModelDef(receivedModelDef, frame);
+        modelDefReceived.store(false, std::memory_order_relaxed);
+      }
+
+      // a truncated packet leaves a partial frame behind in scratch, which
+      // the next decode overwrites
+      FrameWriter writer(*this, scratch);
+      if (decoder.decode(packet, length, writer)) {
+        const uint64_t hostTimeStamp = datagrams.hostTimeStamp(i);
+        scratch.setHostTimeStamp(hostTimeStamp);
+        std::swap(frame, scratch);
+
+        // refresh the model definitions when the server reports a change
+        // or sends bodies we do not know, at most every MODELDEF_REFRESH_INTERVAL.
+        // While refreshes leave bodies unknown (the server streams a body
+        // it does not describe), the interval doubles up to
+        // MODELDEF_REFRESH_MAX_INTERVAL; a reported change resets it.
+        if (writer.unknownBodies() > 0) {
+          if (!unknownBodies) {
+            unknownBodies = true;
+            printf("Frame contains %zu rigid bodies without a model definition; skipping them.\n",
+              writer.unknownBodies());
+          }
+          refreshWanted = true;
+        } else {
+          refreshInterval = MODELDEF_REFRESH_INTERVAL;
         }
+        if (writer.modelsChanged() && !modelsChanged) {
+          refreshWanted = true;
+          refreshInterval = MODELDEF_REFRESH_INTERVAL;
+        }
+        modelsChanged = writer.modelsChanged();
+        if (refreshWanted && hostTimeStamp >= lastRefresh + refreshInterval) {
+          requestModelDef(hostTimeStamp);
+        }
+        return true;
+      }
+    } else if (messageId >= 0) {
+      printf("Unrecognized Packet Type.\n");
+    }
+    return false;
+  }
 
-        // Assets ( Motive 3.1 / NatNet 4.1 and greater)
-        if (((major == 4) && (minor > 0)) || (major > 4))
-        {
-            int nAssets = 0;
-            memcpy(&nAssets, ptr, 4); ptr += 4;
-            // printf("Asset Count : %d\n", nAssets);
+  MotionCaptureOptitrack::MotionCaptureOptitrack(
+    const std::string &hostname,
+    const std::string& interface_ip,
+    int port_command,
+    bool enable_objects,
+    bool enable_pointcloud,
+    const std::string& subscribe_rigid_bodies)
+  {
+    // owned here until the connection is set up; the destructor does not run
+    // if this constructor throws
+    std::unique_ptr<MotionCaptureOptitrackImpl> impl(new MotionCaptureOptitrackImpl(memoryResource_));
+    pImpl = impl.get();
 
-            int nBytes=0;
-            ptr = UnpackDataSize(ptr, major, minor,nBytes);
-            ptr += nBytes;
-        }
-        
-        // labeled markers (NatNet version 2.3 and later)
-        // labeled markers - this includes all markers: Active, Passive, and 'unlabeled' (markers with no asset but a PointCloud ID)
-        if( ((major == 2)&&(minor>=3)) || (major>2))
-        {
-          int nLabeledMarkers = 0;
-          memcpy(&nLabeledMarkers, ptr, 4); ptr += 4;
-          ptr = UnpackDataSize(ptr, major, minor,nBytes);
-          pImpl->markers.resize(nOtherMarkers + nLabeledMarkers);
-          // printf("Labeled Marker Count : %d\n", nLabeledMarkers);
-
-          // Loop through labeled markers
-          for (int j=0; j < nLabeledMarkers; j++)
-          {
-            // id
-            // Marker ID Scheme:
-            // Active Markers:
-            //   ID = ActiveID, correlates to RB ActiveLabels list
-            // Passive Markers: 
-            //   If Asset with Legacy Labels
-            //      AssetID   (Hi Word)
-            //      MemberID  (Lo Word)
-            //   Else
-            //      PointCloud ID
-            // int ID = 0; memcpy(&ID, ptr, 4);
-            ptr += 4;
-            // int modelID, markerID;
-            // DecodeMarkerID(ID, &modelID, &markerID);
-
-            memcpy(&pImpl->markers[nOtherMarkers + j].x, ptr, 4); ptr += 4;
-            memcpy(&pImpl->markers[nOtherMarkers + j].y, ptr, 4); ptr += 4;
-            memcpy(&pImpl->markers[nOtherMarkers + j].z, ptr, 4); ptr += 4;
-            // size
-            //float size = 0.0f; memcpy(&size, ptr, 4);
-            ptr += 4;
-
-            // NatNet version 2.6 and later
-            if( ((major == 2)&&(minor >= 6)) || (major > 2) || (major == 0) ) 
-            {
-              // marker params
-              // short params = 0; memcpy(&params, ptr, 2);
-              ptr += 2;
-              // bool bOccluded = (params & 0x01) != 0;     // marker was not visible (occluded) in this frame
-              // bool bPCSolved = (params & 0x02) != 0;     // position provided by point cloud solve
-              // bool bModelSolved = (params & 0x04) != 0;  // position provided by model solve
-              // if ((major >= 3) || (major == 0))
-              // {
-              //   bool bHasModel = (params & 0x08) != 0;     // marker has an associated asset in the data stream
-              //   bool bUnlabeled = (params & 0x10) != 0;    // marker is 'unlabeled', but has a point cloud ID
-              //   bool bActiveMarker = (params & 0x20) != 0; // marker is an actively labeled LED marker
-              // }
-            }
+    // Connect to command port to query version
+    udp::endpoint endpoint_cmd(boost::asio::ip::make_address(hostname), port_command);
+    pImpl->commands.reset(new NatNetCommandChannel(endpoint_cmd));
 
-            // NatNet version 3.0 and later
-            // float residual = 0.0f;
-            if ((major >= 3) || (major == 0))
-            {
-              // Marker residual
-              // memcpy(&residual, ptr, 4);
-              ptr += 4;
-            }
-          }
-        }
+    const std::vector<char> serverInfo = pImpl->commands->request(NAT_CONNECT, NAT_SERVERINFO);
+    NatNetServerInfo server;
+    if (!MotionCaptureOptitrackImpl::parseServerInfo(serverInfo.data(), serverInfo.size(), server)) {
+      throw std::runtime_error("Could not query NatNet version!");
+    }
+    pImpl->interfaceAddress = interface_ip;
+    pImpl->applyServerInfo(server);
+    pImpl->modelDefDecoder.setVersion(server.versionMajor, server.versionMinor);
 
-        // Force Plate data (NatNet version 2.9 and later)
-        if (((major == 2) && (minor >= 9)) || (major > 2))
-        {
-          int nForcePlates;
-          memcpy(&nForcePlates, ptr, 4); ptr += 4;
-          ptr = UnpackDataSize(ptr, major, minor,nBytes);
-          for (int iForcePlate = 0; iForcePlate < nForcePlates; iForcePlate++)
-          {
-            // ID
-            // int ID = 0; memcpy(&ID, ptr, 4);
-            ptr += 4;
-            // printf("Force Plate : %d\n", ID);
-
-            // Channel Count
-            int nChannels = 0; memcpy(&nChannels, ptr, 4); ptr += 4;
-
-            // Channel Data
-            for (int i = 0; i < nChannels; i++)
-            {
-              // printf(" Channel %d : ", i);
-              int nFrames = 0; memcpy(&nFrames, ptr, 4); ptr += 4;
-              for (int j = 0; j < nFrames; j++)
-              {
-                  // float val = 0.0f;  memcpy(&val, ptr, 4);
-                  ptr += 4;
-                  // printf("%3.2f   ", val);
-              }
-              // printf("\n");
-            }
-          }
-        }
+    // query model def
+    const std::vector<char> modelDef = pImpl->commands->request(NAT_REQUEST_MODELDEF, NAT_MODELDEF);
+    std::vector<NatNetRigidBodyDescription> bodies;
+    if (!pImpl->modelDefDecoder.decodeModelDef(modelDef.data(), modelDef.size(), bodies)) {
+      printf("Incomplete model definition received; using %zu rigid bodies.\n", bodies.size());
+    }
+    pImpl->applyModelDef(bodies, frame_);
 
-        // Device data (NatNet version 3.0 and later)
-        if (((major == 2) && (minor >= 11)) || (major > 2))
-        {
-          int nDevices;
-          memcpy(&nDevices, ptr, 4); ptr += 4;
-          ptr = UnpackDataSize(ptr, major, minor,nBytes);
-          for (int iDevice = 0; iDevice < nDevices; iDevice++)
-          {
-            // ID
-            // int ID = 0; memcpy(&ID, ptr, 4);
-            ptr += 4;
-            // printf("Device : %d\n", ID);
-
-            // Channel Count
-            int nChannels = 0; memcpy(&nChannels, ptr, 4); ptr += 4;
-
-            // Channel Data
-            for (int i = 0; i < nChannels; i++)
-            {
-              // printf(" Channel %d : ", i);
-              int nFrames = 0; memcpy(&nFrames, ptr, 4); ptr += 4;
-              for (int j = 0; j < nFrames; j++)
-              {
-                  // float val = 0.0f;  memcpy(&val, ptr, 4); 
-                  ptr += 4;
-                  // printf("%3.2f   ", val);
+    if (!server.isMulticast) {
+      // log some server info
+      std::ostringstream ustr;
+      ustr << "Using unicast from server " << hostname << ":" << server.dataPort;
+      std::cout << ustr.str() << std::endl;
+
+      // NatNet 4.0 streams only what is subscribed to, once anything is
+      if (server.versionMajor >= 4) {
+        auto& subscriptions = pImpl->subscriptions;
+        if (enable_objects) {
+          if (subscribe_rigid_bodies.empty()) {
+            subscriptions.push_back("SubscribeToData,RigidBody,All");
+          } else {
+            std::istringstream names(subscribe_rigid_bodies);
+            std::string name;
+            while (std::getline(names, name, ';')) {
+              if (!name.empty()) {
+                subscriptions.push_back("SubscribeToData,RigidBody," + name);
               }
-              // printf("\n");
             }
           }
         }
-    
-        // software latency (removed in version 3.0)
-        if ( major < 3 )
-        {
-          // float softwareLatency = 0.0f; memcpy(&softwareLatency, ptr, 4);
-          ptr += 4;
-          // printf("software latency : %3.3f\n", softwareLatency);
+        if (enable_pointcloud) {
+          subscriptions.push_back("SubscribeToData,LabeledMarkers,All");
         }
-
-        // timecode
-        // unsigned int timecode = 0;  memcpy(&timecode, ptr, 4);
-        ptr += 4;
-        // unsigned int timecodeSub = 0; memcpy(&timecodeSub, ptr, 4);
-        ptr += 4;
-        // char szTimecode[128] = "";
-        // TimecodeStringify(timecode, timecodeSub, szTimecode, 128);
-
-        // timestamp
-        // double timestamp = 0.0f;
-
-        // NatNet version 2.7 and later - increased from single to double precision
-        if( ((major == 2)&&(minor>=7)) || (major>2))
-        {
-          // memcpy(&timestamp, ptr, 8);
-          ptr += 8;
+        if (subscriptions.empty()) {
+          // nothing wanted, but without any subscription everything is sent
+          subscriptions.push_back("SubscribeToData,AllTypes,None");
         }
-        else
-        {
-          // float fTemp = 0.0f;
-          // memcpy(&fTemp, ptr, 4);
-          ptr += 4;
-          // timestamp = (double)fTemp;
-        }
-        // printf("Timestamp : %3.3f\n", timestamp);
-
-        // high res timestamps (version 3.0 and later)
-        latencies_.clear();
-        if ( (major >= 3) || (major == 0) )
-        {
-          uint64_t cameraMidExposureTimestamp = 0;
-          memcpy( &cameraMidExposureTimestamp, ptr, 8 );
-          ptr += 8;
-
-          uint64_t cameraDataReceivedTimestamp = 0;
-          memcpy( &cameraDataReceivedTimestamp, ptr, 8 );
-          ptr += 8;
-
-          uint64_t transmitTimestamp = 0;
-          memcpy( &transmitTimestamp, ptr, 8 );
-          ptr += 8;
-
-          const uint64_t cameraLatencyTicks = cameraDataReceivedTimestamp - cameraMidExposureTimestamp;
-          const double cameraLatencySeconds = cameraLatencyTicks / (double)pImpl->clockFrequency;
-          latencies_.emplace_back(LatencyInfo("Camera", cameraLatencySeconds));
-
-          const uint64_t swLatencyTicks = transmitTimestamp - cameraDataReceivedTimestamp;
-          const double swLatencySeconds = swLatencyTicks / (double)pImpl->clockFrequency;
-          latencies_.emplace_back(LatencyInfo("Motive", swLatencySeconds));
-
-          // convert actual shutter timestamp to microseconds
-          timestamp_ = cameraMidExposureTimestamp * 1e6 / pImpl->clockFrequency;
-        }
-
-        // frame params
-        short params = 0;  memcpy(&params, ptr, 2);
-        ptr += 2;
-        // bool bIsRecording = (params & 0x01) != 0;                  // 0x01 Motive is recording
-        bool bTrackedModelsChanged = (params & 0x02) != 0;         // 0x02 Actively tracked model list has changed
-
-        // end of data tag
-        // int eod = 0; memcpy(&eod, ptr, 4); ptr += 4;
-        // printf("End Packet\n-------------\n");
-      }
-      else
-      {
-          printf("Unrecognized Packet Type.\n");
+        pImpl->subscribe(true);
       }
     }
 
+    pImpl->startCommandChannel(!server.isMulticast);
+    impl.release();
   }
 
-  const std::map<std::string, RigidBody>& MotionCaptureOptitrack::rigidBodies() const
+  const std::string & MotionCaptureOptitrack::version() const
   {
-    // TODO: avoid copies here...
-    rigidBodies_.clear();
-    for (const auto& rb : pImpl->rigidBodies) {
-      if (rb.bTrackingValid) {
-        const auto& def = pImpl->rigidBodyDefinitions[rb.ID];
-
-        Eigen::Vector3f position(
-          rb.x + def.xoffset,
-          rb.y + def.yoffset,
-          rb.z + def.zoffset);
-
-        Eigen::Quaternionf rotation(
-          rb.qw, // w
-          rb.qx, // x
-          rb.qy, // y
-          rb.qz  // z
-          );
-        rigidBodies_.emplace(def.name, RigidBody(def.name, position, rotation));
-      }
-    }
-    return rigidBodies_;
+    return pImpl->server.version;
   }
 
-  const PointCloud& MotionCaptureOptitrack::pointCloud() const
+  bool MotionCaptureOptitrack::serverResponding() const
   {
-    // TODO: avoid copies here...
-    pointcloud_.resize(pImpl->markers.size(), Eigen::NoChange);
-    for (size_t r = 0; r < pImpl->markers.size(); ++r) {
-      const auto& marker = pImpl->markers[r];
-      pointcloud_.row(r) << marker.x, marker.y, marker.z;
-    }
-    return pointcloud_;
+    return !pImpl->commands->lost();
   }
 
-  const std::vector<LatencyInfo> &MotionCaptureOptitrack::latency() const
+  bool MotionCaptureOptitrack::receiveFrame(std::chrono::nanoseconds timeout)
   {
-    return latencies_;
-  }
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    size_t bytes = 0;
+    pImpl->checkServerInfo();
+
+    if (deliveryPolicy() != DeliverLatest) {
+      // hand out the datagrams of the current batch one by one, oldest
+      // first; the socket buffers the rest
+      do {
+        while (pImpl->nextDatagram < pImpl->datagramCount) {
+          const size_t i = pImpl->nextDatagram++;
+          const uint64_t start = hostTime();
+          if (pImpl->decode(i, frame_)) {
+            recordParseTime(hostTime() - start);
+            TRACE_SPAN("decode", start);
+            recordReceived(pImpl->datagrams.length(i), 1);
+            frameReceived(frame_);
+            return true;
+          }
+        }
+      } while (pImpl->waitReadable(deadline - std::chrono::steady_clock::now())
+               && pImpl->receiveBatch(bytes) > 0);
+      return false;
+    }
 
-  uint64_t MotionCaptureOptitrack::timeStamp() const
-  {
-    return timestamp_;
+    if (!pImpl->waitReadable(timeout)) {
+      return false;
+    }
+
+    // drain everything that is queued; a full batch means there may be
+    // more, and each batch is newer than the one before
+    size_t received;
+    size_t total = 0;
+    do {
+      received = pImpl->receiveBatch(bytes);
+      total += received;
+    } while (received == pImpl->datagrams.capacity());
+    if (total == 0) {
+      return false;
+    }
+
+    // decode the newest complete frame straight into frame_
+    pImpl->nextDatagram = pImpl->datagramCount;
+    for (size_t i = pImpl->datagramCount; i-- > 0; ) {
+      const uint64_t start = hostTime();
+      if (pImpl->decode(i, frame_)) {
+        recordParseTime(hostTime() - start);
+        TRACE_SPAN("decode", start);
+        recordReceived(bytes, total);
+        frameReceived(frame_);
+        return true;
+      }
+    }
+    return false;
   }
 
   MotionCaptureOptitrack::~MotionCaptureOptitrack()
   {
+    stopReceiveThread();
     delete pImpl;
   }
 
@@ -1,4 +1,6 @@
 #include "libmotioncapture/optitrack_closed_source.h"
+#include "frame_queue.h"
+#include "trace.h"
 
 #include <NatNetTypes.h>
 #include <NatNetCAPI.h>
@@ -12,22 +14,32 @@ namespace libmotioncapture {
 
   class MotionCaptureOptitrackClosedSourceImpl{
   public:
-    MotionCaptureOptitrackClosedSourceImpl()
-      : received(false)
+    MotionCaptureOptitrackClosedSourceImpl(
+      MotionCaptureOptitrackClosedSource* owner,
+      MemoryResource* resource)
+      : owner(owner)
+      , frame(resource)
+      , received(false)
+      , latest(resource)
+      , queue(64, resource)
     {
     }
 
     void FrameReceivedCallback(sFrameOfMocapData *data)
     {
-      // We can only receive data, if we can hold onto the data mutex to update the data structure
-      std::lock_guard<std::mutex> lk(data_m);
+      const uint64_t hostTimeStamp = hostTime();
+      std::lock_guard<std::mutex> decodeLk(decode_m);
+      const uint64_t start = hostTime();
+      frame.setHostTimeStamp(hostTimeStamp);
+      frame.setFrameNumber((uint32_t)data->iFrame);
 
       // update state
-      rigidBodies->clear();
+      frame.invalidate();
       for (size_t i = 0; i < data->nRigidBodies; ++i) {
         const auto& rb = data->RigidBodies[i];
-        if (rb.params & 0x01) {
-          const auto &def = rigidBodyDefinitions[rb.ID];
+        const auto iter = rigidBodyDefinitions.find(rb.ID);
+        if ((rb.params & 0x01) && iter != rigidBodyDefinitions.end()) {
+          const auto &def = iter->second;
 
           Eigen::Vector3f position(
               rb.x + def.xoffset,
@@ -40,44 +52,64 @@ namespace libmotioncapture {
               rb.qy, // y
               rb.qz  // z
           );
-          rigidBodies->emplace(def.name, RigidBody(def.name, position, rotation));
+          frame.setPose(def.slot, position, rotation);
         }
       }
 
-      pointcloud->resize(data->nOtherMarkers, Eigen::NoChange);
+      auto& pointcloud = frame.pointCloud();
+      pointcloud.resize(data->nOtherMarkers, Eigen::NoChange);
       for (size_t r = 0; r < data->nOtherMarkers; ++r)
       {
-        pointcloud->row(r) << 
+        pointcloud.row(r) << 
             data->OtherMarkers[r][0], 
             data->OtherMarkers[r][1], 
             data->OtherMarkers[r][2];
       }
 
-      latencies->clear();
+      auto& latencies = frame.latency();
+      latencies.clear();
       const uint64_t cameraLatencyTicks = data->CameraDataReceivedTimestamp - data->CameraMidExposureTimestamp;
       const double cameraLatencySeconds = cameraLatencyTicks / (double)clockFrequency;
-      latencies->emplace_back(LatencyInfo("Camera", cameraLatencySeconds));
+      latencies.emplace_back(LatencyInfo("Camera", cameraLatencySeconds));
 
       const uint64_t swLatencyTicks = data->TransmitTimestamp - data->CameraDataReceivedTimestamp;
       const double swLatencySeconds = swLatencyTicks / (double)clockFrequency;
-      latencies->emplace_back(LatencyInfo("Motive", swLatencySeconds));
+      latencies.emplace_back(LatencyInfo("Motive", swLatencySeconds));
 
       // convert actual shutter timestamp to microseconds
-      *timestamp = data->CameraMidExposureTimestamp * 1e6 / clockFrequency;
+      frame.setTimeStamp(data->CameraMidExposureTimestamp * 1e6 / clockFrequency);
 
-      // notify main thread of update
+      // invoke the frame callback right here on the NatNet thread
+      owner->recordParseTime(hostTime() - start);
+      TRACE_SPAN("decode", start);
+      owner->frameReceived(frame);
+
+      // notify receiving thread of update
       {
-        std::lock_guard<std::mutex> lk(cv_m);
+        std::lock_guard<std::mutex> lk(data_m);
+        if (owner->deliveryPolicy() != MotionCapture::DeliverLatest) {
+          if (!queue.push(frame)) {
+            owner->recordDropped(1);
+          }
+        }
+        // all frames have the same slots, so swapping hands over the data without copies
+        std::swap(frame, latest);
         received = true;
       }
       cv.notify_all();
     }
 
   public:
+    MotionCaptureOptitrackClosedSource* owner;
     NatNetClient client;
+
+    // protects frame and rigidBodyDefinitions; never taken by the consumer, so the frame callback
+    // runs without blocking it
+    std::mutex decode_m;
+    Frame frame; // written by the NatNet thread
+
     std::condition_variable cv;
-    std::mutex cv_m;
-    std::mutex data_m;
+    std::mutex data_m; // protects latest, queue and received
     bool received;
 
     uint64_t clockFrequency; // ticks/second for timestamps
@@ -89,13 +121,12 @@ namespace libmotioncapture {
       float xoffset;
       float yoffset;
       float zoffset;
+      size_t slot; // index into Frame
     };
     std::map<int, rigidBodyDefinition> rigidBodyDefinitions;
 
-    std::map<std::string, RigidBody>* rigidBodies;
-    PointCloud* pointcloud;
-    std::vector<LatencyInfo>* latencies;
-    uint64_t* timestamp;
+    Frame latest; // newest frame, handed over in receiveFrame()
+    FrameQueue queue; // frames not yet handed over (DeliverAll)
   };
 
   static void FrameReceivedCallback(sFrameOfMocapData *data, void *pUserData)
@@ -108,11 +139,7 @@ namespace libmotioncapture {
     const std::string &hostname,
     int port_command)
   {
-    pImpl = new MotionCaptureOptitrackClosedSourceImpl;
-    pImpl->rigidBodies = &rigidBodies_;
-    pImpl->pointcloud = &pointcloud_;
-    pImpl->latencies = &latencies_;
-    pImpl->timestamp = &timestamp_;
+    pImpl = new MotionCaptureOptitrackClosedSourceImpl(this, memoryResource_);
 
     ErrorCode err;
 
@@ -163,6 +190,8 @@ namespace libmotioncapture {
     {
       throw std::runtime_error("NatNetSDK Error " + std::to_string(err));
     }
+    std::lock_guard<std::mutex> decodeLk(pImpl->decode_m);
+    pImpl->frame.reserve(pDataDefs->nDataDescriptions);
     for (int i = 0; i < pDataDefs->nDataDescriptions; i++)
     {
       if (pDataDefs->arrDataDescriptions[i].type == Descriptor_RigidBody) {
@@ -174,8 +203,12 @@ namespace libmotioncapture {
         def.xoffset = pRB->offsetx;
         def.yoffset = pRB->offsety;
         def.zoffset = pRB->offsety;
+        def.slot = pImpl->frame.findOrAddBody(pRB->ID, pRB->szName, pImpl->frame.size());
       }
     }
+    std::lock_guard<std::mutex> lk(pImpl->data_m);
+    frame_ = pImpl->frame;
+    pImpl->latest = pImpl->frame;
   }
 
   const std::string & MotionCaptureOptitrackClosedSource::version() const
@@ -183,42 +216,30 @@ namespace libmotioncapture {
     // return pImpl->version;
   }
 
-  void MotionCaptureOptitrackClosedSource::waitForNextFrame()
+  bool MotionCaptureOptitrackClosedSource::receiveFrame(std::chrono::nanoseconds timeout)
   {
-    // unlock data mutex to allow asynchronous callback to update
-    pImpl->received = false;
-    pImpl->data_m.unlock();
-
     // wait for update
-    std::unique_lock<std::mutex> lk(pImpl->cv_m);
-    pImpl->cv.wait(lk, [this] { return pImpl->received; });
-    
-    // lock data mutex for user to use data safely
-    pImpl->data_m.lock();
-  }
-
-  const std::map<std::string, RigidBody>& MotionCaptureOptitrackClosedSource::rigidBodies() const
-  {
-    return rigidBodies_;
-  }
-
-  const PointCloud& MotionCaptureOptitrackClosedSource::pointCloud() const
-  {
-    return pointcloud_;
-  }
-
-  const std::vector<LatencyInfo> &MotionCaptureOptitrackClosedSource::latency() const
-  {
-    return latencies_;
-  }
+    std::unique_lock<std::mutex> lk(pImpl->data_m);
+    if (deliveryPolicy() != DeliverLatest) {
+      if (!pImpl->cv.wait_for(lk, timeout, [this] { return !pImpl->queue.empty(); })) {
+        return false;
+      }
+      pImpl->queue.pop(frame_, deliveryPolicy() == DeliverAllWithGapReport);
+      return true;
+    }
+    if (!pImpl->cv.wait_for(lk, timeout, [this] { return pImpl->received; })) {
+      return false;
+    }
+    pImpl->received = false;
 
-  uint64_t MotionCaptureOptitrackClosedSource::timeStamp() const
-  {
-    return timestamp_;
+    // both frames have the same slots, so swapping hands over the data without copies
+    std::swap(frame_, pImpl->latest);
+    return true;
   }
 
   MotionCaptureOptitrackClosedSource::~MotionCaptureOptitrackClosedSource()
   {
+    stopReceiveThread();
     delete pImpl;
   }
 
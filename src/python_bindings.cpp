@@ -5,6 +5,7 @@
 #include <pybind11/stl_bind.h>
 #include <pybind11/numpy.h>
 #include <pybind11/eigen.h>
+#include <pybind11/chrono.h>
 
 #include "libmotioncapture/motioncapture.h"
 
@@ -17,7 +18,7 @@ PYBIND11_MODULE(motioncapture, m) {
 
   m.attr("__version__") = version();
 
-  m.def("connect", &MotionCapture::connect);
+  m.def("connect", static_cast<MotionCapture* (*)(const std::string&, const std::map<std::string, std::string>&)>(&MotionCapture::connect));
 
   // Quaternions
   py::class_<Eigen::Quaternionf>(m, "Quaternion")
@@ -32,9 +33,27 @@ PYBIND11_MODULE(motioncapture, m) {
       .def_property_readonly("position", &RigidBody::position)
       .def_property_readonly("rotation", &RigidBody::rotation);
 
+  // Pose
+  py::class_<Pose>(m, "Pose")
+      .def_property_readonly("position", &Pose::position)
+      .def_property_readonly("rotation", &Pose::rotation)
+      .def_property_readonly("valid", &Pose::valid);
+
   //
-  py::class_<MotionCapture>(m, "MotionCapture")
-      .def("waitForNextFrame", &MotionCapture::waitForNextFrame, py::call_guard<py::gil_scoped_release>())
-      .def_property_readonly("rigidBodies", &MotionCapture::rigidBodies);
+  py::class_<MotionCapture> motionCapture(m, "MotionCapture");
+
+  py::enum_<MotionCapture::PredictionModel>(motionCapture, "PredictionModel")
+      .value("ConstantVelocity", MotionCapture::ConstantVelocity)
+      .value("ConstantAcceleration", MotionCapture::ConstantAcceleration);
+
+  motionCapture
+      .def("waitForNextFrame", static_cast<void (MotionCapture::*)()>(&MotionCapture::waitForNextFrame), py::call_guard<py::gil_scoped_release>())
+      .def("waitForNextFrame", static_cast<bool (MotionCapture::*)(std::chrono::nanoseconds)>(&MotionCapture::waitForNextFrame), py::call_guard<py::gil_scoped_release>())
+      .def("tryGetNextFrame", &MotionCapture::tryGetNextFrame)
+      .def("toHostTime", &MotionCapture::toHostTime)
+      .def("predictPose", &MotionCapture::predictPose, py::arg("handle"), py::arg("hostTimeNs"), py::arg("model") = MotionCapture::ConstantVelocity)
+      .def_property_readonly("rigidBodies", &MotionCapture::rigidBodies)
+      .def("resolve", &MotionCapture::resolve)
+      .def("pose", &MotionCapture::pose);
 
 }
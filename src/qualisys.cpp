@@ -3,12 +3,14 @@
 #include <cmath>
 
 #include "libmotioncapture/qualisys.h"
+#include "trace.h"
 
 // Qualisys
 #include "RTProtocol.h"
 
 #include <string>
 #include <sstream>
+#include <limits>
 
 namespace libmotioncapture {
 
@@ -50,6 +52,9 @@ namespace libmotioncapture {
     // Get 6DOF settings
     bool dataAvailable;
     pImpl->poRTProtocol.Read6DOFSettings(dataAvailable);
+    for (unsigned int i = 0; i < pImpl->poRTProtocol.Get6DOFBodyCount(); ++i) {
+      frame_.addBody(i, pImpl->poRTProtocol.Get6DOFBodyName(i));
+    }
 
     // Enable UDP streaming of selected component
     if (!pImpl->poRTProtocol.StreamFrames(CRTProtocol::RateAllFrames, 0, udpPort, NULL, pImpl->componentType)) {
@@ -70,6 +75,7 @@ namespace libmotioncapture {
 
   MotionCaptureQualisys::~MotionCaptureQualisys()
   {
+    stopReceiveThread();
     delete pImpl;
   }
 
@@ -78,92 +84,92 @@ namespace libmotioncapture {
     return pImpl->version;
   }
 
-  void MotionCaptureQualisys::waitForNextFrame()
+  Eigen::Quaternionf MotionCaptureQualisys::eulerToQuaternion(float rx, float ry, float rz)
+  {
+    Eigen::Matrix3f rotation;
+    rotation = Eigen::AngleAxisf((rx/180.0f)*M_PI, Eigen::Vector3f::UnitX())
+             * Eigen::AngleAxisf((ry/180.0f)*M_PI, Eigen::Vector3f::UnitY())
+             * Eigen::AngleAxisf((rz/180.0f)*M_PI, Eigen::Vector3f::UnitZ());
+    return Eigen::Quaternionf(rotation);
+  }
+
+  bool MotionCaptureQualisys::receiveFrame(std::chrono::nanoseconds timeout)
   {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
     CRTPacket::EPacketType packetType;
+    bool received = false; // the SDK's packet buffer holds a data packet
+    size_t datagrams = 0;
     do {
-      auto result = pImpl->poRTProtocol.Receive(packetType, true, -1);
-      if (result == CNetwork::ResponseType::success
-          && packetType == CRTPacket::PacketData) {
-        pImpl->pRTPacket = pImpl->poRTProtocol.GetRTPacket();
+      // the SDK takes the timeout in microseconds (as int); once a frame is
+      // received, DeliverLatest only polls for newer ones
+      auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+      remaining = std::min<long long>(std::max<long long>(remaining, 0), std::numeric_limits<int>::max());
+      CNetwork::ResponseType result;
+      {
+        TRACE_SCOPE("receive");
+        result = pImpl->poRTProtocol.Receive(packetType, true, received ? 0 : (int)remaining);
+      }
+      if (result == CNetwork::ResponseType::success) {
+        // every packet overwrites the buffer
+        received = packetType == CRTPacket::PacketData;
+        if (received) {
+          ++datagrams;
+          pImpl->pRTPacket = pImpl->poRTProtocol.GetRTPacket();
+          frame_.setHostTimeStamp(hostTime());
+          if (deliveryPolicy() != DeliverLatest) {
+            break;
+          }
+        }
+        continue;
+      }
+      if (received) {
         break;
       }
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return false;
+      }
     } while(true);
-  }
+    const uint64_t start = hostTime();
+    recordReceived(pImpl->pRTPacket->GetSize(), datagrams);
+    frame_.setFrameNumber(pImpl->pRTPacket->GetFrameNumber());
 
-  const std::map<std::string, RigidBody>& MotionCaptureQualisys::rigidBodies() const
-  {
+    // update frame
     float pos[3], rx, ry, rz;
 
-    rigidBodies_.clear();
+    frame_.invalidate();
     size_t count = pImpl->pRTPacket->Get6DOFEulerBodyCount();
 
     for(size_t i = 0; i < count; ++i) {
-      std::string name = std::string(pImpl->poRTProtocol.Get6DOFBodyName(i));
+      const char* name = pImpl->poRTProtocol.Get6DOFBodyName(i);
       pImpl->pRTPacket->Get6DOFEulerBody(i, pos[0], pos[1], pos[2], rx, ry, rz);
       if (!std::isnan(pos[0])) {
         Eigen::Vector3f position = Eigen::Vector3f(pos) / 1000.0;
 
-        Eigen::Matrix3f rotation;
-        rotation = Eigen::AngleAxisf((rx/180.0f)*M_PI, Eigen::Vector3f::UnitX())
-                 * Eigen::AngleAxisf((ry/180.0f)*M_PI, Eigen::Vector3f::UnitY())
-                 * Eigen::AngleAxisf((rz/180.0f)*M_PI, Eigen::Vector3f::UnitZ());
-        Eigen::Quaternionf quaternion = Eigen::Quaternionf(rotation);
+        Eigen::Quaternionf quaternion = eulerToQuaternion(rx, ry, rz);
 
-        rigidBodies_.emplace(name, RigidBody(name, position, quaternion));
-      }
-    }
-    return rigidBodies_;
-  }
-
-  RigidBody MotionCaptureQualisys::rigidBodyByName(const std::string &name) const
-  {
-    // Find object index
-    size_t bodyCount = pImpl->pRTPacket->Get6DOFEulerBodyCount();
-    size_t bodyId;
-    for (bodyId = 0; bodyId < bodyCount; ++bodyId) {
-      if (!strcmp(name.c_str(), pImpl->poRTProtocol.Get6DOFBodyName(bodyId))) {
-        break;
+        // the body index matches the slot unless the 6DOF settings changed
+        size_t slot = frame_.findOrAddBody(i, name, i);
+        frame_.setPose(slot, position, quaternion);
       }
     }
 
-    // If found, get object position
-    if (bodyId < bodyCount) {
-      float pos[3], rx, ry, rz;
-
-      pImpl->pRTPacket->Get6DOFEulerBody(bodyId, pos[0], pos[1], pos[2], rx, ry, rz);
-
-      if (!std::isnan(pos[0])) {
-        Eigen::Vector3f position = Eigen::Vector3f(pos) / 1000.0;
-
-        Eigen::Matrix3f rotation;
-        rotation = Eigen::AngleAxisf((rx/180.0f)*M_PI, Eigen::Vector3f::UnitX())
-                 * Eigen::AngleAxisf((ry/180.0f)*M_PI, Eigen::Vector3f::UnitY())
-                 * Eigen::AngleAxisf((rz/180.0f)*M_PI, Eigen::Vector3f::UnitZ());
-        Eigen::Quaternionf quaternion = Eigen::Quaternionf(rotation);
-
-        return RigidBody(name, position, quaternion);
-      }
-    }
-    throw std::runtime_error("Unknown rigid body!");
-  }
-
-  const PointCloud& MotionCaptureQualisys::pointCloud() const
-  {
-    size_t count = pImpl->pRTPacket->Get3DNoLabelsMarkerCount();
-    pointcloud_.resize(count, Eigen::NoChange);
+    auto& pointcloud = frame_.pointCloud();
+    count = pImpl->pRTPacket->Get3DNoLabelsMarkerCount();
+    pointcloud.resize(count, Eigen::NoChange);
     for(size_t i = 0; i < count; ++i) {
       float x, y, z;
       unsigned int nId;
       pImpl->pRTPacket->Get3DNoLabelsMarker(i, x, y, z, nId);
-      pointcloud_.row(i) << x / 1000.0, y / 1000.0, z / 1000.0;
+      pointcloud.row(i) << x / 1000.0, y / 1000.0, z / 1000.0;
     }
-    return pointcloud_;
-  }
 
-  uint64_t MotionCaptureQualisys::timeStamp() const
-  {
-    return pImpl->pRTPacket->GetTimeStamp();
+    frame_.setTimeStamp(pImpl->pRTPacket->GetTimeStamp());
+
+    recordParseTime(hostTime() - start);
+    TRACE_SPAN("decode", start);
+    frameReceived(frame_);
+    return true;
   }
 
 }
@@ -0,0 +1,208 @@
+#pragma once
+#include "libmotioncapture/motioncapture.h"
+
+#include <boost/asio.hpp>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <time.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+// Kernel receive timestamps and batched receives for the UDP sockets of the
+// OptiTrack and FZMotion backends (internal header).
+
+namespace libmotioncapture {
+
+  // Asks the kernel to timestamp datagrams on arrival (Linux only)
+  inline void enableReceiveTimestamps(boost::asio::ip::udp::socket& socket)
+  {
+#ifdef __linux__
+    int enable = 1;
+    setsockopt(socket.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+#endif
+  }
+
+#ifdef __linux__
+  // Returns the arrival time of a datagram received with recvmsg() at
+  // 'hostNow' (see hostTime()), using the kernel timestamp if present.
+  // 'realtimeNow' is CLOCK_REALTIME at about the same moment.
+  inline uint64_t kernelTimeStamp(
+    struct msghdr& msg,
+    const struct timespec& realtimeNow,
+    uint64_t hostNow)
+  {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        // the kernel stamps in CLOCK_REALTIME: shift the steady time by the
+        // age of the datagram instead of mixing clock domains
+        struct timespec stamp;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        int64_t age = (int64_t)(realtimeNow.tv_sec - stamp.tv_sec) * 1000000000LL + (realtimeNow.tv_nsec - stamp.tv_nsec);
+        if (age > 0 && (uint64_t)age < hostNow) {
+          return hostNow - age;
+        }
+      }
+    }
+    return hostNow;
+  }
+#endif
+
+  // Receives one datagram like socket.receive_from(). 'hostTimeStamp' is set
+  // to the arrival time (see hostTime()): the kernel timestamp if available,
+  // otherwise the current time. Returns 0 and sets 'ec' on failure.
+  inline size_t receiveTimestamped(
+    boost::asio::ip::udp::socket& socket,
+    void* data,
+    size_t size,
+    boost::asio::ip::udp::endpoint& sender,
+    uint64_t& hostTimeStamp,
+    boost::system::error_code& ec)
+  {
+#ifdef __linux__
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = sender.data();
+    msg.msg_namelen = sender.capacity();
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t length = ::recvmsg(socket.native_handle(), &msg, 0);
+    hostTimeStamp = hostTime();
+    if (length < 0) {
+      ec = boost::system::error_code(errno, boost::system::system_category());
+      return 0;
+    }
+    ec = boost::system::error_code();
+    sender.resize(msg.msg_namelen);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    hostTimeStamp = kernelTimeStamp(msg, now, hostTimeStamp);
+    return length;
+#else
+    size_t length = socket.receive_from(boost::asio::buffer(data, size), sender, 0, ec);
+    hostTimeStamp = hostTime();
+    return length;
+#endif
+  }
+
+  // Preallocated buffers to drain the datagrams queued on a socket. On Linux
+  // one recvmmsg() call fills the whole batch. All buffers are allocated
+  // from 'resource' (nullptr: heap).
+  class DatagramBatch
+  {
+  public:
+    template<typename T>
+    using Buffer = std::vector<T, ResourceAllocator<T> >;
+
+    DatagramBatch(size_t capacity, size_t datagramSize, MemoryResource* resource = nullptr)
+      : m_datagramSize(datagramSize)
+      , m_buffer(capacity * datagramSize, 0, ResourceAllocator<char>(resource))
+      , m_length(capacity, 0, ResourceAllocator<size_t>(resource))
+      , m_hostTimeStamp(capacity, 0, ResourceAllocator<uint64_t>(resource))
+#ifdef __linux__
+      , m_msgs(capacity, mmsghdr(), ResourceAllocator<struct mmsghdr>(resource))
+      , m_iov(capacity, iovec(), ResourceAllocator<struct iovec>(resource))
+      , m_names(capacity, sockaddr_storage(), ResourceAllocator<struct sockaddr_storage>(resource))
+      , m_control(capacity * CMSG_SPACE(sizeof(struct timespec)), 0, ResourceAllocator<char>(resource))
+#endif
+    {
+#ifdef __linux__
+      for (size_t i = 0; i < capacity; ++i) {
+        m_iov[i].iov_base = &m_buffer[i * datagramSize];
+        m_iov[i].iov_len = datagramSize;
+        memset(&m_msgs[i], 0, sizeof(m_msgs[i]));
+        m_msgs[i].msg_hdr.msg_name = &m_names[i];
+        m_msgs[i].msg_hdr.msg_iov = &m_iov[i];
+        m_msgs[i].msg_hdr.msg_iovlen = 1;
+        m_msgs[i].msg_hdr.msg_control = &m_control[i * CMSG_SPACE(sizeof(struct timespec))];
+      }
+#endif
+    }
+
+    // Receives up to capacity() datagrams that are already queued, without
+    // blocking. Returns the number of datagrams received; the buffers keep
+    // their previous contents if there were none.
+    size_t receive(
+      boost::asio::ip::udp::socket& socket,
+      boost::system::error_code& ec)
+    {
+      ec = boost::system::error_code();
+#ifdef __linux__
+      for (auto& msg : m_msgs) {
+        // the kernel overwrites these
+        msg.msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msg.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+      }
+      int count = ::recvmmsg(socket.native_handle(), m_msgs.data(), m_msgs.size(), MSG_DONTWAIT, nullptr);
+      const uint64_t hostNow = hostTime();
+      if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          ec = boost::system::error_code(errno, boost::system::system_category());
+        }
+        return 0;
+      }
+      struct timespec realtimeNow;
+      clock_gettime(CLOCK_REALTIME, &realtimeNow);
+      for (int i = 0; i < count; ++i) {
+        m_length[i] = m_msgs[i].msg_len;
+        m_hostTimeStamp[i] = kernelTimeStamp(m_msgs[i].msg_hdr, realtimeNow, hostNow);
+      }
+      return count;
+#else
+      size_t count = 0;
+      boost::asio::ip::udp::endpoint sender;
+      while (count < capacity() && socket.available() > 0) {
+        m_length[count] = receiveTimestamped(socket, &m_buffer[count * m_datagramSize], m_datagramSize, sender, m_hostTimeStamp[count], ec);
+        if (ec) {
+          return 0;
+        }
+        ++count;
+      }
+      return count;
+#endif
+    }
+
+    size_t capacity() const
+    {
+      return m_length.size();
+    }
+
+    const char* data(size_t i) const
+    {
+      return &m_buffer[i * m_datagramSize];
+    }
+
+    size_t length(size_t i) const
+    {
+      return m_length[i];
+    }
+
+    uint64_t hostTimeStamp(size_t i) const
+    {
+      return m_hostTimeStamp[i];
+    }
+
+  private:
+    size_t m_datagramSize;
+    Buffer<char> m_buffer;
+    Buffer<size_t> m_length;
+    Buffer<uint64_t> m_hostTimeStamp;
+#ifdef __linux__
+    Buffer<struct mmsghdr> m_msgs;
+    Buffer<struct iovec> m_iov;
+    Buffer<struct sockaddr_storage> m_names;
+    Buffer<char> m_control;
+#endif
+  };
+
+} // namespace libmotioncapture
@@ -0,0 +1,45 @@
+#include "libmotioncapture/stats.h"
+
+namespace libmotioncapture {
+
+  double Histogram::mean() const
+  {
+    if (count == 0) {
+      return 0;
+    }
+    return sum / (double)count;
+  }
+
+  uint64_t Histogram::quantile(double q) const
+  {
+    if (count == 0) {
+      return 0;
+    }
+    const double rank = q * count;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS - 1; ++i) {
+      seen += counts[i];
+      if (seen >= rank && seen > 0) {
+        const uint64_t upper = (2ULL << i) - 1;
+        return upper < max ? upper : max;
+      }
+    }
+    return max;
+  }
+
+  size_t Histogram::bucket(uint64_t value)
+  {
+    size_t i = 0;
+#if defined(__GNUC__)
+    if (value > 1) {
+      i = 63 - __builtin_clzll(value);
+    }
+#else
+    while (value >>= 1) {
+      ++i;
+    }
+#endif
+    return i < BUCKETS ? i : BUCKETS - 1;
+  }
+
+} // namespace libmotioncapture
@@ -0,0 +1,168 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace libmotioncapture {
+
+#ifdef ENABLE_TRACING
+  namespace {
+
+    // fields are atomics only so that writeChromeTrace() may read while the
+    // owner thread writes; relaxed accesses compile to plain moves
+    struct TraceEvent
+    {
+      std::atomic<const char*> name;
+      std::atomic<uint64_t> start;
+      std::atomic<uint64_t> duration;
+    };
+
+    // Ring of the newest spans of one thread. Only the owning thread writes.
+    // Readers copy the events and drop those that may have been overwritten
+    // during the copy.
+    struct TraceBuffer
+    {
+      enum { CAPACITY = 65536 };
+
+      explicit TraceBuffer(int tid)
+        : tid(tid)
+        , next(0)
+        , first(0)
+        , events(new TraceEvent[CAPACITY])
+      {
+      }
+
+      int tid;
+      std::atomic<uint64_t> next;  // index of the next span to write
+      std::atomic<uint64_t> first; // spans before were cleared
+      std::unique_ptr<TraceEvent[]> events;
+    };
+
+    struct TraceRegistry
+    {
+      std::mutex mutex; // protects buffers
+      std::vector<std::unique_ptr<TraceBuffer> > buffers;
+    };
+
+    TraceRegistry& registry()
+    {
+      static TraceRegistry instance;
+      return instance;
+    }
+
+    // Buffers are owned by the registry and outlive their thread, so spans
+    // of finished threads can still be written.
+    TraceBuffer* threadBuffer()
+    {
+      thread_local TraceBuffer* buffer = nullptr;
+      if (!buffer) {
+        TraceRegistry& r = registry();
+        std::lock_guard<std::mutex> lk(r.mutex);
+        r.buffers.emplace_back(new TraceBuffer((int)r.buffers.size() + 1));
+        buffer = r.buffers.back().get();
+      }
+      return buffer;
+    }
+
+  } // namespace
+
+  void traceSpan(const char* name, uint64_t start, uint64_t end)
+  {
+    TraceBuffer* buffer = threadBuffer();
+    const uint64_t i = buffer->next.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[i % TraceBuffer::CAPACITY];
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.duration.store(end - start, std::memory_order_relaxed);
+    buffer->next.store(i + 1, std::memory_order_release);
+  }
+
+  bool tracingEnabled()
+  {
+    return true;
+  }
+
+  bool writeChromeTrace(const std::string& filename)
+  {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool firstEvent = true;
+
+    struct Span
+    {
+      const char* name;
+      uint64_t start;
+      uint64_t duration;
+    };
+    std::vector<Span> spans;
+
+    TraceRegistry& r = registry();
+    std::lock_guard<std::mutex> lk(r.mutex);
+    for (const auto& buffer : r.buffers) {
+      const uint64_t end = buffer->next.load(std::memory_order_acquire);
+      uint64_t begin = buffer->first.load(std::memory_order_relaxed);
+      if (end > TraceBuffer::CAPACITY && end - TraceBuffer::CAPACITY > begin) {
+        begin = end - TraceBuffer::CAPACITY;
+      }
+      spans.clear();
+      for (uint64_t i = begin; i < end; ++i) {
+        const TraceEvent& event = buffer->events[i % TraceBuffer::CAPACITY];
+        Span span;
+        span.name = event.name.load(std::memory_order_relaxed);
+        span.start = event.start.load(std::memory_order_relaxed);
+        span.duration = event.duration.load(std::memory_order_relaxed);
+        spans.push_back(span);
+      }
+
+      // the owner may have overwritten the oldest spans in the meantime
+      const uint64_t written = buffer->next.load(std::memory_order_acquire);
+      size_t skip = 0;
+      if (written >= TraceBuffer::CAPACITY && written - TraceBuffer::CAPACITY + 1 > begin) {
+        skip = std::min<uint64_t>(written - TraceBuffer::CAPACITY + 1 - begin, spans.size());
+      }
+
+      fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+        firstEvent ? "" : ",\n", buffer->tid, buffer->tid);
+      firstEvent = false;
+      for (size_t i = skip; i < spans.size(); ++i) {
+        // Chrome trace times are in microseconds
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+          spans[i].name, buffer->tid, spans[i].start / 1e3, spans[i].duration / 1e3);
+      }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+  }
+
+  void clearTrace()
+  {
+    TraceRegistry& r = registry();
+    std::lock_guard<std::mutex> lk(r.mutex);
+    for (const auto& buffer : r.buffers) {
+      buffer->first.store(buffer->next.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+  }
+#else
+  bool tracingEnabled()
+  {
+    return false;
+  }
+
+  bool writeChromeTrace(const std::string& /*filename*/)
+  {
+    return false;
+  }
+
+  void clearTrace()
+  {
+  }
+#endif
+
+} // namespace libmotioncapture
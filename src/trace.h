@@ -0,0 +1,45 @@
+#pragma once
+#include "libmotioncapture/motioncapture.h"
+#include "libmotioncapture/trace.h"
+
+// Trace spans of the library internals (internal header), see
+// libmotioncapture/trace.h. TRACE_SCOPE("name") records the remainder of the
+// enclosing scope, TRACE_SPAN("name", start) the time since 'start' (see
+// hostTime()); 'name' must be a string literal. Both compile to nothing
+// unless ENABLE_TRACING is defined.
+
+namespace libmotioncapture {
+
+#ifdef ENABLE_TRACING
+  // appends a span to the buffer of the calling thread (lock-free)
+  void traceSpan(const char* name, uint64_t start, uint64_t end);
+
+  class TraceScope
+  {
+  public:
+    explicit TraceScope(const char* name)
+      : m_name(name)
+      , m_start(hostTime())
+    {
+    }
+
+    ~TraceScope()
+    {
+      traceSpan(m_name, m_start, hostTime());
+    }
+
+  private:
+    const char* m_name;
+    uint64_t m_start;
+  };
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) ::libmotioncapture::TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_SPAN(name, start) ::libmotioncapture::traceSpan(name, start, ::libmotioncapture::hostTime())
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_SPAN(name, start) do {} while (0)
+#endif
+
+} // namespace libmotioncapture
@@ -0,0 +1,126 @@
+#include "libmotioncapture/velocity_filter.h"
+
+namespace libmotioncapture {
+
+  // estimates of bodies that are not tracked for longer are dropped
+  static const uint32_t MAX_MISSED_FRAMES = 10;
+
+  // rotation from 'from' to 'to' in body coordinates, as axis * angle
+  static Eigen::Vector3f rotationVector(const Eigen::Quaternionf& from, const Eigen::Quaternionf& to)
+  {
+    Eigen::Quaternionf dq = from.conjugate() * to;
+    if (dq.w() < 0) {
+      dq.coeffs() = -dq.coeffs(); // shortest path
+    }
+    const Eigen::AngleAxisf aa(dq.normalized());
+    return aa.axis() * aa.angle();
+  }
+
+  static Eigen::Quaternionf quaternionExp(const Eigen::Vector3f& theta)
+  {
+    const float angle = theta.norm();
+    if (angle <= 0) {
+      return Eigen::Quaternionf::Identity();
+    }
+    return Eigen::Quaternionf(Eigen::AngleAxisf(angle, theta / angle));
+  }
+
+  VelocityFilter::VelocityFilter(
+    float alpha,
+    float beta)
+    : m_alpha(alpha)
+    , m_beta(beta)
+    , m_lastTime(0)
+  {
+  }
+
+  void VelocityFilter::reset()
+  {
+    m_lastTime = 0;
+    std::fill(m_active.begin(), m_active.end(), 0.0f);
+  }
+
+  void VelocityFilter::resize(size_t count)
+  {
+    for (size_t k = 0; k < 3; ++k) {
+      m_position[k].resize(count, 0);
+      m_velocity[k].resize(count, 0);
+    }
+    m_rotations.resize(count, Eigen::Quaternionf::Identity());
+    m_angularVelocities.resize(count, Eigen::Vector3f::Zero());
+    m_active.resize(count, 0);
+    m_missed.resize(count, 0);
+  }
+
+  void VelocityFilter::update(Frame& frame)
+  {
+    const size_t count = frame.size();
+    if (count == 0) {
+      return;
+    }
+    if (count > m_active.size()) {
+      resize(count);
+    }
+
+    const uint64_t time = frame.hostTimeStamp();
+    const float dt = (m_lastTime > 0 && time > m_lastTime) ? (time - m_lastTime) * 1e-9f : 0.0f;
+    m_lastTime = time;
+    const float a = m_alpha;
+    const float b = dt > 0 ? m_beta / dt : 0.0f;
+
+    const uint8_t* valid = frame.validFlags();
+    const Eigen::Vector3f* positions = frame.positions();
+    const float* active = m_active.data();
+
+    // translation: predict, then correct with the residual of tracked bodies
+    // (one pass per axis keeps the loops simple enough to vectorize)
+    for (size_t k = 0; k < 3; ++k) {
+      const float* measured = positions->data() + k;
+      float* p = m_position[k].data();
+      float* v = m_velocity[k].data();
+      for (size_t i = 0; i < count; ++i) {
+        const float gain = valid[i] * active[i];
+        const float predicted = p[i] + v[i] * dt;
+        const float residual = gain * (measured[3 * i] - predicted);
+        p[i] = predicted + a * residual;
+        v[i] += b * residual;
+      }
+    }
+
+    // rotation (per body) and bookkeeping
+    for (size_t i = 0; i < count; ++i) {
+      if (!valid[i]) {
+        if (m_active[i] > 0 && ++m_missed[i] > MAX_MISSED_FRAMES) {
+          m_active[i] = 0;
+        } else if (m_active[i] > 0) {
+          // coast like the translation
+          m_rotations[i] = m_rotations[i] * quaternionExp(m_angularVelocities[i] * dt);
+        }
+      } else if (m_active[i] > 0) {
+        m_missed[i] = 0;
+        const Eigen::Vector3f& w = m_angularVelocities[i];
+        const Eigen::Quaternionf predicted = m_rotations[i] * quaternionExp(w * dt);
+        const Eigen::Vector3f r = rotationVector(predicted, frame.rotation(i));
+        m_rotations[i] = (predicted * quaternionExp(a * r)).normalized();
+        m_angularVelocities[i] += b * r;
+      } else {
+        // (re-)acquired: start from rest
+        for (size_t k = 0; k < 3; ++k) {
+          m_position[k][i] = positions[i](k);
+          m_velocity[k][i] = 0;
+        }
+        m_rotations[i] = frame.rotation(i);
+        m_angularVelocities[i].setZero();
+        m_active[i] = 1;
+        m_missed[i] = 0;
+      }
+
+      if (m_active[i] > 0) {
+        frame.setVelocity(i, Eigen::Vector3f(m_velocity[0][i], m_velocity[1][i], m_velocity[2][i]), m_angularVelocities[i]);
+      } else {
+        frame.setVelocity(i, Eigen::Vector3f::Zero(), Eigen::Vector3f::Zero());
+      }
+    }
+  }
+
+} // namespace libmotioncapture
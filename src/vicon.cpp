@@ -1,4 +1,11 @@
 #include "libmotioncapture/vicon.h"
+#include "frame_queue.h"
+#include "trace.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 // VICON
 #include "ViconDataStreamSDK_CPP/DataStreamClient.h"
@@ -7,11 +14,61 @@ using namespace ViconDataStreamSDK::CPP;
 
 namespace libmotioncapture {
 
+  constexpr unsigned int BUFFER_SIZE_ALL = 100; // frames buffered by the SDK with DeliverAll
+
   class MotionCaptureViconImpl
   {
   public:
     Client client;
     std::string version;
+    bool enablePointcloud;
+
+    MotionCaptureVicon* owner;
+    // GetFrame() blocks until the server pushes a frame, so it is called on
+    // a thread of its own and receiveFrame() waits on that with a timeout
+    std::thread thread;
+    std::atomic<bool> running;
+    Frame frame; // written by 'thread'
+
+    std::mutex mtx; // protects latest, queue and received
+    std::condition_variable cv;
+    bool received;
+    Frame latest; // newest frame, handed over in receiveFrame()
+    FrameQueue queue; // frames not yet handed over (DeliverAll)
+
+    MotionCaptureViconImpl(MotionCaptureVicon* owner, MemoryResource* resource)
+      : owner(owner)
+      , running(false)
+      , frame(resource)
+      , received(false)
+      , latest(resource)
+      , queue(BUFFER_SIZE_ALL, resource)
+    {
+    }
+
+    ~MotionCaptureViconImpl()
+    {
+      if (thread.joinable()) {
+        running = false;
+        // makes a pending GetFrame() return
+        client.Disconnect();
+        thread.join();
+      }
+    }
+
+    void run()
+    {
+      while (running) {
+        if (client.GetFrame().Result != Result::Success) {
+          // e.g. not connected; do not spin
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          continue;
+        }
+        handleFrame();
+      }
+    }
+
+    void handleFrame();
   };
 
   MotionCaptureVicon::MotionCaptureVicon(
@@ -19,7 +76,8 @@ namespace libmotioncapture {
     bool enableObjects,
     bool enablePointcloud)
   {
-    pImpl = new MotionCaptureViconImpl;
+    pImpl = new MotionCaptureViconImpl(this, memoryResource_);
+    pImpl->enablePointcloud = enablePointcloud;
 
     // Try connecting...
     while (!pImpl->client.IsConnected().Connected) {
@@ -46,10 +104,14 @@ namespace libmotioncapture {
     std::stringstream sstr;
     sstr << version.Major << "." << version.Minor << "." << version.Point;
     pImpl->version = sstr.str();
+
+    pImpl->running = true;
+    pImpl->thread = std::thread(&MotionCaptureViconImpl::run, pImpl);
   }
 
   MotionCaptureVicon::~MotionCaptureVicon()
   {
+    stopReceiveThread();
     delete pImpl;
   }
 
@@ -58,20 +120,25 @@ namespace libmotioncapture {
     return pImpl->version;
   }
 
-  void MotionCaptureVicon::waitForNextFrame()
+  void MotionCaptureVicon::setDeliveryPolicy(DeliveryPolicy policy)
   {
-    while (pImpl->client.GetFrame().Result != Result::Success) {
-    }
+    MotionCapture::setDeliveryPolicy(policy);
+    pImpl->client.SetBufferSize(policy == DeliverLatest ? 1 : BUFFER_SIZE_ALL);
   }
 
-  const std::map<std::string, RigidBody>& MotionCaptureVicon::rigidBodies() const
+  void MotionCaptureViconImpl::handleFrame()
   {
-    rigidBodies_.clear();
-    size_t count = pImpl->client.GetSubjectCount().SubjectCount;
+    const uint64_t start = hostTime();
+    frame.setHostTimeStamp(start);
+    frame.setFrameNumber(client.GetFrameNumber().FrameNumber);
+
+    // update frame
+    frame.invalidate();
+    size_t count = client.GetSubjectCount().SubjectCount;
     for (size_t i = 0; i < count; ++i) {
-      auto const name = pImpl->client.GetSubjectName(i).SubjectName;
-      auto const translation = pImpl->client.GetSegmentGlobalTranslation(name, name);
-      auto const quaternion = pImpl->client.GetSegmentGlobalRotationQuaternion(name, name);
+      const std::string name = client.GetSubjectName(i).SubjectName;
+      auto const translation = client.GetSegmentGlobalTranslation(name, name);
+      auto const quaternion = client.GetSegmentGlobalRotationQuaternion(name, name);
       if (   translation.Result == Result::Success
           && quaternion.Result == Result::Success
           && !translation.Occluded
@@ -89,64 +156,75 @@ namespace libmotioncapture {
           quaternion.Rotation[2]  // z
           );
 
-        rigidBodies_.emplace(name, RigidBody(name, position, rotation));
+        // subjects are usually reported in the same order, so slot i is checked first
+        size_t slot = frame.findOrAddBody(i, name.c_str(), i);
+        frame.setPose(slot, position, rotation);
       }
     }
-    return rigidBodies_;
-  }
 
-  RigidBody MotionCaptureVicon::rigidBodyByName(
-    const std::string& name) const
-  {
-    auto const translation = pImpl->client.GetSegmentGlobalTranslation(name, name);
-    auto const quaternion = pImpl->client.GetSegmentGlobalRotationQuaternion(name, name);
-    if (   translation.Result == Result::Success
-        && quaternion.Result == Result::Success
-        && !translation.Occluded
-        && !quaternion.Occluded) {
-
-      Eigen::Vector3f position(
-        translation.Translation[0] / 1000.0,
-        translation.Translation[1] / 1000.0,
-        translation.Translation[2] / 1000.0);
-
-      Eigen::Quaternionf rotation(
-        quaternion.Rotation[3], // w
-        quaternion.Rotation[0], // x
-        quaternion.Rotation[1], // y
-        quaternion.Rotation[2]  // z
-        );
-
-      return RigidBody(name, position, rotation);
+    auto& pointcloud = frame.pointCloud();
+    if (enablePointcloud) {
+      size_t count = client.GetUnlabeledMarkerCount().MarkerCount;
+      pointcloud.resize(count, Eigen::NoChange);
+      for(size_t i = 0; i < count; ++i) {
+        Output_GetUnlabeledMarkerGlobalTranslation translation =
+          client.GetUnlabeledMarkerGlobalTranslation(i);
+        pointcloud.row(i) << 
+          translation.Translation[0] / 1000.0,
+          translation.Translation[1] / 1000.0,
+          translation.Translation[2] / 1000.0;
+      }
     }
-    throw std::runtime_error("Unknown rigid body!");
-  }
 
-  const PointCloud& MotionCaptureVicon::pointCloud() const
-  {
-    size_t count = pImpl->client.GetUnlabeledMarkerCount().MarkerCount;
-    pointcloud_.resize(count, Eigen::NoChange);
-    for(size_t i = 0; i < count; ++i) {
-      Output_GetUnlabeledMarkerGlobalTranslation translation =
-        pImpl->client.GetUnlabeledMarkerGlobalTranslation(i);
-      pointcloud_.row(i) << 
-        translation.Translation[0] / 1000.0,
-        translation.Translation[1] / 1000.0,
-        translation.Translation[2] / 1000.0;
+    auto& latencies = frame.latency();
+    latencies.clear();
+    size_t latencyCount = client.GetLatencySampleCount().Count;
+    for(size_t i = 0; i < latencyCount; ++i) {
+      std::string sampleName  = client.GetLatencySampleName(i).Name;
+      double      sampleValue = client.GetLatencySampleValue(sampleName).Value;
+      latencies.emplace_back(LatencyInfo(sampleName, sampleValue));
     }
-    return pointcloud_;
+
+    // invoke the frame callback right here, before the frame is handed over
+    // and without holding mtx
+    owner->recordParseTime(hostTime() - start);
+    TRACE_SPAN("decode", start);
+    owner->frameReceived(frame);
+
+    {
+      std::lock_guard<std::mutex> lck(mtx);
+      if (owner->deliveryPolicy() != MotionCapture::DeliverLatest) {
+        if (!queue.push(frame)) {
+          owner->recordDropped(1);
+        }
+      }
+      // subjects are added on the fly, so copy (rather than swap) to keep slots stable
+      latest = frame;
+      received = true;
+    }
+    cv.notify_all();
   }
 
-  const std::vector<LatencyInfo>& MotionCaptureVicon::latency() const
+  bool MotionCaptureVicon::receiveFrame(std::chrono::nanoseconds timeout)
   {
-    latencies_.clear();
-    size_t latencyCount = pImpl->client.GetLatencySampleCount().Count;
-    for(size_t i = 0; i < latencyCount; ++i) {
-      std::string sampleName  = pImpl->client.GetLatencySampleName(i).Name;
-      double      sampleValue = pImpl->client.GetLatencySampleValue(sampleName).Value;
-      latencies_.emplace_back(LatencyInfo(sampleName, sampleValue));
+    // wait for the receive thread to deliver a new frame
+    TRACE_SCOPE("receive");
+    std::unique_lock<std::mutex> lck(pImpl->mtx);
+    if (deliveryPolicy() != DeliverLatest) {
+      if (!pImpl->cv.wait_for(lck, timeout, [this] { return !pImpl->queue.empty(); })) {
+        return false;
+      }
+      pImpl->queue.pop(frame_, deliveryPolicy() == DeliverAllWithGapReport);
+      return true;
+    }
+    if (!pImpl->cv.wait_for(lck, timeout, [this] { return pImpl->received; })) {
+      return false;
     }
-    return latencies_;
+    pImpl->received = false;
+
+    // latest is overwritten as a whole by the next frame
+    std::swap(frame_, pImpl->latest);
+    return true;
   }
 
 }
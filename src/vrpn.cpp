@@ -1,4 +1,5 @@
 #include "libmotioncapture/vrpn.h"
+#include "trace.h"
 
 #include <unordered_map>
 #include <unordered_set>
@@ -21,43 +22,50 @@ namespace libmotioncapture {
   class MotionCaptureVrpnImpl
   {
   public:
-    static MotionCaptureVrpnImpl* instance;
+    // Pose of one tracker, updated by its change handler. Elements of an
+    // unordered_map keep their address, so they serve as handler user data.
+    struct Tracker
+    {
+      std::shared_ptr<vrpn_Tracker_Remote> remote;
+      vrpn_TRACKERCB pose;
+      bool updated = false;
+      size_t slot = 0; // slot hint for Frame::findOrAddBody()
+    };
+
     std::shared_ptr<vrpn_Connection> connection;
-    std::unordered_map<std::string, std::shared_ptr<vrpn_Tracker_Remote> > trackers;
-    std::unordered_map<std::string, vrpn_TRACKERCB> trackerData;
+    std::unordered_map<std::string, Tracker> trackers;
+    int senderCount = 0; // senders of the connection that were checked
     int updateFrequency;
+    uint64_t frameNumber = 0; // VRPN has no frames: count the delivered ones
 
     void updateTrackers()
     {
+      // senders are never removed, so only new ones need a look
       const char* name = nullptr;
-      for (int i = 0; (name = connection->sender_name(i)) != NULL; ++i) {
+      for (; (name = connection->sender_name(senderCount)) != NULL; ++senderCount) {
         if (trackers.count(name) == 0 && name_blacklist_.count(name) == 0)
         {
           std::cerr << "tracker: " << name << std::endl;
-          trackers.insert(std::make_pair(name,
-            std::make_shared<vrpn_Tracker_Remote>(name, connection.get())));
-
-          trackers[name]->register_change_handler((void*)name, &MotionCaptureVrpnImpl::handle_pose);
+          Tracker& tracker = trackers[name];
+          tracker.remote = std::make_shared<vrpn_Tracker_Remote>(name, connection.get());
+          tracker.remote->register_change_handler(&tracker, &MotionCaptureVrpnImpl::handle_pose);
         }
       }
     }
 
     static void VRPN_CALLBACK handle_pose(void *userData, const vrpn_TRACKERCB tracker_pose)
     {
-      // std::cerr << "pos " << (const char*)userData << tracker_pose.pos[0] << std::endl;
-      std::string name((const char*)userData);
-      instance->trackerData[name] = tracker_pose;
+      Tracker* tracker = static_cast<Tracker*>(userData);
+      tracker->pose = tracker_pose;
+      tracker->updated = true;
     }
   };
 
- MotionCaptureVrpnImpl*  MotionCaptureVrpnImpl::instance;
-
   MotionCaptureVrpn::MotionCaptureVrpn(
     const std::string& hostname,
     int updateFrequency)
   {
     pImpl = new MotionCaptureVrpnImpl;
-    pImpl->instance = pImpl;
     pImpl->updateFrequency = updateFrequency;
 
     pImpl->connection = std::shared_ptr<vrpn_Connection>(vrpn_get_connection_by_name(hostname.c_str()));
@@ -65,10 +73,11 @@ namespace libmotioncapture {
 
   MotionCaptureVrpn::~MotionCaptureVrpn()
   {
+    stopReceiveThread();
     delete pImpl;
   }
 
-  void MotionCaptureVrpn::waitForNextFrame()
+  bool MotionCaptureVrpn::receiveFrame(std::chrono::nanoseconds timeout)
   {
     // We use a fixed update frequency here, because VRPN is stateless
     // with respect to the active trackers. Since users might enable/disable
@@ -81,73 +90,65 @@ namespace libmotioncapture {
     auto elapsed = now - lastTime;
     auto desiredPeriod = std::chrono::milliseconds(1000 / pImpl->updateFrequency);
     if (elapsed < desiredPeriod) {
+      if (desiredPeriod - elapsed > timeout) {
+        std::this_thread::sleep_for(timeout);
+        return false;
+      }
       std::this_thread::sleep_for(desiredPeriod - elapsed);
     }
 
 
+    // the tracker callbacks decode the messages within mainloop()
+    const uint64_t start = hostTime();
     pImpl->updateTrackers();
-    pImpl->trackerData.clear();
+    for (auto& tracker : pImpl->trackers) {
+      tracker.second.updated = false;
+    }
     pImpl->connection->mainloop();
-    for (auto tracker : pImpl->trackers) {
-      tracker.second->mainloop();
+    for (auto& tracker : pImpl->trackers) {
+      tracker.second.remote->mainloop();
     }
+    frame_.setHostTimeStamp(hostTime());
+    frame_.setFrameNumber(++pImpl->frameNumber);
 
     // Note: This implementation does not support stamp per rigid body, but will assume that all rigid bodies have the same timestamp
-    for (const auto& data : pImpl->trackerData) {
-      struct timeval stamp = data.second.msg_time;
-      timestamp_ = stamp.tv_sec * 1000000ULL + stamp.tv_usec;
-
-      break;
+    for (const auto& tracker : pImpl->trackers) {
+      if (tracker.second.updated) {
+        struct timeval stamp = tracker.second.pose.msg_time;
+        frame_.setTimeStamp(stamp.tv_sec * 1000000ULL + stamp.tv_usec);
+        break;
+      }
     }
     lastTime = now;
-  }
-
-  const std::map<std::string, RigidBody>& MotionCaptureVrpn::rigidBodies() const
-  {
-    rigidBodies_.clear();
-    for (const auto& data : pImpl->trackerData) {
-      Eigen::Vector3f position(
-        data.second.pos[0],
-        data.second.pos[1],
-        data.second.pos[2]);
-
-      Eigen::Quaternionf rotation(
-        data.second.quat[3], // w
-        data.second.quat[0], // x
-        data.second.quat[1], // y
-        data.second.quat[2]  // z
-        );
-
-      rigidBodies_.emplace(data.first, RigidBody(data.first, position, rotation));
-    }
-    return rigidBodies_;
-  }
-
-  RigidBody MotionCaptureVrpn::rigidBodyByName(const std::string &name) const
-  {
-    const auto data = pImpl->trackerData.find(name);
-    if (data != pImpl->trackerData.end()) {
 
+    // update frame
+    frame_.invalidate();
+    for (auto& data : pImpl->trackers) {
+      auto& tracker = data.second;
+      if (!tracker.updated) {
+        continue;
+      }
       Eigen::Vector3f position(
-        data->second.pos[0],
-        data->second.pos[1],
-        data->second.pos[2]);
+        tracker.pose.pos[0],
+        tracker.pose.pos[1],
+        tracker.pose.pos[2]);
 
       Eigen::Quaternionf rotation(
-        data->second.quat[3], // w
-        data->second.quat[0], // x
-        data->second.quat[1], // y
-        data->second.quat[2]  // z
+        tracker.pose.quat[3], // w
+        tracker.pose.quat[0], // x
+        tracker.pose.quat[1], // y
+        tracker.pose.quat[2]  // z
         );
 
-      return RigidBody(name, position, rotation);
+      // VRPN has no numeric IDs, so the slot index is used as ID
+      tracker.slot = frame_.findOrAddBody(frame_.size(), data.first.c_str(), tracker.slot);
+      frame_.setPose(tracker.slot, position, rotation);
     }
-    throw std::runtime_error("Unknown rigid body!");
-  }
 
-  uint64_t MotionCaptureVrpn::timeStamp() const
-  {
-    return timestamp_;
+    recordParseTime(hostTime() - start);
+    TRACE_SPAN("decode", start);
+    frameReceived(frame_);
+    return true;
   }
 
 }